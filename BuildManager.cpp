@@ -3,143 +3,1180 @@
 // https://third-bit.com/sdxpy/build/
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <set>
 #include <map>
 
+// requires: /std:c++17
+#include <filesystem>
+
+// OpenSSL, for the digests of cached outputs (see FindDuplicateFiles.cpp)
+#include <openssl/evp.h>
+
+#include "MappedFile.h"
+
 using namespace std;
 
-struct BuildTarget
-{
-    string name;
-    vector<string> depends;
-    string rule;
-    int timestamp = -1;
+struct BuildTarget
+{
+    string name;
+    vector<string> depends;
+    string rule;
+    int timestamp = -1;
+};
+
+typedef vector<BuildTarget> BuildConfig;
+
+class BuildManagerException : public exception {};
+class DuplicateTarget : public BuildManagerException {};
+class InvalidTargetName : public BuildManagerException {};
+class InvalidTargetRule : public BuildManagerException {};
+class UnknownDepend : public BuildManagerException {};
+class CircularDepends : public BuildManagerException {};
+
+// Thread pool where each worker has its own deque of tasks. A worker runs its
+// newest task first and, when its deque is empty, steals the oldest task of
+// another worker. Tasks submitted by a worker go to its own deque, others are
+// dealt out in turn.
+class WorkStealingPool
+{
+    struct alignas(64) Worker
+    {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<Worker> workers;
+    vector<thread> threads;
+    atomic<size_t> queued{ 0 };
+    atomic<size_t> pending{ 0 };     // queued or running
+    atomic<size_t> next_worker{ 0 };
+    mutex idle_lock;
+    condition_variable idle, finished;
+    bool stopping = false;
+
+    inline static thread_local WorkStealingPool *current_pool = nullptr;
+    inline static thread_local size_t current_worker = 0;
+
+public:
+    WorkStealingPool(size_t thread_count) : workers(max<size_t>(thread_count, 1))
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            threads.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        wait();
+        {
+            lock_guard<mutex> guard(idle_lock);
+            stopping = true;
+        }
+        idle.notify_all();
+        for (auto &worker : threads)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    void submit(function<void()> task)
+    {
+        size_t index = current_pool == this ? current_worker : next_worker++ % workers.size();
+        pending++;
+        {
+            lock_guard<mutex> guard(workers[index].lock);
+            workers[index].tasks.push_back(move(task));
+        }
+        queued++;
+        lock_guard<mutex> guard(idle_lock);
+        idle.notify_one();
+    }
+
+    // Until every task, including those submitted by tasks, has finished.
+    void wait()
+    {
+        unique_lock<mutex> guard(idle_lock);
+        finished.wait(guard, [&]() { return pending == 0; });
+    }
+
+private:
+    void work(size_t index)
+    {
+        current_pool = this;
+        current_worker = index;
+        while (true)
+        {
+            function<void()> task;
+            if (take(index, task))
+            {
+                task();
+                if (--pending == 0)
+                {
+                    lock_guard<mutex> guard(idle_lock);
+                    finished.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> guard(idle_lock);
+            idle.wait(guard, [&]() { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+            {
+                return;
+            }
+        }
+    }
+
+    bool take(size_t index, function<void()> &task)
+    {
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            Worker &worker = workers[(index + i) % workers.size()];
+            lock_guard<mutex> guard(worker.lock);
+            if (!worker.tasks.empty())
+            {
+                if (i == 0)
+                {
+                    task = move(worker.tasks.back());
+                    worker.tasks.pop_back();
+                }
+                else
+                {
+                    task = move(worker.tasks.front());
+                    worker.tasks.pop_front();
+                }
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct BuildOptions
+{
+    size_t jobs = 1;                // rules run at once, like make -j N
+    bool keep_going = false;        // like make -k: after a failure, build what doesn't depend on it
+};
+
+struct BuildReport
+{
+    vector<string> succeeded;       // targets in the order they finished
+    vector<string> failed;
+    vector<string> skipped;         // not run because of a failure
+    double elapsed_ms = 0;
+    double work_ms = 0;             // time spent in rules, summed
+    double critical_path_ms = 0;    // longest chain of rule times through the graph
+    vector<string> critical_path;   // its targets, prerequisites first
+
+    // Average number of rules running at once.
+    double parallelism() const
+    {
+        return elapsed_ms > 0 ? work_ms / elapsed_ms : 0;
+    }
+};
+
+// Runs a target's rule, returning false or throwing when it fails.
+typedef function<bool(const BuildTarget &)> RuleRunner;
+
+class BuildBase
+{
+protected:
+    // Targets numbered 0..n-1 in name order. The dependents of target i are
+    // dependents[first[i]] up to dependents[first[i + 1]] (compressed sparse rows),
+    // its depends are depends[depend_first[i]] up to depends[depend_first[i + 1]].
+    struct Graph
+    {
+        vector<const BuildTarget *> nodes;
+        vector<uint32_t> positions;     // of the nodes in the config
+        vector<uint32_t> first;
+        vector<uint32_t> dependents;
+        vector<uint32_t> in_degree;     // number of depends
+        vector<uint32_t> depend_first;
+        vector<uint32_t> depends;
+        vector<uint32_t> order;         // topological, empty until known
+    };
+
+    // Graph cache file: this header, then positions, first, dependents,
+    // depend_first, depends and order (when ordered) as uint32_t arrays, all
+    // in native byte order.
+    struct GraphCacheHeader
+    {
+        char magic[8];
+        uint64_t config_hash;
+        uint32_t count;
+        uint32_t edges;
+        uint32_t ordered;
+        uint32_t unused;
+    };
+
+    constexpr static char GRAPH_MAGIC[8] = { 'S', 'D', 'X', 'B', 'G', 'C', '0', '1' };
+
+public:
+    virtual ~BuildBase() = default;
+
+    // Given a cache_path, the checked graph is saved there and, while the
+    // names, rules and depends in the config stay the same, loaded from it
+    // instead of being checked and derived again. Timestamps aren't part of it.
+    BuildBase(BuildConfig config, const filesystem::path &cache_path = {}) : targets(move(config))
+    {
+        if (!cache_path.empty() && load_graph(cache_path))
+        {
+            return;
+        }
+        make_graph();
+        if (!cache_path.empty())
+        {
+            try
+            {
+                topo_order();
+            }
+            catch (const CircularDepends &)
+            {
+                // saved without an order, build() will throw
+            }
+            save_graph(cache_path);
+        }
+    }
+
+    bool graph_cached() const
+    {
+        return cached;
+    }
+
+    // 64-bit FNV-1a, seeded by starting from seed instead of the offset basis.
+    static uint64_t hash_bytes(string_view data, uint64_t seed = 0xcbf29ce484222325ull)
+    {
+        uint64_t hash = seed;
+        for (char c : data)
+        {
+            hash = (hash ^ (uint8_t)c) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    virtual vector<string> build()
+    {
+        vector<string> result; 
+        for (uint32_t i : topo_order())
+        {
+            if (needs_update(i))
+            {
+                result.push_back(graph.nodes[i]->rule);
+            }
+        }
+        return result;
+    }
+
+    // Runs the rules build() would return on options.jobs threads. A target is
+    // queued as soon as its last prerequisite has finished; targets that are up
+    // to date count as finished from the start. After a failure nothing more is
+    // started unless options.keep_going is set.
+    virtual BuildReport execute(const RuleRunner &run, const BuildOptions &options = {})
+    {
+        const vector<uint32_t> &order = topo_order();
+        size_t count = graph.nodes.size();
+        vector<uint32_t> waiting_on = graph.in_degree;
+        vector<bool> runs(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            runs[i] = needs_update(i);
+        }
+
+        enum class State { waiting, done, failed };
+        vector<State> states(count, State::waiting);
+        vector<double> durations(count, 0);
+        BuildReport report;
+        mutex lock;
+        bool stopped = false;
+        auto start = chrono::steady_clock::now();
+        WorkStealingPool pool(options.jobs);
+        function<void(size_t)> finish;
+        auto queue = [&](size_t i)
+        {
+            if (!runs[i])
+            {
+                finish(i);
+                return;
+            }
+            pool.submit([&, i]()
+            {
+                {
+                    lock_guard<mutex> guard(lock);
+                    if (stopped)
+                    {
+                        return;
+                    }
+                }
+                auto began = chrono::steady_clock::now();
+                bool ok;
+                try
+                {
+                    ok = run(*graph.nodes[i]);
+                }
+                catch (const exception &)
+                {
+                    ok = false;
+                }
+                double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - began).count();
+                lock_guard<mutex> guard(lock);
+                durations[i] = elapsed;
+                report.work_ms += elapsed;
+                if (ok)
+                {
+                    report.succeeded.push_back(graph.nodes[i]->name);
+                    built((uint32_t)i);
+                    finish(i);
+                }
+                else
+                {
+                    states[i] = State::failed;
+                    report.failed.push_back(graph.nodes[i]->name);
+                    stopped = stopped || !options.keep_going;
+                }
+            });
+        };
+        // called with lock held, or before any rule runs
+        finish = [&](size_t i)
+        {
+            states[i] = State::done;
+            if (stopped)
+            {
+                return;
+            }
+            for (uint32_t e = graph.first[i]; e < graph.first[i + 1]; e++)
+            {
+                if (--waiting_on[graph.dependents[e]] == 0)
+                {
+                    queue(graph.dependents[e]);
+                }
+            }
+        };
+        {
+            lock_guard<mutex> guard(lock);
+            for (size_t i = 0; i < count; i++)
+            {
+                if (graph.in_degree[i] == 0)
+                {
+                    queue(i);
+                }
+            }
+        }
+        pool.wait();
+        report.elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        for (size_t i = 0; i < count; i++)
+        {
+            if (states[i] == State::waiting)
+            {
+                report.skipped.push_back(graph.nodes[i]->name);
+            }
+        }
+        critical_path(graph, order, durations, report);
+        return report;
+    }
+
+protected:
+    BuildConfig targets;
+    Graph graph;
+    bool cached = false;
+
+    virtual bool needs_update(uint32_t id)
+    {
+        const BuildTarget &target = *graph.nodes[id];
+        if (target.timestamp == -1) // Forced update
+        {
+            return true;
+        }
+        for (uint32_t e = graph.depend_first[id]; e < graph.depend_first[id + 1]; e++)
+        {
+            if (target.timestamp < graph.nodes[graph.depends[e]]->timestamp)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Called by execute() after a target's rule succeeds.
+    virtual void built(uint32_t)
+    {
+    }
+
+    // Longest path through the graph weighted by how long each rule took.
+    static void critical_path(const Graph &graph, const vector<uint32_t> &order, const vector<double> &durations, BuildReport &report)
+    {
+        vector<double> start(graph.nodes.size(), 0);
+        vector<uint32_t> previous(graph.nodes.size(), UINT32_MAX);
+        uint32_t last = UINT32_MAX;
+        double longest = 0;
+        for (uint32_t i : order)
+        {
+            double finish = start[i] + durations[i];
+            for (uint32_t e = graph.first[i]; e < graph.first[i + 1]; e++)
+            {
+                uint32_t dependent = graph.dependents[e];
+                if (previous[dependent] == UINT32_MAX || finish > start[dependent])
+                {
+                    start[dependent] = finish;
+                    previous[dependent] = i;
+                }
+            }
+            if (last == UINT32_MAX || finish > longest)
+            {
+                last = i;
+                longest = finish;
+            }
+        }
+        report.critical_path_ms = longest;
+        for (uint32_t i = last; i != UINT32_MAX; i = previous[i])
+        {
+            report.critical_path.insert(report.critical_path.begin(), graph.nodes[i]->name);
+        }
+    }
+
+    void check(const BuildTarget &target, const unordered_map<string_view, uint32_t> &ids)
+    {
+        if (target.name.empty())
+        {
+            throw InvalidTargetName();
+        }
+        if (target.rule.empty())
+        {
+            throw InvalidTargetRule();
+        }
+        for (const string &depend : target.depends)
+        {
+            if (ids.count(depend) == 0)
+            {
+                throw UnknownDepend();
+            }
+        }
+    }
+
+    void make_graph()
+    {
+        uint32_t count = (uint32_t)targets.size();
+        unordered_map<string_view, uint32_t> ids;
+        ids.reserve(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!ids.emplace(targets[i].name, i).second)
+            {
+                throw DuplicateTarget();
+            }
+        }
+        for (const BuildTarget &target : targets)
+        {
+            check(target, ids);
+        }
+        graph.positions.resize(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            graph.positions[i] = i;
+        }
+        sort(graph.positions.begin(), graph.positions.end(), [&](uint32_t a, uint32_t b)
+        {
+            return targets[a].name < targets[b].name;
+        });
+        vector<uint32_t> renumbered(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            renumbered[graph.positions[i]] = i;
+        }
+        graph.first.assign(count + 1, 0);
+        graph.depend_first.assign(count + 1, 0);
+        graph.depends.clear();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            for (const string &depend : targets[graph.positions[i]].depends)
+            {
+                uint32_t id = renumbered[ids.at(depend)];
+                graph.depends.push_back(id);
+                graph.first[id + 1]++;
+            }
+            graph.depend_first[i + 1] = (uint32_t)graph.depends.size();
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            graph.first[i + 1] += graph.first[i];
+        }
+        graph.dependents.resize(graph.depends.size());
+        vector<uint32_t> next(graph.first.begin(), graph.first.end() - 1);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            for (uint32_t e = graph.depend_first[i]; e < graph.depend_first[i + 1]; e++)
+            {
+                graph.dependents[next[graph.depends[e]]++] = i;
+            }
+        }
+        graph.order.clear();
+        link_nodes();
+    }
+
+    // Fills in what the cache file leaves out.
+    void link_nodes()
+    {
+        size_t count = graph.positions.size();
+        graph.nodes.resize(count);
+        graph.in_degree.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            graph.nodes[i] = &targets[graph.positions[i]];
+            graph.in_degree[i] = graph.depend_first[i + 1] - graph.depend_first[i];
+        }
+    }
+
+    // Hashes what the graph is made of. Lengths go in ahead of strings so
+    // that moving bytes from one string to the next changes the hash.
+    uint64_t config_hash() const
+    {
+        uint64_t hash = hash_bytes(string_view(GRAPH_MAGIC, sizeof(GRAPH_MAGIC)));
+        auto add = [&](string_view data)
+        {
+            uint64_t size = data.size();
+            hash = hash_bytes(string_view((const char *)&size, sizeof(size)), hash);
+            hash = hash_bytes(data, hash);
+        };
+        for (const BuildTarget &target : targets)
+        {
+            add(target.name);
+            add(target.rule);
+            uint64_t depends = target.depends.size();
+            hash = hash_bytes(string_view((const char *)&depends, sizeof(depends)), hash);
+            for (const string &depend : target.depends)
+            {
+                add(depend);
+            }
+        }
+        return hash;
+    }
+
+    // False when the file is missing, was made from another config or
+    // doesn't hold a well formed graph.
+    bool load_graph(const filesystem::path &cache_path)
+    {
+        if (!filesystem::exists(cache_path))
+        {
+            return false;
+        }
+        MappedFile file(cache_path);
+        GraphCacheHeader header;
+        if (file.size() < sizeof(header))
+        {
+            return false;
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        if (memcmp(header.magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC)) != 0 || header.count != targets.size()
+            || header.ordered > 1 || header.config_hash != config_hash())
+        {
+            return false;
+        }
+        size_t count = header.count;
+        size_t edges = header.edges;
+        size_t words = count + 2 * (count + 1) + 2 * edges + (header.ordered ? count : 0);
+        if (file.size() != sizeof(header) + words * sizeof(uint32_t))
+        {
+            return false;
+        }
+        const char *next = file.data() + sizeof(header);
+        auto read = [&](vector<uint32_t> &array, size_t length, size_t limit)
+        {
+            array.resize(length);
+            if (length > 0)
+            {
+                memcpy(array.data(), next, length * sizeof(uint32_t));
+                next += length * sizeof(uint32_t);
+            }
+            return all_of(array.begin(), array.end(), [&](uint32_t value) { return value < limit; });
+        };
+        auto ascending = [&](const vector<uint32_t> &array)
+        {
+            return array.front() == 0 && array.back() == edges && is_sorted(array.begin(), array.end());
+        };
+        bool valid = read(graph.positions, count, count) && read(graph.first, count + 1, edges + 1) && ascending(graph.first)
+            && read(graph.dependents, edges, count) && read(graph.depend_first, count + 1, edges + 1) && ascending(graph.depend_first)
+            && read(graph.depends, edges, count) && read(graph.order, header.ordered ? count : 0, count);
+        if (!valid)
+        {
+            graph = Graph();
+            return false;
+        }
+        link_nodes();
+        cached = true;
+        return true;
+    }
+
+    void save_graph(const filesystem::path &cache_path) const
+    {
+        GraphCacheHeader header = {};
+        memcpy(header.magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC));
+        header.config_hash = config_hash();
+        header.count = (uint32_t)graph.nodes.size();
+        header.edges = (uint32_t)graph.depends.size();
+        header.ordered = graph.order.empty() ? 0 : 1;
+        filesystem::path temp_path = cache_path;
+        temp_path += ".tmp";
+        {
+            ofstream writer(temp_path, ios::binary);
+            writer.write((const char *)&header, sizeof(header));
+            for (const vector<uint32_t> *array : { &graph.positions, &graph.first, &graph.dependents, &graph.depend_first, &graph.depends, &graph.order })
+            {
+                writer.write((const char *)array->data(), array->size() * sizeof(uint32_t));
+            }
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, cache_path);
+    }
+
+    // Kahn's algorithm. Of the targets that are ready, the one with the greatest
+    // name goes first, so the order is the same on every run. Kept in the graph
+    // once found.
+    const vector<uint32_t> &topo_order()
+    {
+        if (!graph.order.empty() || graph.nodes.empty())
+        {
+            return graph.order;
+        }
+        vector<uint32_t> remaining = graph.in_degree;
+        vector<uint32_t> initial;
+        for (uint32_t i = 0; i < remaining.size(); i++)
+        {
+            if (remaining[i] == 0)
+            {
+                initial.push_back(i);
+            }
+        }
+        priority_queue<uint32_t> ready(less<uint32_t>(), move(initial));
+        vector<uint32_t> order;
+        order.reserve(remaining.size());
+        while (!ready.empty())
+        {
+            uint32_t next = ready.top();
+            ready.pop();
+            order.push_back(next);
+            for (uint32_t e = graph.first[next]; e < graph.first[next + 1]; e++)
+            {
+                if (--remaining[graph.dependents[e]] == 0)
+                {
+                    ready.push(graph.dependents[e]);
+                }
+            }
+        }
+        if (order.size() != remaining.size())
+        {
+            throw CircularDepends();
+        }
+        graph.order = move(order);
+        return graph.order;
+    }
+
+    vector<string> topo_sort()
+    {
+        vector<string> result;
+        result.reserve(graph.nodes.size());
+        for (uint32_t i : topo_order())
+        {
+            result.push_back(graph.nodes[i]->name);
+        }
+        return result;
+    }
+};
+
+// Fingerprints of the targets as of their last successful build, one
+// "<16 hex digits> <name>" line per target. Saved to a temp file that is then
+// renamed over the old one. A damaged line is skipped, which only makes its
+// target stale.
+class BuildDatabase
+{
+    filesystem::path file_path;
+    map<string, uint64_t> fingerprints;
+    bool changed = false;
+
+public:
+    BuildDatabase(const filesystem::path &file_path) : file_path(file_path)
+    {
+        ifstream reader(file_path);
+        string line;
+        while (getline(reader, line))
+        {
+            if (line.size() > 17 && line[16] == ' ' && line.find_first_not_of("0123456789abcdef") == 16)
+            {
+                fingerprints[line.substr(17)] = stoull(line.substr(0, 16), nullptr, 16);
+            }
+        }
+    }
+
+    // Saves what hasn't been saved, but a destructor can't report that it
+    // failed; callers that need to know call save() first.
+    ~BuildDatabase()
+    {
+        try
+        {
+            save();
+        }
+        catch (const exception &)
+        {
+        }
+    }
+
+    bool find(const string &name, uint64_t &fingerprint) const
+    {
+        auto found = fingerprints.find(name);
+        if (found == fingerprints.end())
+        {
+            return false;
+        }
+        fingerprint = found->second;
+        return true;
+    }
+
+    void set(const string &name, uint64_t fingerprint)
+    {
+        fingerprints[name] = fingerprint;
+        changed = true;
+    }
+
+    void save()
+    {
+        if (!changed)
+        {
+            return;
+        }
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp";
+        {
+            ofstream writer(temp_path);
+            for (const auto &[name, fingerprint] : fingerprints)
+            {
+                char hex[17];
+                snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fingerprint);
+                writer << hex << ' ' << name << '\n';
+            }
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, file_path);
+        changed = false;
+    }
+};
+
+// What a target's fingerprint covers of its own besides its rule, such as the
+// contents of the source file it names. Empty when there is nothing.
+typedef function<string(const BuildTarget &)> ContentReader;
+
+// Rebuilds by content instead of timestamps. A target's fingerprint hashes its
+// rule, what the reader returns for it and the fingerprints of its depends,
+// so a change anywhere below a target changes its fingerprint too. A target
+// is stale when its fingerprint differs from the one recorded in the build
+// database when it last built; execute() records the new one when its rule
+// succeeds. Fingerprints are taken once, on first use.
+class HashBuild : public BuildBase
+{
+    ContentReader read;
+    BuildDatabase database;
+    vector<uint64_t> fingerprints;
+    vector<bool> fingerprinted;
+
+public:
+    HashBuild(BuildConfig config, const filesystem::path &database_path, ContentReader read = nullptr, const filesystem::path &cache_path = {})
+        : BuildBase(move(config), cache_path), read(move(read)), database(database_path),
+        fingerprints(graph.nodes.size()), fingerprinted(graph.nodes.size())
+    {
+    }
+
+    uint64_t fingerprint(uint32_t id)
+    {
+        if (fingerprinted[id])
+        {
+            return fingerprints[id];
+        }
+        const BuildTarget &target = *graph.nodes[id];
+        uint64_t result = hash_bytes(target.rule);
+        if (read)
+        {
+            string content = read(target);
+            result = hash_bytes(content, result ^ content.size());
+        }
+        for (uint32_t e = graph.depend_first[id]; e < graph.depend_first[id + 1]; e++)
+        {
+            uint64_t value = fingerprint(graph.depends[e]);
+            result = hash_bytes(string_view((const char *)&value, sizeof(value)), result);
+        }
+        fingerprints[id] = result;
+        fingerprinted[id] = true;
+        return result;
+    }
+
+    void save()
+    {
+        database.save();
+    }
+
+protected:
+    bool needs_update(uint32_t id) override
+    {
+        uint64_t recorded;
+        return !database.find(graph.nodes[id]->name, recorded) || recorded != fingerprint(id);
+    }
+
+    void built(uint32_t id) override
+    {
+        database.set(graph.nodes[id]->name, fingerprint(id));
+    }
+};
+
+// Hex SHA-256 of an output's contents. Blobs are shared between machines
+// and checked against their digest when restored, so a 64-bit hash that
+// collides by accident or on purpose isn't enough.
+string content_digest(string_view data)
+{
+    unsigned char value[EVP_MAX_MD_SIZE];
+    unsigned int size;
+    if (!EVP_Digest(data.data(), data.size(), value, &size, EVP_sha256(), nullptr))
+    {
+        throw runtime_error("message digest failed");
+    }
+    string result;
+    for (unsigned int i = 0; i < size; i++)
+    {
+        char buffer[3];
+        snprintf(buffer, sizeof(buffer), "%02x", value[i]);
+        result += buffer;
+    }
+    return result;
+}
+
+// What an action left behind: the names of its outputs, relative to the
+// workspace, and the digests of their contents.
+struct ActionResult
+{
+    vector<pair<string, string>> outputs;
+};
+
+// Where cached actions are kept. Shaped like a remote cache: an action key
+// maps to a small ActionResult, and output contents are blobs stored under
+// their digest, so a networked store only has to move these two kinds of
+// records. Implementations must be safe to call from several threads.
+class ActionStore
+{
+public:
+    virtual ~ActionStore() = default;
+    virtual bool get_action(const string &key, ActionResult &result) = 0;
+    virtual void put_action(const string &key, const ActionResult &result) = 0;
+    virtual bool get_blob(const string &digest, string &data) = 0;
+    virtual bool has_blob(const string &digest) = 0;
+    virtual void put_blob(const string &digest, const string &data) = 0;
+};
+
+// Action store in a local directory, one file per record: ac/<key> holds
+// "<digest> <name>" lines and cas/<digest> the bytes of a blob. Files
+// are written under a temporary name and then renamed into place, so readers
+// never see half of one.
+class LocalActionStore : public ActionStore
+{
+    filesystem::path root;
+    atomic<uint64_t> temp_count{ 0 };
+
+public:
+    LocalActionStore(const filesystem::path &root) : root(root)
+    {
+        filesystem::create_directories(root / "ac");
+        filesystem::create_directories(root / "cas");
+    }
+
+    bool get_action(const string &key, ActionResult &result) override
+    {
+        ifstream reader(record_path("ac", key));
+        if (!reader)
+        {
+            return false;
+        }
+        result.outputs.clear();
+        string line;
+        while (getline(reader, line))
+        {
+            // the digest names a file in cas/, so it has to be just hex digits
+            if (line.size() <= DIGEST_SIZE + 1 || line[DIGEST_SIZE] != ' '
+                || line.find_first_not_of("0123456789abcdef") < DIGEST_SIZE)
+            {
+                return false;
+            }
+            result.outputs.push_back({ line.substr(DIGEST_SIZE + 1), line.substr(0, DIGEST_SIZE) });
+        }
+        return true;
+    }
+
+    void put_action(const string &key, const ActionResult &result) override
+    {
+        string contents;
+        for (const auto &[name, digest] : result.outputs)
+        {
+            contents += digest + ' ' + name + '\n';
+        }
+        write_record("ac", key, contents);
+    }
+
+    bool get_blob(const string &digest, string &data) override
+    {
+        ifstream reader(record_path("cas", digest), ios::binary);
+        if (!reader)
+        {
+            return false;
+        }
+        data.assign(istreambuf_iterator<char>(reader), istreambuf_iterator<char>());
+        return true;
+    }
+
+    bool has_blob(const string &digest) override
+    {
+        return filesystem::exists(record_path("cas", digest));
+    }
+
+    void put_blob(const string &digest, const string &data) override
+    {
+        write_record("cas", digest, data);
+    }
+
+private:
+    constexpr static size_t DIGEST_SIZE = 64;
+
+    filesystem::path record_path(const char *kind, const string &id) const
+    {
+        return root / kind / id;
+    }
+
+    void write_record(const char *kind, const string &id, const string &contents)
+    {
+        filesystem::path file_path = record_path(kind, id);
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp" + to_string(temp_count++);
+        {
+            ofstream writer(temp_path, ios::binary);
+            writer.write(contents.data(), contents.size());
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, file_path);
+    }
 };
 
-typedef vector<BuildTarget> BuildConfig;
+struct ActionCacheStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t uploaded = 0;        // actions stored after their rule ran
+    size_t restored_bytes = 0;
 
-class BuildManagerException : public exception {};
-class DuplicateTarget : public BuildManagerException {};
-class InvalidTargetName : public BuildManagerException {};
-class InvalidTargetRule : public BuildManagerException {};
-class UnknownDepend : public BuildManagerException {};
-class CircularDepends : public BuildManagerException {};
+    double hit_rate() const
+    {
+        return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+    }
+};
 
-class BuildBase
+// Names of the files a target's rule makes, relative to the workspace.
+typedef function<vector<string>(const BuildTarget &)> OutputLister;
+
+// HashBuild that looks up each stale target in an action store before running
+// its rule. The action key is a SHA-256 of the environment, the target's rule
+// and content and the action keys of its depends, so the same action in
+// another checkout or on another machine gets the same key, and unlike the
+// 64-bit fingerprint two different actions can't share one. On a
+// hit the outputs are restored into the workspace and the rule isn't run; on
+// a miss the rule runs and, if it succeeds, its outputs are stored. By default
+// a target's only output is the file named after it.
+class CachedBuild : public HashBuild
 {
+    ActionStore &store;
+    filesystem::path workspace;
+    string environment;
+    ContentReader read_content;
+    OutputLister outputs;
+    vector<string> keys;
+    mutex stats_lock;
+    ActionCacheStats cache_stats;
+
 public:
-    BuildBase(const BuildConfig &config)
+    CachedBuild(BuildConfig config, const filesystem::path &database_path, ActionStore &store, const filesystem::path &workspace,
+        const string &environment = "", ContentReader read = nullptr, OutputLister outputs = nullptr)
+        : HashBuild(move(config), database_path, read), store(store), workspace(workspace), environment(environment),
+        read_content(move(read)), outputs(move(outputs)), keys(graph.nodes.size())
+    {
+    }
+
+    // Each part is length-prefixed so parts can't run into each other.
+    const string &action_key(uint32_t id)
     {
-        for (const BuildTarget &target : config)
+        if (!keys[id].empty())
         {
-            if (targets.count(target.name) == 0)
-            {
-                targets[target.name] = target;
-            }
-            else
-            {
-                throw DuplicateTarget();
-            }
+            return keys[id];
         }
-        for (const BuildTarget &target : config)
+        const BuildTarget &target = *graph.nodes[id];
+        string input;
+        auto add = [&](string_view part)
         {
-            check(target);
+            uint64_t size = part.size();
+            input.append((const char *)&size, sizeof(size));
+            input += part;
+        };
+        add(environment);
+        add(target.rule);
+        add(read_content ? read_content(target) : string());
+        for (uint32_t e = graph.depend_first[id]; e < graph.depend_first[id + 1]; e++)
+        {
+            add(action_key(graph.depends[e]));
         }
+        keys[id] = content_digest(input);
+        return keys[id];
     }
 
-    virtual vector<string> build()
+    BuildReport execute(const RuleRunner &run, const BuildOptions &options = {}) override
     {
-        vector<string> result; 
-        vector<string> ordered = topo_sort();
-        for (const string &target : ordered)
+        // keys are found up front, rules run on several threads
+        vector<string> target_keys(targets.size());
+        for (uint32_t id = 0; id < graph.nodes.size(); id++)
         {
-            auto &current = targets[target];
-            bool needs_update = false;
-            if (current.timestamp == -1) // Forced update
-            {
-                needs_update = true;
-            }
-            else
+            target_keys[graph.positions[id]] = action_key(id);
+        }
+        return BuildBase::execute([&](const BuildTarget &target)
+        {
+            const string &key = target_keys[&target - targets.data()];
+            if (restore(key))
             {
-                for (const string &depend : current.depends)
-                {
-                    if (current.timestamp < targets[depend].timestamp)
-                    {
-                        needs_update = true;
-                        break;
-                    }
-                }
+                return true;
             }
-            if (needs_update)
+            if (!run(target))
             {
-                result.push_back(current.rule);
+                return false;
             }
-        }
-        return result;
+            upload(target, key);
+            return true;
+        }, options);
     }
 
-protected:
-    map<string, BuildTarget> targets;
+    ActionCacheStats stats()
+    {
+        lock_guard<mutex> guard(stats_lock);
+        return cache_stats;
+    }
 
-    void check(const BuildTarget &target)
+private:
+    vector<string> output_names(const BuildTarget &target) const
     {
-        if (target.name.empty())
-        {
-            throw InvalidTargetName();
-        }
-        if (target.rule.empty())
+        return outputs ? outputs(target) : vector<string>{ target.name };
+    }
+
+    static bool inside_workspace(const string &name)
+    {
+        filesystem::path path(name);
+        if (name.empty() || path.has_root_path())
         {
-            throw InvalidTargetRule();
+            return false;
         }
-        for (const string &depend : target.depends)
+        for (const auto &part : path)
         {
-            if (targets.count(depend) == 0)
+            if (part == "..")
             {
-                throw UnknownDepend();
+                return false;
             }
         }
+        return true;
     }
 
-    vector<string> topo_sort()
+    // The store may be shared or damaged, so a record that would write
+    // outside the workspace or a blob that doesn't match its digest is a miss.
+    bool restore(const string &key)
     {
-        vector<string> result;
-        map<string, set<string>> graph;
-        for (const auto &[name, target] : targets)
+        ActionResult result;
+        vector<string> blobs;
+        bool found = store.get_action(key, result);
+        for (size_t i = 0; found && i < result.outputs.size(); i++)
         {
-            graph[name] = {};
-            for (const string &depend : target.depends)
-            {
-                graph[name].emplace(depend);
-            }
+            blobs.emplace_back();
+            found = inside_workspace(result.outputs[i].first)
+                && store.get_blob(result.outputs[i].second, blobs.back())
+                && content_digest(blobs.back()) == result.outputs[i].second;
         }
-        while (!graph.empty())
+        size_t bytes = 0;
+        for (size_t i = 0; found && i < blobs.size(); i++)
         {
-            string next;
-            for (const auto &[target, depends] : graph)
+            filesystem::path file_path = workspace / result.outputs[i].first;
+            if (file_path.has_parent_path())
             {
-                if (depends.size() == 0)
-                {
-                    next = target;
-                }
+                filesystem::create_directories(file_path.parent_path());
             }
-            if (!next.empty())
+            ofstream writer(file_path, ios::binary);
+            writer.write(blobs[i].data(), blobs[i].size());
+            found = (bool)writer;
+            bytes += blobs[i].size();
+        }
+        lock_guard<mutex> guard(stats_lock);
+        if (found)
+        {
+            cache_stats.hits++;
+            cache_stats.restored_bytes += bytes;
+        }
+        else
+        {
+            cache_stats.misses++;
+        }
+        return found;
+    }
+
+    // A rule that didn't make all of its outputs isn't cached.
+    void upload(const BuildTarget &target, const string &key)
+    {
+        ActionResult result;
+        for (const string &name : output_names(target))
+        {
+            ifstream reader(workspace / name, ios::binary);
+            if (!reader)
             {
-                for (auto &[target, depends]: graph)
-                {
-                    depends.erase(next);
-                }
-                graph.erase(next);
-                result.push_back(next);
+                return;
             }
-            else if (!graph.empty())
+            string data(istreambuf_iterator<char>(reader), (istreambuf_iterator<char>()));
+            string digest = content_digest(data);
+            if (!store.has_blob(digest))
             {
-                throw CircularDepends();
+                store.put_blob(digest, data);
             }
+            result.outputs.push_back({ name, digest });
         }
-        return result;
+        store.put_action(key, result);
+        lock_guard<mutex> guard(stats_lock);
+        cache_stats.uploaded++;
     }
 };
 
@@ -214,11 +1251,582 @@ void test_timestamps()
     assert(result == expect);
 }
 
+void test_execute()
+{
+    BuildConfig diamond = { { "A", {"B", "C"}, "build A" }, { "B", {"D"}, "build B" }, { "C", {"D"}, "build C" }, { "D", {}, "build D" } };
+    {
+        BuildBase base(diamond);
+        mutex lock;
+        vector<string> rules;
+        BuildReport report = base.execute([&](const BuildTarget &target)
+        {
+            lock_guard<mutex> guard(lock);
+            rules.push_back(target.rule);
+            return true;
+        }, { 4 });
+        assert(rules.size() == 4 && rules.front() == "build D" && rules.back() == "build A");
+        assert(report.succeeded.size() == 4 && report.failed.empty() && report.skipped.empty());
+        assert(report.critical_path.size() == 3 && report.critical_path.front() == "D" && report.critical_path.back() == "A");
+    }
+
+    // independent rules run side by side
+    BuildConfig wide = { { "all", {"w", "x", "y", "z"}, "link" } };
+    for (string name : { "w", "x", "y", "z" })
+    {
+        wide.push_back({ name, {}, "compile " + name });
+    }
+    // count the rules in flight rather than time them, a loaded machine can
+    // stretch any sleep
+    atomic<int> running{ 0 };
+    atomic<int> most_running{ 0 };
+    auto sleeper = [&](const BuildTarget &)
+    {
+        int now = ++running;
+        for (int most = most_running; most < now && !most_running.compare_exchange_weak(most, now);)
+        {
+        }
+        this_thread::sleep_for(chrono::milliseconds(40));
+        running--;
+        return true;
+    };
+    {
+        BuildBase base(wide);
+        BuildReport report = base.execute(sleeper, { 4 });
+        assert(report.succeeded.size() == 5 && report.succeeded.back() == "all");
+        assert(most_running > 1);
+        assert(report.critical_path.size() == 2 && report.critical_path.back() == "all" && report.critical_path_ms >= 80);
+    }
+    {
+        most_running = 0;
+        BuildBase base(wide);
+        BuildReport report = base.execute(sleeper, { 1 });
+        assert(most_running == 1 && report.elapsed_ms >= 200);
+    }
+
+    // a failed rule's dependents never run, with or without keep_going
+    BuildConfig broken = { { "F", {}, "fail" }, { "G", {"F"}, "build G" }, { "H", {}, "build H" }, { "I", {"H"}, "build I" } };
+    auto fail_f = [](const BuildTarget &target)
+    {
+        if (target.rule == "throw")
+        {
+            throw runtime_error("rule threw");
+        }
+        return target.rule != "fail";
+    };
+    {
+        BuildBase base(broken);
+        BuildReport report = base.execute(fail_f, { 1 });
+        assert(report.failed == vector<string>({ "F" }));
+        assert(count(report.skipped.begin(), report.skipped.end(), "G") == 1);
+        assert(report.succeeded.size() + report.skipped.size() == 3);
+    }
+    {
+        broken[0].rule = "throw";
+        BuildBase base(broken);
+        BuildReport report = base.execute(fail_f, { 2, true });
+        assert(report.failed == vector<string>({ "F" }));
+        assert(report.skipped == vector<string>({ "G" }));
+        assert(report.succeeded == vector<string>({ "H", "I" }));
+    }
+
+    // up to date targets aren't run
+    {
+        BuildBase base({ { "A", {"B", "C"}, "build A", 0 }, { "B", {"D"}, "build B", 0 }, { "C", {"D"}, "build C", 1 }, { "D", {}, "build D", 1 } });
+        BuildReport report = base.execute([](const BuildTarget &) { return true; }, { 2 });
+        assert(report.succeeded == vector<string>({ "B", "A" }));
+    }
+}
+
+// The map-of-sets topo_sort that BuildBase used before, kept to compare against.
+vector<string> quadratic_topo_sort(const BuildConfig &config)
+{
+    vector<string> result;
+    map<string, set<string>> graph;
+    for (const auto &target : config)
+    {
+        graph[target.name] = set<string>(target.depends.begin(), target.depends.end());
+    }
+    while (!graph.empty())
+    {
+        string next;
+        for (const auto &[target, depends] : graph)
+        {
+            if (depends.size() == 0)
+            {
+                next = target;
+            }
+        }
+        if (next.empty())
+        {
+            throw CircularDepends();
+        }
+        for (auto &[target, depends] : graph)
+        {
+            depends.erase(next);
+        }
+        graph.erase(next);
+        result.push_back(next);
+    }
+    return result;
+}
+
+// Each target depends on up to three random targets made before it.
+BuildConfig synthetic_build(size_t count, unsigned seed)
+{
+    mt19937 random(seed);
+    BuildConfig config;
+    config.reserve(count);
+    auto name = [](size_t i)
+    {
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "t%07zu", i);
+        return string(buffer);
+    };
+    for (size_t i = 0; i < count; i++)
+    {
+        BuildTarget target{ name(i), {}, "build " + name(i) };
+        for (size_t d = 0; i > 0 && d < 3; d++)
+        {
+            string depend = name(random() % i);
+            if (find(target.depends.begin(), target.depends.end(), depend) == target.depends.end())
+            {
+                target.depends.push_back(depend);
+            }
+        }
+        config.push_back(move(target));
+    }
+    return config;
+}
+
+struct TopoSortBuild : BuildBase
+{
+    using BuildBase::BuildBase;
+    using BuildBase::topo_sort;
+};
+
+void sweep_topo_sort()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+#else
+    vector<size_t> sizes = { 1000, 10000, 100000 };
+#endif
+    const size_t quadratic_limit = 10000;
+
+    cout << "topo_sort on synthetic graphs, up to 3 depends per target (times are in ms)" << endl;
+    cout << "targets\tkahn\tquadratic\tspeedup" << endl;
+    for (auto size : sizes)
+    {
+        BuildConfig config = synthetic_build(size, 1);
+        TopoSortBuild base(config);
+        auto start = chrono::steady_clock::now();
+        vector<string> order = base.topo_sort();
+        double kahn = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        cout << size << "\t" << kahn;
+        if (size <= quadratic_limit)
+        {
+            start = chrono::steady_clock::now();
+            vector<string> expect = quadratic_topo_sort(config);
+            double quadratic = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            assert(order == expect);
+            cout << "\t" << quadratic << "\t" << quadratic / kahn;
+        }
+        cout << endl;
+    }
+}
+
+void test_topo_sort_matches_quadratic()
+{
+    for (unsigned seed = 1; seed <= 5; seed++)
+    {
+        BuildConfig config = synthetic_build(300, seed);
+        TopoSortBuild base(config);
+        assert(base.topo_sort() == quadratic_topo_sort(config));
+    }
+}
+
+void test_hash_build()
+{
+    filesystem::path dir = filesystem::temp_directory_path().append("sdbxbuild");
+    filesystem::remove_all(dir);
+    filesystem::create_directory(dir);
+    filesystem::path database_path = dir / "build.db";
+    auto write = [&](const string &name, const string &content)
+    {
+        ofstream(dir / name) << content;
+    };
+    auto read = [&](const BuildTarget &target)
+    {
+        ifstream reader(dir / target.name);
+        return string(istreambuf_iterator<char>(reader), istreambuf_iterator<char>());
+    };
+    BuildConfig config = {
+        { "prog", {"a.o", "b.o"}, "link prog" },
+        { "a.o", {"a.c"}, "cc a.c" },
+        { "b.o", {"b.c"}, "cc b.c" },
+        { "a.c", {}, "source" },
+        { "b.c", {}, "source" },
+    };
+    auto rebuilt = [&](const BuildConfig &config, const string &failing = "")
+    {
+        HashBuild build(config, database_path, read);
+        BuildReport report = build.execute([&](const BuildTarget &target) { return target.name != failing; }, { 2 });
+        set<string> result(report.succeeded.begin(), report.succeeded.end());
+        result.insert(report.failed.begin(), report.failed.end());
+        return result;
+    };
+    write("a.c", "int a;");
+    write("b.c", "int b;");
+    assert(rebuilt(config).size() == 5);
+    assert(rebuilt(config).empty());
+
+    // new timestamps, same contents
+    write("a.c", "int a;");
+    for (auto &target : config)
+    {
+        target.timestamp = 100;
+    }
+    assert(rebuilt(config).empty());
+
+    // a changed source rebuilds everything above it and nothing else
+    write("a.c", "int a = 1;");
+    assert(rebuilt(config) == set<string>({ "a.c", "a.o", "prog" }));
+    config[2].rule = "cc -O2 b.c";
+    assert(rebuilt(config) == set<string>({ "b.o", "prog" }));
+
+    // a failed target isn't recorded, so it and what depends on it are tried again
+    write("b.c", "int b = 2;");
+    assert(rebuilt(config, "b.o") == set<string>({ "b.c", "b.o" }));
+    assert(rebuilt(config) == set<string>({ "b.o", "prog" }));
+    assert(rebuilt(config).empty());
+
+    // damaged lines in the database are skipped instead of failing the build
+    ofstream(database_path, ios::app) << "zzzzzzzzzzzzzzzz a.o\nshort\n0123456789abcdeg prog\n";
+    assert(rebuilt(config).empty());
+
+    // build() lists the same stale rules
+    write("b.c", "int b = 3;");
+    HashBuild build(config, database_path, read);
+    assert(build.build() == vector<string>({ "source", "cc -O2 b.c", "link prog" }));
+
+    // a database that can't be saved throws from save(), not the destructor
+    {
+        HashBuild lost(config, dir / "missing" / "build.db", read);
+        assert(lost.execute([](const BuildTarget &) { return true; }).succeeded.size() == 5);
+        bool threw = false;
+        try
+        {
+            lost.save();
+        }
+        catch (const exception &)
+        {
+            threw = true;
+        }
+        assert(threw);
+    }
+    filesystem::remove_all(dir);
+}
+
+void test_graph_cache()
+{
+    filesystem::path dir = filesystem::temp_directory_path().append("sdbxgraph");
+    filesystem::remove_all(dir);
+    filesystem::create_directory(dir);
+    filesystem::path cache_path = dir / "graph.cache";
+    BuildConfig config = { { "A", {"B", "C"}, "build A", 0 }, { "B", {"D"}, "build B", 0 }, { "C", {"D"}, "build C", 1 }, { "D", {}, "build D", 1 } };
+    {
+        BuildBase base(config, cache_path);
+        assert(!base.graph_cached() && filesystem::exists(cache_path));
+        assert(base.build() == vector<string>({ "build B", "build A" }));
+    }
+
+    // timestamps aren't part of the graph
+    for (auto &target : config)
+    {
+        target.timestamp = -1;
+    }
+    {
+        BuildBase base(config, cache_path);
+        assert(base.graph_cached());
+        assert(base.build() == vector<string>({ "build D", "build C", "build B", "build A" }));
+        BuildReport report = base.execute([](const BuildTarget &) { return true; }, { 2 });
+        assert(report.succeeded.size() == 4 && report.critical_path.front() == "D");
+    }
+
+    // a changed depend or rule makes a new one
+    config[0].depends = { "C" };
+    {
+        BuildBase base(config, cache_path);
+        assert(!base.graph_cached());
+        assert(base.build() == vector<string>({ "build D", "build C", "build B", "build A" }));
+    }
+    config[1].rule = "build B again";
+    assert(!BuildBase(config, cache_path).graph_cached());
+    assert(BuildBase(config, cache_path).graph_cached());
+
+    // a bad config is still rejected, and a damaged cache is ignored
+    try
+    {
+        BuildConfig unknown = config;
+        unknown[0].depends = { "E" };
+        BuildBase base(unknown, cache_path);
+        assert(!"UnknownDepend not thrown");
+    }
+    catch (UnknownDepend)
+    {
+    }
+    filesystem::resize_file(cache_path, filesystem::file_size(cache_path) - 4);
+    assert(!BuildBase(config, cache_path).graph_cached());
+    {
+        fstream file(cache_path, ios::in | ios::out | ios::binary);
+        file.seekp(sizeof(uint64_t) * 2 + sizeof(uint32_t) * 4);
+        uint32_t bad = 99;
+        file.write((const char *)&bad, sizeof(bad));
+    }
+    assert(!BuildBase(config, cache_path).graph_cached());
+    assert(BuildBase(config, cache_path).graph_cached());
+
+    // cycles are found again on every build
+    BuildConfig circular = { { "A", {"B"}, "build A" }, { "B", {"A"}, "build B" } };
+    for (int run = 0; run < 2; run++)
+    {
+        try
+        {
+            BuildBase base(circular, cache_path);
+            assert(base.graph_cached() == (run == 1));
+            base.build();
+            assert(!"CircularDepends not thrown");
+        }
+        catch (CircularDepends)
+        {
+        }
+    }
+
+    // the same fingerprints either way
+    filesystem::path database_path = dir / "build.db";
+    {
+        HashBuild build(config, database_path, nullptr, cache_path);
+        assert(build.execute([](const BuildTarget &) { return true; }).succeeded.size() == 4);
+    }
+    HashBuild build(config, database_path, nullptr, cache_path);
+    assert(build.graph_cached() && build.build().empty());
+    filesystem::remove_all(dir);
+}
+
+void sweep_graph_cache()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+#else
+    vector<size_t> sizes = { 1000, 10000, 100000 };
+#endif
+    filesystem::path cache_path = filesystem::temp_directory_path().append("sdbxgraph.cache");
+
+    cout << "Starting a build of synthetic targets, up to 3 depends per target (times are in ms)" << endl;
+    cout << "targets\tuncached\tsaving\tcached\tspeedup" << endl;
+    for (auto size : sizes)
+    {
+        BuildConfig config = synthetic_build(size, 1);
+        filesystem::remove(cache_path);
+        auto start = chrono::steady_clock::now();
+        vector<string> expect = TopoSortBuild(config).topo_sort();
+        double uncached = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        start = chrono::steady_clock::now();
+        TopoSortBuild(config, cache_path).topo_sort();
+        double saving = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        start = chrono::steady_clock::now();
+        TopoSortBuild base(config, cache_path);
+        vector<string> order = base.topo_sort();
+        double cached = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        assert(base.graph_cached() && order == expect);
+        cout << size << "\t" << uncached << "\t" << saving << "\t" << cached << "\t" << uncached / cached << endl;
+    }
+    filesystem::remove(cache_path);
+}
+
+void test_action_cache()
+{
+    filesystem::path dir = filesystem::temp_directory_path().append("sdbxaction");
+    filesystem::remove_all(dir);
+    filesystem::path workspace = dir / "work";
+    filesystem::create_directories(workspace);
+    LocalActionStore store(dir / "cache");
+    auto write = [&](const string &name, const string &content)
+    {
+        ofstream(workspace / name) << content;
+    };
+    auto read_file = [&](const string &name)
+    {
+        ifstream reader(workspace / name);
+        return string(istreambuf_iterator<char>(reader), istreambuf_iterator<char>());
+    };
+    auto read = [&](const BuildTarget &target)
+    {
+        return target.depends.empty() ? read_file(target.name) : string();
+    };
+    BuildConfig config = {
+        { "prog", {"a.o", "b.o"}, "link" },
+        { "a.o", {"a.c"}, "cc" },
+        { "b.o", {"b.c"}, "cc" },
+        { "a.c", {}, "source" },
+        { "b.c", {}, "source" },
+    };
+    // a rule writes its rule and its inputs to the target's file, sources are left alone
+    set<string> ran;
+    mutex lock;
+    auto run = [&](const BuildTarget &target)
+    {
+        if (!target.depends.empty())
+        {
+            string output = target.rule;
+            for (const string &depend : target.depends)
+            {
+                output += " " + read_file(depend);
+            }
+            write(target.name, output);
+        }
+        lock_guard<mutex> guard(lock);
+        ran.insert(target.name);
+        return target.rule != "fail";
+    };
+    // a fresh checkout: no build database and no outputs
+    auto clean_build = [&](const BuildConfig &config, const string &environment = "")
+    {
+        filesystem::remove(dir / "build.db");
+        for (string name : { "prog", "a.o", "b.o" })
+        {
+            filesystem::remove(workspace / name);
+        }
+        ran.clear();
+        CachedBuild build(config, dir / "build.db", store, workspace, environment, read);
+        BuildBase &base = build;
+        BuildReport report = base.execute(run, { 2 });
+        assert(report.failed.empty() || config[0].rule == "fail");
+        return build.stats();
+    };
+    write("a.c", "A");
+    write("b.c", "B");
+    ActionCacheStats stats = clean_build(config);
+    assert(stats.hits == 0 && stats.misses == 5 && stats.uploaded == 5 && ran.size() == 5);
+    assert(read_file("prog") == "link cc A cc B");
+
+    // the second clean build restores everything and runs nothing
+    stats = clean_build(config);
+    assert(stats.hits == 5 && stats.misses == 0 && stats.uploaded == 0 && ran.empty());
+    assert(stats.hit_rate() == 1 && stats.restored_bytes > 0);
+    assert(read_file("prog") == "link cc A cc B");
+
+    // only what a change reaches misses
+    write("a.c", "AA");
+    stats = clean_build(config);
+    assert(stats.hits == 2 && stats.misses == 3 && ran == set<string>({ "a.c", "a.o", "prog" }));
+    assert(read_file("prog") == "link cc AA cc B");
+    write("a.c", "A");
+    stats = clean_build(config);
+    assert(stats.hits == 5 && read_file("prog") == "link cc A cc B");
+
+    // another environment is another action
+    stats = clean_build(config, "CC=clang");
+    assert(stats.hits == 0 && stats.misses == 5);
+
+    // a failed rule isn't stored, and a lost blob is a miss
+    config[0].rule = "fail";
+    stats = clean_build(config);
+    assert(stats.misses == 1 && stats.uploaded == 0);
+    stats = clean_build(config);
+    assert(stats.misses == 1 && ran == set<string>({ "prog" }));
+    config[0].rule = "link";
+    for (const auto &entry : filesystem::directory_iterator(dir / "cache" / "cas"))
+    {
+        filesystem::remove(entry.path());
+    }
+    stats = clean_build(config);
+    assert(stats.hits == 0 && stats.misses == 5 && stats.uploaded == 5);
+
+    // a blob that doesn't match its digest is a miss
+    ofstream(dir / "cache" / "cas" / content_digest("link cc A cc B"), ios::binary) << "link cc X cc Y";
+    stats = clean_build(config);
+    assert(stats.hits == 4 && stats.misses == 1 && ran == set<string>({ "prog" }));
+    assert(read_file("prog") == "link cc A cc B");
+
+    // so is a record that names an output outside the workspace
+    for (const auto &entry : filesystem::directory_iterator(dir / "cache" / "ac"))
+    {
+        assert(entry.path().filename().string().size() == 64);
+        string line;
+        getline(ifstream(entry.path()), line);
+        ofstream(entry.path()) << line.substr(0, line.find(' ')) << " ../escaped\n";
+    }
+    stats = clean_build(config);
+    assert(stats.hits == 0 && stats.misses == 5 && !filesystem::exists(dir / "escaped"));
+
+    // an up to date target is neither looked up nor run
+    {
+        ran.clear();
+        CachedBuild build(config, dir / "build.db", store, workspace, "", read);
+        build.execute(run);
+        assert(build.stats().hits + build.stats().misses == 0 && ran.empty());
+    }
+    filesystem::remove_all(dir);
+}
+
+void sweep_action_cache()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 100, 1000, 10000 };
+#else
+    vector<size_t> sizes = { 100, 1000 };
+#endif
+    const int rule_ms = 1;
+    filesystem::path dir = filesystem::temp_directory_path().append("sdbxaction");
+
+    cout << "Clean builds of synthetic targets, rules take " << rule_ms << " ms (times are in ms)" << endl;
+    cout << "targets\tcold\twarm\thit rate\tspeedup" << endl;
+    for (auto size : sizes)
+    {
+        filesystem::remove_all(dir);
+        filesystem::create_directories(dir / "work");
+        LocalActionStore store(dir / "cache");
+        BuildConfig config = synthetic_build(size, 1);
+        auto run = [&](const BuildTarget &target)
+        {
+            this_thread::sleep_for(chrono::milliseconds(rule_ms));
+            ofstream(dir / "work" / target.name) << target.rule;
+            return true;
+        };
+        auto clean_build = [&](ActionCacheStats &stats)
+        {
+            filesystem::remove(dir / "build.db");
+            auto start = chrono::steady_clock::now();
+            CachedBuild build(config, dir / "build.db", store, dir / "work");
+            build.execute(run, { 4 });
+            stats = build.stats();
+            return (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        };
+        ActionCacheStats stats;
+        double cold = clean_build(stats);
+        double warm = clean_build(stats);
+        cout << size << "\t" << cold << "\t" << warm << "\t" << stats.hit_rate() << "\t" << cold / warm << endl;
+    }
+    filesystem::remove_all(dir);
+}
+
 void build_main()
 {
     cout << "Build Manager:" << endl;
     test_build_base();
     test_topo_sort();
     test_timestamps();
+    test_execute();
+    test_topo_sort_matches_quadratic();
+    test_hash_build();
+    test_graph_cache();
+    test_action_cache();
     cout << "All tests passed" << endl;
+    //sweep_topo_sort();
+    //sweep_graph_cache();
+    //sweep_action_cache();
 }
\ No newline at end of file
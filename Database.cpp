@@ -3,16 +3,61 @@
 // https://third-bit.com/sdxpy/db/
 
 #include <assert.h>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <map>
+#include <numeric>
+#include <memory>
+#include <queue>
+#include <random>
 #include <set>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <tuple>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
 
 // requires: /std:c++17
 #include <filesystem>
 
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SDX_SSE2
+#endif
+
+// SSE4.2 isn't part of the x64 baseline the project builds for, so the code
+// that uses it is compiled for it on its own and picked at run time.
+#if defined(_M_X64) || defined(__x86_64__)
+#include <nmmintrin.h>
+#define SDX_SSE42
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SDX_TARGET_SSE42
+#else
+#include <cpuid.h>
+#define SDX_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+#include <nlohmann/json.hpp>
+
+#include "FileUtils.h"
+#include "MappedFile.h"
+
 using namespace std;
+using json = nlohmann::json;
 
 struct BasicRecord
 {
@@ -30,6 +75,10 @@ struct BasicRecord
 
     void pack(char *buffer) const
     {
+        if (name.length() >= max_name)
+        {
+            throw invalid_argument("name too long for a packed record: " + name);
+        }
         size_t *strlen_ptr = (size_t *)buffer;
         *strlen_ptr = name.length();
         strcpy_s(buffer + sizeof(size_t), max_name, name.c_str());
@@ -42,14 +91,14 @@ struct BasicRecord
         }
     }
 
-    static BasicRecord unpack(char *buffer)
+    static BasicRecord unpack(const char *buffer)
     {
         BasicRecord result;
-        size_t *strlen_ptr = (size_t *)buffer;
+        const size_t *strlen_ptr = (const size_t *)buffer;
         result.name = string(buffer + sizeof(size_t), *strlen_ptr);
-        int *timestamp_ptr = (int *)(buffer + sizeof(size_t) + max_name);
+        const int *timestamp_ptr = (const int *)(buffer + sizeof(size_t) + max_name);
         result.timestamp = *timestamp_ptr;
-        int *readings_ptr = (int *)(timestamp_ptr + 1);
+        const int *readings_ptr = (const int *)(timestamp_ptr + 1);
         for (int i = 0; i < 10; i++)
         {
             result.readings[i] = readings_ptr[i];
@@ -73,8 +122,32 @@ bool operator==(const BasicRecord &left, const BasicRecord &right)
 class Database
 {
 public:
+    virtual ~Database() = default;
+
     virtual void add(const BasicRecord &record) = 0;
     virtual BasicRecord get(const string &key) = 0;
+
+    // Records with begin_key <= key < end_key in key order, an empty end_key means no upper bound.
+    virtual vector<BasicRecord> scan(const string &begin_key, const string &end_key) = 0;
+
+    // Same as add for each record in turn. Stores override these when they can
+    // do the work for many records at once.
+    virtual void add_batch(const BasicRecord *records, size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            add(records[i]);
+        }
+    }
+
+    // Fills result[i] with get(keys[i]).
+    virtual void get_batch(const string *keys, size_t count, BasicRecord *result)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            result[i] = get(keys[i]);
+        }
+    }
 };
 
 class MemDb : public Database
@@ -98,307 +171,5120 @@ public:
         }
         return result;
     }
+
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        vector<BasicRecord> result;
+        for (auto it = data.lower_bound(begin_key); it != data.end() && (end_key.empty() || it->first < end_key); ++it)
+        {
+            result.push_back(it->second);
+        }
+        return result;
+    }
+};
+
+// Data files written by FileDb and MappedDb end in a trailer shorter than a
+// record, so readers that count whole records don't see it: "SDXGEN01" and a
+// generation that is new every time the file is written. MappedDb's index
+// records the generation it was built for, which makes checking it O(1).
+struct DataTrailer
+{
+    constexpr static char MAGIC[8] = { 'S', 'D', 'X', 'G', 'E', 'N', '0', '1' };
+    constexpr static size_t SIZE = 16;
+
+    static void append(string &contents)
+    {
+        random_device random;
+        uint64_t generation = ((uint64_t)random() << 32) ^ random() ^ (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+        contents.append(MAGIC, sizeof(MAGIC));
+        contents.append((const char *)&generation, sizeof(generation));
+    }
+
+    // 0 when the file has no trailer.
+    static uint64_t generation(const char *data, size_t size)
+    {
+        if (size % BasicRecord::packed_size != SIZE || memcmp(data + size - SIZE, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            return 0;
+        }
+        uint64_t result;
+        memcpy(&result, data + size - sizeof(result), sizeof(result));
+        return result;
+    }
+};
+
+struct WalOptions
+{
+    size_t group_size = 256;                    // commit once this many records are pending...
+    chrono::milliseconds group_delay{ 5 };      // ...or after this long, whichever comes first
+    bool sync = false;                          // make each commit durable (fdatasync)
+    size_t checkpoint_records = 100000;         // rewrite the data file once the log is this long
 };
 
+// Records are appended to a write-ahead log (file_path + ".wal") in groups
+// instead of rewriting the whole data file on every add. A background thread
+// commits groups that have waited group_delay and, once the log is long enough,
+// checkpoints: the data file is rewritten from a copy of the records and the
+// log is started over. Loading replays the log over the data file.
+//
+// A checkpoint renames the current log to ".wal.old" before writing the data
+// file, so a crash at any point leaves data file + old log + log, which replay
+// to the same records.
 class FileDb : public MemDb
 {
-    filesystem::path file_path;
+    filesystem::path file_path, wal_path, old_wal_path;
+    WalOptions options;
+    AppendFile wal;
+    mutex lock, checkpoint_lock;
+    condition_variable wake;
+    string pending;
+    size_t pending_records = 0;
+    size_t wal_records = 0;
+    bool stopping = false;
+    thread background;
+
 public:
-    FileDb(const filesystem::path &file_path): file_path(file_path)
+    FileDb(const filesystem::path &file_path, const WalOptions &options = {})
+        : file_path(file_path), options(options)
     {
+        wal_path = file_path;
+        wal_path += ".wal";
+        old_wal_path = file_path;
+        old_wal_path += ".wal.old";
         load();
+        if (filesystem::exists(old_wal_path))
+        {
+            // interrupted checkpoint, finish it before the log can be rotated again
+            save(data);
+            filesystem::remove(old_wal_path);
+        }
+        wal.open(wal_path);
+        background = thread([this] { run_background(); });
     }
 
-    void add(const BasicRecord &record) override
+    ~FileDb()
     {
-        MemDb::add(record);
-        save();
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        background.join();
+        lock_guard<mutex> guard(lock);
+        commit();
     }
 
-private:
-    void load()
+    // Records are packed before anything changes, so one that can't be
+    // packed leaves neither the records nor the log behind.
+    void add(const BasicRecord &record) override
     {
-        ifstream reader(file_path.c_str(), ios_base::binary);
-        if (reader.is_open())
+        char packed[BasicRecord::packed_size];
+        record.pack(packed);
+        lock_guard<mutex> guard(lock);
+        MemDb::add(record);
+        pending.append(packed, sizeof(packed));
+        if (++pending_records >= options.group_size)
         {
-            reader.seekg(0, ios_base::end);
-            size_t total_size = (size_t)reader.tellg();
-            char *buffer = new char[total_size];
-            reader.seekg(0, ios_base::beg);
-            reader.read(buffer, total_size);
-            reader.close();
-            size_t record_size = BasicRecord::packed_size;
-            for (size_t offset = 0; offset < total_size; offset += record_size)
-            {
-                MemDb::add(BasicRecord::unpack(buffer + offset));
-            }
-            delete[] buffer;
+            commit();
         }
     }
 
-    void save()
+    void add_batch(const BasicRecord *records, size_t count) override
     {
-        ofstream writer(file_path.c_str(), ios_base::binary);
-        if (writer.is_open())
+        string packed(count * BasicRecord::packed_size, '\0');
+        for (size_t i = 0; i < count; i++)
         {
-            size_t record_size = BasicRecord::packed_size;
-            size_t total_size = data.size() * record_size;
-            size_t offset = 0;
-            char *buffer = new char[total_size];
-            for (const auto &[key, value] : data)
-            {
-                value.pack(buffer + offset);
-                offset += record_size;
-            }
-            writer.write(buffer, total_size);
-            writer.close();
-            delete[] buffer;
+            records[i].pack(&packed[i * BasicRecord::packed_size]);
+        }
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < count; i++)
+        {
+            MemDb::add(records[i]);
+        }
+        pending += packed;
+        pending_records += count;
+        if (pending_records >= options.group_size)
+        {
+            commit();
         }
     }
-};
-
-class BlockDb : public Database
-{
-protected:
-    size_t next_id = 0;
-    map<string, size_t> index;
-    vector<map<size_t, BasicRecord>> blocks;
 
-public:
-    constexpr static size_t records_per_block = 2;
-
-    size_t size()
+    // Commits whatever is pending now instead of waiting for the group to fill.
+    void flush()
     {
-        return records_per_block;
+        lock_guard<mutex> guard(lock);
+        commit();
     }
 
-    size_t num_blocks()
+    // Rewrites the data file and starts a new log.
+    void checkpoint()
     {
-        return blocks.size();
+        lock_guard<mutex> checkpoint_guard(checkpoint_lock);
+        map<string, BasicRecord> snapshot;
+        {
+            lock_guard<mutex> guard(lock);
+            commit();
+            snapshot = data;
+            wal.close();
+            filesystem::rename(wal_path, old_wal_path);
+            wal.open(wal_path);
+            wal_records = 0;
+        }
+        save(snapshot);
+        filesystem::remove(old_wal_path);
     }
 
-    size_t num_records()
+    size_t log_records()
     {
-        return index.size();
+        lock_guard<mutex> guard(lock);
+        return wal_records + pending_records;
     }
 
-    size_t get_block_id(size_t seq_id)
+private:
+    // Caller holds lock.
+    void commit()
     {
-        return seq_id / records_per_block;
+        if (pending_records == 0)
+        {
+            return;
+        }
+        wal.write(pending.data(), pending.size());
+        if (options.sync)
+        {
+            wal.sync();
+        }
+        wal_records += pending_records;
+        pending.clear();
+        pending_records = 0;
     }
 
-    map<size_t, BasicRecord>& get_block(size_t bloq_id)
+    void run_background()
     {
-        while (bloq_id >= blocks.size())
+        unique_lock<mutex> guard(lock);
+        while (!stopping)
         {
-            blocks.push_back({});
+            wake.wait_for(guard, options.group_delay);
+            commit();
+            if (wal_records >= options.checkpoint_records && !stopping)
+            {
+                guard.unlock();
+                checkpoint();
+                guard.lock();
+            }
         }
-        return blocks.at(bloq_id);
     }
 
-    virtual void add(const BasicRecord & record) override
+    void load()
     {
-        string key = record.key();
-        size_t seq_id = next_id++;
-        index.emplace(key, seq_id);
-        size_t block_id = get_block_id(seq_id);
-        auto &block = get_block(block_id);
-        block.emplace(seq_id, record);
+        for (const auto &path : { file_path, old_wal_path, wal_path })
+        {
+            ifstream reader(path.c_str(), ios_base::binary);
+            if (reader.is_open())
+            {
+                reader.seekg(0, ios_base::end);
+                size_t total_size = (size_t)reader.tellg();
+                char *buffer = new char[total_size];
+                reader.seekg(0, ios_base::beg);
+                reader.read(buffer, total_size);
+                reader.close();
+                size_t record_size = BasicRecord::packed_size;
+                // a torn record at the end of a log is dropped
+                for (size_t offset = 0; offset + record_size <= total_size; offset += record_size)
+                {
+                    MemDb::add(BasicRecord::unpack(buffer + offset));
+                }
+                delete[] buffer;
+            }
+        }
     }
 
-    virtual BasicRecord get(const string & key) override
+    // The new data file is synced, renamed into place and the rename synced
+    // before the caller removes the old log, so the records are never only in
+    // a file that can still be lost.
+    void save(const map<string, BasicRecord> &records)
     {
-        BasicRecord result;
-        if (index.count(key) == 0)
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp";
+        size_t record_size = BasicRecord::packed_size;
+        string buffer(records.size() * record_size, '\0');
+        size_t offset = 0;
+        for (const auto &[key, value] : records)
         {
-            return result;
+            value.pack(&buffer[offset]);
+            offset += record_size;
         }
-        size_t seq_id = index.at(key);
-        size_t block_id = get_block_id(seq_id);
-        auto &block = get_block(block_id);
-        result = block.at(seq_id);
-        return result;
+        DataTrailer::append(buffer);
+        filesystem::remove(temp_path);
+        AppendFile writer;
+        writer.open(temp_path);
+        writer.write(buffer.data(), buffer.size());
+        writer.sync();
+        writer.close();
+        filesystem::rename(temp_path, file_path);
+        sync_directory(file_path.parent_path());
     }
 };
 
-class BlockFileDb : public BlockDb
+// A packed BasicRecord read in place, without unpacking it.
+struct BasicRecordView
 {
-    filesystem::path db_dir;
+    const char *buffer = nullptr;
 
-public:
-    BlockFileDb(const filesystem::path &db_dir) : db_dir(db_dir)
+    explicit operator bool() const
     {
-        build_index();
+        return buffer != nullptr;
     }
 
-    virtual void add(const BasicRecord & record) override
+    string_view name() const
     {
-        BlockDb::add(record);
-        save(record);
+        size_t length;
+        memcpy(&length, buffer, sizeof(length));
+        return string_view(buffer + sizeof(size_t), length < BasicRecord::max_name ? length : BasicRecord::max_name);
     }
 
-    virtual BasicRecord get(const string & key) override
+    int timestamp() const
     {
-        if (index.count(key) == 0)
+        int result;
+        memcpy(&result, buffer + sizeof(size_t) + BasicRecord::max_name, sizeof(result));
+        return result;
+    }
+
+    int reading(int i) const
+    {
+        int result;
+        memcpy(&result, buffer + sizeof(size_t) + BasicRecord::max_name + sizeof(int) * (1 + i), sizeof(result));
+        return result;
+    }
+
+    BasicRecord record() const
+    {
+        return buffer ? BasicRecord::unpack(buffer) : BasicRecord();
+    }
+};
+
+// FNV-1a, stable across runs and platforms so it can be stored on disk.
+uint64_t stable_hash(string_view key)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (char c : key)
+    {
+        hash ^= (unsigned char)c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// CRC-32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it
+// and a byte-at-a-time table otherwise.
+struct Crc32c
+{
+    static uint32_t compute(const char *data, size_t size, uint32_t crc = 0)
+    {
+#ifdef SDX_SSE42
+        static const bool has_sse42 = []()
         {
-            load(key);
+#ifdef _MSC_VER
+            int info[4];
+            __cpuid(info, 1);
+            return (info[2] & (1 << 20)) != 0;
+#else
+            unsigned eax, ebx, ecx, edx;
+            return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2) != 0;
+#endif
+        }();
+        if (has_sse42)
+        {
+            return hardware(data, size, crc);
         }
-        return BlockDb::get(key);
+#endif
+        return software(data, size, crc);
     }
 
-private:
-    void build_index()
+#ifdef SDX_SSE42
+    SDX_TARGET_SSE42 static uint32_t hardware(const char *data, size_t size, uint32_t crc = 0)
     {
-        set<filesystem::path> files;
-        for (const auto &entry : filesystem::directory_iterator(db_dir))
+        crc = ~crc;
+        for (; size >= 8; data += 8, size -= 8)
         {
-            if (entry.is_regular_file())
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+            crc = (uint32_t)_mm_crc32_u64(crc, word);
+        }
+        for (; size > 0; data++, size--)
+        {
+            crc = _mm_crc32_u8(crc, (uint8_t)*data);
+        }
+        return ~crc;
+    }
+#endif
+
+    static uint32_t software(const char *data, size_t size, uint32_t crc = 0)
+    {
+        static const auto table = []()
+        {
+            array<uint32_t, 256> result;
+            for (uint32_t i = 0; i < 256; i++)
             {
-                auto extension = entry.path().extension();
-                if (extension == L".db")
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; bit++)
                 {
-                    files.emplace(entry.path());
+                    value = (value >> 1) ^ (value & 1 ? 0x82F63B78u : 0);
                 }
+                result[i] = value;
             }
+            return result;
+        }();
+        crc = ~crc;
+        for (; size > 0; data++, size--)
+        {
+            crc = (crc >> 8) ^ table[(crc ^ (uint8_t)*data) & 0xFF];
         }
-        for (const auto &file : files)
+        return ~crc;
+    }
+};
+
+// Thread-safe in-memory store. Keys are spread over a power-of-two number of
+// shards by hash, each with its own reader-writer lock, so readers only share
+// a lock with the readers and writers of the same shard. Shards are cache-line
+// aligned so that locking one doesn't slow down its neighbours.
+class ConcurrentMemDb : public Database
+{
+    struct alignas(64) Shard
+    {
+        shared_mutex lock;
+        unordered_map<string, BasicRecord> data;
+    };
+
+    vector<Shard> shards;
+    size_t mask;
+
+public:
+    ConcurrentMemDb(size_t num_shards = 64)
+    {
+        size_t count = 1;
+        while (count < num_shards)
         {
-            size_t block_id = _wtoi(file.stem().c_str());
-            load_block(block_id);
+            count *= 2;
         }
+        shards = vector<Shard>(count);
+        mask = count - 1;
     }
 
-    filesystem::path get_file_path(size_t block_id)
+    size_t num_shards() const
     {
-        filesystem::path result(db_dir);
-        result /= to_string(block_id);
-        result += ".db";
-        return result;
+        return shards.size();
     }
 
-    void save(const BasicRecord & record)
+    void add(const BasicRecord &record) override
     {
         string key = record.key();
-        size_t seq_id = index.at(key);
-        size_t block_id = get_block_id(seq_id);
-        save_block(block_id);
+        Shard &shard = shard_for(key);
+        unique_lock<shared_mutex> guard(shard.lock);
+        shard.data[key] = record;
     }
 
-    void load(const string &key)
+    BasicRecord get(const string &key) override
     {
-        size_t seq_id = index.at(key);
-        size_t block_id = get_block_id(seq_id);
-        load_block(block_id);
+        Shard &shard = shard_for(key);
+        shared_lock<shared_mutex> guard(shard.lock);
+        auto found = shard.data.find(key);
+        return found == shard.data.end() ? BasicRecord() : found->second;
     }
 
-    void save_block(size_t block_id)
+    // Each shard is locked once for all of its records.
+    void add_batch(const BasicRecord *records, size_t count) override
     {
-        auto &block = get_block(block_id);
-        auto file_path = get_file_path(block_id);
-        ofstream writer(file_path.c_str(), ios_base::binary);
-        if (writer.is_open())
+        vector<size_t> order = by_shard(count, [&](size_t i) { return records[i].name; });
+        for (size_t start = 0; start < count;)
         {
-            size_t record_size = BasicRecord::packed_size;
-            size_t total_size = block.size() * record_size;
-            size_t offset = 0;
-            char *buffer = new char[total_size];
-            for (const auto &[key, value] : block)
+            Shard &shard = shard_for(records[order[start]].name);
+            unique_lock<shared_mutex> guard(shard.lock);
+            for (; start < count && &shard_for(records[order[start]].name) == &shard; start++)
             {
-                value.pack(buffer + offset);
-                offset += record_size;
+                shard.data[records[order[start]].key()] = records[order[start]];
             }
-            writer.write(buffer, total_size);
-            writer.close();
-            delete[] buffer;
         }
     }
 
-    void load_block(size_t block_id)
+    void get_batch(const string *keys, size_t count, BasicRecord *result) override
     {
-        auto &block = get_block(block_id);
-        auto file_path = get_file_path(block_id);
-        ifstream reader(file_path.c_str(), ios_base::binary);
-        if (reader.is_open())
+        vector<size_t> order = by_shard(count, [&](size_t i) { return keys[i]; });
+        for (size_t start = 0; start < count;)
         {
-            reader.seekg(0, ios_base::end);
-            size_t total_size = (size_t)reader.tellg();
-            char *buffer = new char[total_size];
-            reader.seekg(0, ios_base::beg);
-            reader.read(buffer, total_size);
-            reader.close();
-            size_t record_size = BasicRecord::packed_size;
-            for (size_t offset = 0; offset < total_size; offset += record_size)
+            Shard &shard = shard_for(keys[order[start]]);
+            shared_lock<shared_mutex> guard(shard.lock);
+            for (; start < count && &shard_for(keys[order[start]]) == &shard; start++)
             {
-                BlockDb::add(BasicRecord::unpack(buffer + offset));
+                auto found = shard.data.find(keys[order[start]]);
+                result[order[start]] = found == shard.data.end() ? BasicRecord() : found->second;
             }
-            delete[] buffer;
         }
     }
-};
 
-void test_get_nothing_from_empty_db()
-{
-    MemDb db;
-    BasicRecord result = db.get("something");
-    BasicRecord empty;
-    assert(result == empty);
-}
+    // Each shard is consistent in itself, but adds may land in shards already visited.
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        vector<BasicRecord> result;
+        for (auto &shard : shards)
+        {
+            shared_lock<shared_mutex> guard(shard.lock);
+            for (const auto &[key, record] : shard.data)
+            {
+                if (key >= begin_key && (end_key.empty() || key < end_key))
+                {
+                    result.push_back(record);
+                }
+            }
+        }
+        sort(result.begin(), result.end(), [](const BasicRecord &left, const BasicRecord &right) { return left.name < right.name; });
+        return result;
+    }
 
-void test_add_then_get()
-{
-    MemDb db;
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
-    db.add(ex01);
-    assert(db.get("ex01") == ex01);
-}
+private:
+    Shard &shard_for(const string &key)
+    {
+        return shards[stable_hash(key) & mask];
+    }
 
-void test_add_two_then_get_both()
-{
-    MemDb db;
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
-    BasicRecord ex02{ "ex02", 67890, {3, 4} };
-    db.add(ex01);
-    db.add(ex02);
-    assert(db.get("ex01") == ex01);
-    assert(db.get("ex02") == ex02);
-}
+    // Positions 0..count-1 grouped by shard, in their original order within a shard.
+    template <typename KeyOf>
+    vector<size_t> by_shard(size_t count, KeyOf key_of)
+    {
+        vector<size_t> shard_of(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            shard_of[i] = stable_hash(key_of(i)) & mask;
+        }
+        vector<size_t> order(count);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](size_t left, size_t right) { return shard_of[left] < shard_of[right]; });
+        return order;
+    }
+};
 
-void test_add_then_overwrite()
+struct MvccStats
 {
-    MemDb db;
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
-    db.add(ex01);
-    ex01.timestamp = 67890;
-    db.add(ex01);
-    assert(db.get("ex01") == ex01);
-}
+    uint64_t commits = 0;       // sequence of the last published commit
+    size_t versions = 0;        // versions still linked, current ones included
+    size_t collected = 0;
+    size_t snapshots = 0;
+};
 
-void test_filedb()
+// Multi-version store. Every commit links new versions of its records, stamped
+// with the commit's sequence, in front of the keys' older versions. A snapshot
+// pins the last published sequence and reads the newest version at or before
+// it, so a long scan sees one state of the database while adds go on. Versions
+// are immutable and held by shared_ptr: readers take their shard's lock only
+// to find a key's newest version, never while they walk its versions.
+//
+// A commit takes its sequence while holding the locks of the shards it writes,
+// so each key's versions are linked in sequence order. The last published
+// sequence only moves past commits that are fully linked, so a snapshot never
+// sees a gap: a commit that is linked before the ones ahead of it is published
+// by whichever of them finishes last, nobody waits. Writers to different shards
+// only share the sequence counters. A batch is one commit.
+// Versions older than the first one the oldest snapshot can see are cut off
+// when their key is next written, or by collect_garbage(), which also runs when the
+// oldest snapshot is released with more old versions around than keys.
+class MvccMemDb : public Database
 {
-    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExample.db");
-
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
-    BasicRecord ex02{ "ex02", 67890, {3, 4} };
+    struct Version
+    {
+        BasicRecord record;
+        uint64_t seq;
+        shared_ptr<Version> next;   // older, read and cut with atomic_load and atomic_exchange
+    };
 
+    // Counted per shard, so writers to different shards don't share a cache line.
+    struct alignas(64) Shard
     {
-        FileDb db(db_file_path);
-        db.add(ex01);
-        db.add(ex02);
-    }
+        shared_mutex lock;
+        unordered_map<string, shared_ptr<Version>> data;
+        atomic<size_t> keys{ 0 };
+        atomic<size_t> versions{ 0 };
+        atomic<size_t> collected{ 0 };
+    };
+
+    vector<Shard> shards;
+    size_t mask;
+    atomic<uint64_t> next_seq{ 1 };
+    atomic<uint64_t> visible{ 0 };
+    array<atomic<uint64_t>, 1024> finished{};     // by seq % size, the last seq linked there
+    atomic<uint64_t> horizon{ 0 };  // at or before every snapshot's sequence
+    mutex snapshot_lock;
+    multiset<uint64_t> snapshots;
+    mutex collect_lock;
 
+public:
+    constexpr static uint64_t HORIZON_INTERVAL = 256;
+
+    // Reads as of the sequence it was taken at until it is destroyed.
+    class Snapshot
     {
-        FileDb db(db_file_path);
-        assert(db.get("ex01") == ex01);
-        assert(db.get("ex02") == ex02);
-    }
+        friend class MvccMemDb;
+        MvccMemDb *db = nullptr;
+        uint64_t seq = 0;
 
-    filesystem::remove(db_file_path);
-}
+        Snapshot(MvccMemDb *db, uint64_t seq) : db(db), seq(seq) {}
 
-void test_blockdb()
-{
-    BlockDb db;
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    public:
+        Snapshot() = default;
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        Snapshot(Snapshot &&other) noexcept : db(other.db), seq(other.seq)
+        {
+            other.db = nullptr;
+        }
+
+        Snapshot &operator=(Snapshot &&other) noexcept
+        {
+            if (this != &other)
+            {
+                release();
+                db = other.db;
+                seq = other.seq;
+                other.db = nullptr;
+            }
+            return *this;
+        }
+
+        ~Snapshot()
+        {
+            release();
+        }
+
+        uint64_t sequence() const
+        {
+            return seq;
+        }
+
+        void release()
+        {
+            if (db != nullptr)
+            {
+                db->release(seq);
+                db = nullptr;
+            }
+        }
+    };
+
+    MvccMemDb(size_t num_shards = 64)
+    {
+        size_t count = 1;
+        while (count < num_shards)
+        {
+            count *= 2;
+        }
+        shards = vector<Shard>(count);
+        mask = count - 1;
+    }
+
+    Snapshot snapshot()
+    {
+        lock_guard<mutex> guard(snapshot_lock);
+        uint64_t seq = visible.load();
+        snapshots.insert(seq);
+        update_horizon();
+        return Snapshot(this, seq);
+    }
+
+    MvccStats stats()
+    {
+        lock_guard<mutex> guard(snapshot_lock);
+        return { visible.load(), total(&Shard::versions), total(&Shard::collected), snapshots.size() };
+    }
+
+    // The version is made before the shard is locked, the lock is held only
+    // to link it.
+    void add(const BasicRecord &record) override
+    {
+        auto version = make_shared<Version>(Version{ record, 0, nullptr });
+        Shard &shard = shard_for(record.name);
+        uint64_t seq;
+        {
+            unique_lock<shared_mutex> guard(shard.lock);
+            seq = next_seq++;
+            link(shard, move(version), seq);
+        }
+        publish(seq);
+    }
+
+    // One commit: a snapshot sees all of the batch or none of it.
+    void add_batch(const BasicRecord *records, size_t count) override
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        vector<size_t> order(count);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](size_t left, size_t right)
+        {
+            return (stable_hash(records[left].name) & mask) < (stable_hash(records[right].name) & mask);
+        });
+        vector<shared_ptr<Version>> batch(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            batch[i] = make_shared<Version>(Version{ records[order[i]], 0, nullptr });
+        }
+        // every shard of the batch is locked, in shard order, before the sequence is taken
+        vector<unique_lock<shared_mutex>> guards;
+        for (size_t i = 0; i < count; i++)
+        {
+            Shard &shard = shard_for(batch[i]->record.name);
+            if (guards.empty() || guards.back().mutex() != &shard.lock)
+            {
+                guards.emplace_back(shard.lock);
+            }
+        }
+        uint64_t seq = next_seq++;
+        for (size_t i = 0; i < count; i++)
+        {
+            Shard &shard = shard_for(batch[i]->record.name);
+            link(shard, move(batch[i]), seq);
+        }
+        guards.clear();
+        publish(seq);
+    }
+
+    // The newest published version.
+    BasicRecord get(const string &key) override
+    {
+        shared_ptr<Version> version = newest(key);
+        while (version && version->seq > visible.load())
+        {
+            version = atomic_load(&version->next);
+        }
+        return version ? version->record : BasicRecord();
+    }
+
+    BasicRecord get(const string &key, const Snapshot &snapshot)
+    {
+        shared_ptr<Version> version = visible_at(newest(key), snapshot.seq);
+        return version ? version->record : BasicRecord();
+    }
+
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        return scan(begin_key, end_key, snapshot());
+    }
+
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key, const Snapshot &snapshot)
+    {
+        vector<shared_ptr<Version>> found;
+        for (auto &shard : shards)
+        {
+            shared_lock<shared_mutex> guard(shard.lock);
+            for (const auto &[key, version] : shard.data)
+            {
+                if (key >= begin_key && (end_key.empty() || key < end_key))
+                {
+                    found.push_back(version);
+                }
+            }
+        }
+        vector<BasicRecord> result;
+        for (auto &version : found)
+        {
+            shared_ptr<Version> seen = visible_at(move(version), snapshot.seq);
+            if (seen)
+            {
+                result.push_back(seen->record);
+            }
+        }
+        sort(result.begin(), result.end(), [](const BasicRecord &left, const BasicRecord &right) { return left.name < right.name; });
+        return result;
+    }
+
+    // Cuts off every version no snapshot can see.
+    void collect_garbage()
+    {
+        lock_guard<mutex> guard(collect_lock);
+        {
+            lock_guard<mutex> snapshot_guard(snapshot_lock);
+            update_horizon();
+        }
+        uint64_t oldest = horizon.load();
+        for (auto &shard : shards)
+        {
+            // a shared lock keeps out writers, who cut versions as well
+            shared_lock<shared_mutex> shard_guard(shard.lock);
+            for (const auto &[key, version] : shard.data)
+            {
+                cut(shard, version, oldest);
+            }
+        }
+    }
+
+private:
+    Shard &shard_for(const string &key)
+    {
+        return shards[stable_hash(key) & mask];
+    }
+
+    shared_ptr<Version> newest(const string &key)
+    {
+        Shard &shard = shard_for(key);
+        shared_lock<shared_mutex> guard(shard.lock);
+        auto found = shard.data.find(key);
+        return found == shard.data.end() ? nullptr : found->second;
+    }
+
+    static shared_ptr<Version> visible_at(shared_ptr<Version> version, uint64_t seq)
+    {
+        while (version && version->seq > seq)
+        {
+            version = atomic_load(&version->next);
+        }
+        return version;
+    }
+
+    // Called with the shard's lock held. A key repeated in
+    // a batch puts its last record in front. Versions behind the one before
+    // this that no snapshot can see are cut off here.
+    void link(Shard &shard, shared_ptr<Version> version, uint64_t seq)
+    {
+        shared_ptr<Version> &head = shard.data[version->record.name];
+        if (!head)
+        {
+            shard.keys++;
+        }
+        shard.versions++;
+        version->seq = seq;
+        version->next = move(head);
+        head = move(version);
+        if (head->next && head->next->seq <= horizon.load())
+        {
+            cut(shard, head->next, horizon.load());
+        }
+    }
+
+    // Keeps every version newer than oldest and the first one at or before it.
+    void cut(Shard &shard, const shared_ptr<Version> &head, uint64_t oldest)
+    {
+        shared_ptr<Version> version = head;
+        while (version->seq > oldest)
+        {
+            version = atomic_load(&version->next);
+            if (!version)
+            {
+                return;
+            }
+        }
+        // no reader walks past version, and freeing the tail one at a time keeps long chains off the stack
+        size_t count = 0;
+        for (shared_ptr<Version> tail = atomic_exchange(&version->next, shared_ptr<Version>()); tail; count++)
+        {
+            tail = atomic_exchange(&tail->next, shared_ptr<Version>());
+        }
+        shard.versions -= count;
+        shard.collected += count;
+    }
+
+    // Marks seq as linked and moves the published sequence past every commit
+    // that is linked with none unlinked before it. A writer only waits when a
+    // stalled commit has let the others get a whole finished array ahead, so
+    // that an entry is never reused before the published sequence passes it.
+    void publish(uint64_t seq)
+    {
+        while (seq - visible.load() > finished.size())
+        {
+            this_thread::yield();
+        }
+        finished[seq % finished.size()].store(seq);
+        uint64_t last = visible.load();
+        while (finished[(last + 1) % finished.size()].load() == last + 1)
+        {
+            // on failure last is reloaded, another writer moved it on
+            if (visible.compare_exchange_weak(last, last + 1))
+            {
+                last++;
+            }
+        }
+        if (seq % HORIZON_INTERVAL == 0)
+        {
+            lock_guard<mutex> guard(snapshot_lock);
+            update_horizon();
+        }
+    }
+
+    size_t total(atomic<size_t> Shard::*counter) const
+    {
+        size_t sum = 0;
+        for (const auto &shard : shards)
+        {
+            sum += (shard.*counter).load();
+        }
+        return sum;
+    }
+
+    // Called with snapshot_lock held.
+    void update_horizon()
+    {
+        horizon.store(snapshots.empty() ? visible.load() : *snapshots.begin());
+    }
+
+    void release(uint64_t seq)
+    {
+        bool oldest;
+        {
+            lock_guard<mutex> guard(snapshot_lock);
+            oldest = seq == *snapshots.begin();
+            snapshots.erase(snapshots.find(seq));
+            update_horizon();
+        }
+        // each pass frees at least as many versions as there are keys
+        if (oldest && total(&Shard::versions) > 2 * total(&Shard::keys))
+        {
+            collect_garbage();
+        }
+    }
+};
+
+// Read-mostly store over FileDb's data file layout (packed records and a
+// DataTrailer), memory-mapped together with an on-disk hash index
+// (file_path + ".idx"):
+//   "SDXHIX03", uint64 capacity (a power of two), uint64 record count,
+//   uint64 data file size, uint64 data file generation,
+//   capacity uint64 slots, 0 for empty or record number + 1 (linear probing)
+// Opening maps the two files and compares the index header with the data
+// file's size and trailer, so startup takes the same time at any size, and
+// view() returns a pointer into the mapping.
+//
+// New records are appended to a log (file_path + ".log") and kept packed in an
+// in-memory overlay until compact() merges them into new data and index files.
+// Records FileDb hasn't checkpointed yet (".wal.old" and ".wal") are replayed
+// into the overlay first, and compact() takes them over. FileDb and MappedDb
+// must not have the same file open at once.
+class MappedDb : public Database
+{
+    filesystem::path file_path, index_path, log_path, wal_path, old_wal_path;
+    MappedFile records, index;
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+    const char *slots = nullptr;
+    unordered_map<string, string> overlay;
+    AppendFile log;
+
+public:
+    constexpr static char INDEX_MAGIC[8] = { 'S', 'D', 'X', 'H', 'I', 'X', '0', '3' };
+    constexpr static size_t INDEX_HEADER = 40;
+
+    MappedDb(const filesystem::path &file_path) : file_path(file_path)
+    {
+        index_path = file_path;
+        index_path += ".idx";
+        log_path = file_path;
+        log_path += ".log";
+        wal_path = file_path;
+        wal_path += ".wal";
+        old_wal_path = file_path;
+        old_wal_path += ".wal.old";
+        open_files();
+        replay_log();
+        log.open(log_path);
+    }
+
+    void add(const BasicRecord &record) override
+    {
+        string packed(BasicRecord::packed_size, '\0');
+        record.pack(&packed[0]);
+        log.write(packed.data(), packed.size());
+        overlay[record.key()] = move(packed);
+    }
+
+    BasicRecord get(const string &key) override
+    {
+        return view(key).record();
+    }
+
+    // Zero-copy lookup, the view stays valid until the next add() or compact().
+    BasicRecordView view(const string &key) const
+    {
+        auto found = overlay.find(key);
+        if (found != overlay.end())
+        {
+            return { found->second.data() };
+        }
+        if (capacity == 0)
+        {
+            return {};
+        }
+        for (uint64_t slot = stable_hash(key) & (capacity - 1);; slot = (slot + 1) & (capacity - 1))
+        {
+            uint64_t entry;
+            memcpy(&entry, slots + slot * sizeof(uint64_t), sizeof(entry));
+            if (entry == 0)
+            {
+                return {};
+            }
+            BasicRecordView candidate{ records.data() + (entry - 1) * BasicRecord::packed_size };
+            if (candidate.name() == key)
+            {
+                return candidate;
+            }
+        }
+    }
+
+    size_t num_records() const
+    {
+        return (size_t)count + overlay.size();
+    }
+
+    // The hash index has no order, so this reads every record.
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        map<string, BasicRecord> found;
+        auto visit = [&](BasicRecordView record)
+        {
+            string key(record.name());
+            if (key >= begin_key && (end_key.empty() || key < end_key))
+            {
+                found[key] = record.record();
+            }
+        };
+        for (size_t offset = 0; offset + BasicRecord::packed_size <= records.size(); offset += BasicRecord::packed_size)
+        {
+            visit({ records.data() + offset });
+        }
+        for (const auto &[key, packed] : overlay)
+        {
+            visit({ packed.data() });
+        }
+        vector<BasicRecord> result;
+        for (auto &[key, record] : found)
+        {
+            result.push_back(move(record));
+        }
+        return result;
+    }
+
+    // Merges the overlay into the data file and rebuilds the index.
+    void compact()
+    {
+        string merged;
+        merged.reserve((size_t)(records.size() + overlay.size() * BasicRecord::packed_size));
+        for (size_t offset = 0; offset + BasicRecord::packed_size <= records.size(); offset += BasicRecord::packed_size)
+        {
+            BasicRecordView record{ records.data() + offset };
+            if (overlay.count(string(record.name())) == 0)
+            {
+                merged.append(record.buffer, BasicRecord::packed_size);
+            }
+        }
+        for (const auto &[key, packed] : overlay)
+        {
+            merged += packed;
+        }
+        DataTrailer::append(merged);
+        records.close();
+        index.close();
+        write_file(file_path, merged);
+        build_index();
+        // FileDb's logs are in the data file now
+        filesystem::remove(old_wal_path);
+        filesystem::remove(wal_path);
+        overlay.clear();
+        log.close();
+        filesystem::remove(log_path);
+        log.open(log_path);
+        open_files();
+    }
+
+private:
+    static void write_file(const filesystem::path &path, const string &contents)
+    {
+        filesystem::path temp_path = path;
+        temp_path += ".tmp";
+        filesystem::remove(temp_path);
+        AppendFile writer;
+        writer.open(temp_path);
+        writer.write(contents.data(), contents.size());
+        writer.sync();
+        writer.close();
+        filesystem::rename(temp_path, path);
+        sync_directory(path.parent_path());
+    }
+
+    void open_files()
+    {
+        if (!filesystem::exists(file_path))
+        {
+            ofstream(file_path, ios_base::binary).close();
+        }
+        records.open(file_path);
+        count = records.size() / BasicRecord::packed_size;
+        if (DataTrailer::generation(records.data(), records.size()) == 0)
+        {
+            // written before files had a trailer: a torn tail is dropped and
+            // one added, the records stay where they are
+            records.close();
+            filesystem::resize_file(file_path, count * BasicRecord::packed_size);
+            string trailer;
+            DataTrailer::append(trailer);
+            AppendFile writer;
+            writer.open(file_path);
+            writer.write(trailer.data(), trailer.size());
+            writer.sync();
+            writer.close();
+            records.open(file_path);
+        }
+        if (!filesystem::exists(index_path) || !index_matches())
+        {
+            // a new data file, or the index is stale: built once here
+            records.close();
+            build_index();
+            records.open(file_path);
+        }
+        index.open(index_path);
+        memcpy(&capacity, index.data() + 8, sizeof(capacity));
+        slots = index.data() + INDEX_HEADER;
+    }
+
+    bool index_matches()
+    {
+        MappedFile existing(index_path);
+        uint64_t header[5];
+        if (existing.size() < INDEX_HEADER)
+        {
+            return false;
+        }
+        memcpy(header, existing.data(), INDEX_HEADER);
+        return memcmp(header, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 && header[2] == count
+            && existing.size() == INDEX_HEADER + header[1] * sizeof(uint64_t)
+            && header[3] == records.size() && header[4] == DataTrailer::generation(records.data(), records.size());
+    }
+
+    void build_index()
+    {
+        MappedFile data(file_path);
+        uint64_t total = data.size() / BasicRecord::packed_size;
+        uint64_t size = 16;
+        while (size < total * 2)
+        {
+            size *= 2;
+        }
+        vector<uint64_t> table(size, 0);
+        for (uint64_t i = 0; i < total; i++)
+        {
+            BasicRecordView record{ data.data() + i * BasicRecord::packed_size };
+            uint64_t slot = stable_hash(record.name()) & (size - 1);
+            while (table[slot] != 0)
+            {
+                BasicRecordView other{ data.data() + (table[slot] - 1) * BasicRecord::packed_size };
+                if (other.name() == record.name())
+                {
+                    break;      // later duplicates win, like replaying FileDb
+                }
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = i + 1;
+        }
+        string contents(INDEX_HEADER + size * sizeof(uint64_t), '\0');
+        memcpy(&contents[0], INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        memcpy(&contents[8], &size, sizeof(size));
+        memcpy(&contents[16], &total, sizeof(total));
+        uint64_t data_size = data.size();
+        uint64_t generation = DataTrailer::generation(data.data(), data.size());
+        memcpy(&contents[24], &data_size, sizeof(data_size));
+        memcpy(&contents[32], &generation, sizeof(generation));
+        memcpy(&contents[INDEX_HEADER], table.data(), size * sizeof(uint64_t));
+        write_file(index_path, contents);
+    }
+
+    // FileDb's logs in the order FileDb replays them, then this store's own.
+    void replay_log()
+    {
+        for (const auto &path : { old_wal_path, wal_path, log_path })
+        {
+            if (!filesystem::exists(path))
+            {
+                continue;
+            }
+            MappedFile existing(path);
+            for (size_t offset = 0; offset + BasicRecord::packed_size <= existing.size(); offset += BasicRecord::packed_size)
+            {
+                BasicRecordView record{ existing.data() + offset };
+                overlay[string(record.name())] = string(record.buffer, BasicRecord::packed_size);
+            }
+        }
+    }
+};
+
+// Storage of fixed-size pages, read and written whole.
+class PageStore
+{
+public:
+    virtual ~PageStore() = default;
+    virtual size_t page_size() const = 0;
+    // Pages that were never written read as zeros.
+    virtual void read_page(uint64_t page_id, char *buffer) = 0;
+    virtual void write_page(uint64_t page_id, const char *buffer) = 0;
+    virtual void sync() {}
+};
+
+class PageFile : public PageStore
+{
+    fstream file;
+    size_t size;
+    uint64_t pages;
+
+public:
+    PageFile(const filesystem::path &file_path, size_t page_size) : size(page_size)
+    {
+        if (!filesystem::exists(file_path))
+        {
+            ofstream(file_path, ios_base::binary).close();
+        }
+        file.open(file_path, ios_base::in | ios_base::out | ios_base::binary);
+        if (!file.is_open())
+        {
+            throw runtime_error("can't open " + file_path.string());
+        }
+        pages = filesystem::file_size(file_path) / size;
+    }
+
+    size_t page_size() const override
+    {
+        return size;
+    }
+
+    void read_page(uint64_t page_id, char *buffer) override
+    {
+        if (page_id >= pages)
+        {
+            memset(buffer, 0, size);
+            return;
+        }
+        file.seekg((streamoff)(page_id * size));
+        file.read(buffer, size);
+    }
+
+    void write_page(uint64_t page_id, const char *buffer) override
+    {
+        file.seekp((streamoff)(page_id * size));
+        file.write(buffer, size);
+        pages = max(pages, page_id + 1);
+    }
+
+    void sync() override
+    {
+        file.flush();
+    }
+};
+
+class BufferPool;
+
+struct PoolStats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t prefetches = 0;
+    size_t write_backs = 0;
+    size_t bytes_read = 0;
+    size_t bytes_written = 0;
+
+    double hit_ratio() const
+    {
+        return hits + misses == 0 ? 0.0 : (double)hits / (hits + misses);
+    }
+};
+
+// Keeps a page pinned in the pool while in scope.
+class PageHandle
+{
+    BufferPool *pool = nullptr;
+    uint64_t page_id = 0;
+    char *page = nullptr;
+    bool dirty = false;
+
+public:
+    PageHandle() = default;
+    PageHandle(BufferPool *pool, uint64_t page_id, char *page) : pool(pool), page_id(page_id), page(page) {}
+    PageHandle(PageHandle &&other) noexcept { *this = move(other); }
+    PageHandle &operator=(PageHandle &&other) noexcept;
+    ~PageHandle() { release(); }
+
+    char *data() { return page; }
+    const char *data() const { return page; }
+    uint64_t id() const { return page_id; }
+    void mark_dirty() { dirty = true; }
+    void release();
+};
+
+// Fixed number of page frames over a PageStore. Pages are pinned while used;
+// when a frame is needed the CLOCK hand skips pinned frames and gives recently
+// used ones a second chance, dirty victims are written back first.
+class BufferPool
+{
+    struct Frame
+    {
+        uint64_t page_id = NO_PAGE;
+        int pins = 0;
+        bool dirty = false;
+        bool referenced = false;
+    };
+
+    PageStore &store;
+    size_t frame_size;
+    vector<char> memory;
+    vector<Frame> frames;
+    unordered_map<uint64_t, size_t> page_table;
+    size_t hand = 0;
+    PoolStats counters;
+
+public:
+    constexpr static uint64_t NO_PAGE = UINT64_MAX;
+
+    BufferPool(PageStore &store, size_t num_frames)
+        : store(store), frame_size(store.page_size()), memory(num_frames * store.page_size()), frames(num_frames)
+    {
+    }
+
+    ~BufferPool()
+    {
+        flush();
+    }
+
+    size_t capacity() const
+    {
+        return frames.size();
+    }
+
+    size_t resident() const
+    {
+        return page_table.size();
+    }
+
+    const PoolStats &stats() const
+    {
+        return counters;
+    }
+
+    PageHandle fetch(uint64_t page_id)
+    {
+        size_t frame;
+        auto found = page_table.find(page_id);
+        if (found != page_table.end())
+        {
+            frame = found->second;
+            counters.hits++;
+        }
+        else
+        {
+            frame = victim();
+            store.read_page(page_id, &memory[frame * frame_size]);
+            frames[frame].page_id = page_id;
+            page_table[page_id] = frame;
+            counters.misses++;
+            counters.bytes_read += frame_size;
+        }
+        frames[frame].pins++;
+        frames[frame].referenced = true;
+        return PageHandle(this, page_id, &memory[frame * frame_size]);
+    }
+
+    // Reads the pages that aren't cached yet, in page order, without pinning them.
+    // Asking for more pages than there are frames evicts the first ones again.
+    void prefetch(vector<uint64_t> page_ids)
+    {
+        sort(page_ids.begin(), page_ids.end());
+        for (uint64_t page_id : page_ids)
+        {
+            if (page_table.count(page_id) == 0)
+            {
+                size_t frame = victim();
+                store.read_page(page_id, &memory[frame * frame_size]);
+                frames[frame].page_id = page_id;
+                frames[frame].referenced = true;
+                page_table[page_id] = frame;
+                counters.prefetches++;
+                counters.bytes_read += frame_size;
+            }
+        }
+    }
+
+    void unpin(uint64_t page_id, bool dirty)
+    {
+        Frame &frame = frames[page_table.at(page_id)];
+        assert(frame.pins > 0);
+        frame.pins--;
+        frame.dirty |= dirty;
+    }
+
+    // Writes back every dirty page.
+    void flush()
+    {
+        for (size_t i = 0; i < frames.size(); i++)
+        {
+            if (frames[i].page_id != NO_PAGE && frames[i].dirty)
+            {
+                write_back(i);
+            }
+        }
+        store.sync();
+    }
+
+private:
+    size_t victim()
+    {
+        // two full turns: the first may only clear reference bits
+        for (size_t step = 0; step < 2 * frames.size() + 1; step++)
+        {
+            size_t frame = hand;
+            hand = (hand + 1) % frames.size();
+            Frame &candidate = frames[frame];
+            if (candidate.pins > 0)
+            {
+                continue;
+            }
+            if (candidate.referenced)
+            {
+                candidate.referenced = false;
+                continue;
+            }
+            if (candidate.page_id != NO_PAGE)
+            {
+                if (candidate.dirty)
+                {
+                    write_back(frame);
+                }
+                page_table.erase(candidate.page_id);
+                counters.evictions++;
+            }
+            candidate = Frame();
+            return frame;
+        }
+        throw runtime_error("buffer pool: all frames are pinned");
+    }
+
+    void write_back(size_t frame)
+    {
+        store.write_page(frames[frame].page_id, &memory[frame * frame_size]);
+        frames[frame].dirty = false;
+        counters.write_backs++;
+        counters.bytes_written += frame_size;
+    }
+};
+
+PageHandle &PageHandle::operator=(PageHandle &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        pool = other.pool;
+        page_id = other.page_id;
+        page = other.page;
+        dirty = other.dirty;
+        other.pool = nullptr;
+    }
+    return *this;
+}
+
+void PageHandle::release()
+{
+    if (pool)
+    {
+        pool->unpin(page_id, dirty);
+        pool = nullptr;
+    }
+}
+
+// Where a record lives in BlockFileDb.
+struct BlockSlot
+{
+    uint32_t block = 0;
+    uint32_t slot = 0;
+};
+
+// Persistent B+tree from keys to BlockSlot, in 4 KB pages cached by a BufferPool.
+// Page 0 holds the metadata. Every other page starts with a 16-byte header
+// (uint16 is_leaf, uint16 count, uint32 unused, uint64 link) followed by
+// 32-byte entries of a 24-byte key (length byte, then the characters):
+//   leaf      key, uint32 block, uint32 slot; link is the next leaf
+//   internal  key, uint64 child; link is the child left of the first key
+class BPlusTree
+{
+    struct Meta
+    {
+        char magic[8];
+        uint64_t root;
+        uint64_t page_count;
+        uint64_t height;
+        uint64_t count;
+        uint64_t user_value;
+    };
+
+    struct Split
+    {
+        bool happened = false;
+        string key;
+        uint64_t page = 0;
+    };
+
+    PageFile file;
+    BufferPool pool;
+    Meta meta;
+    bool inserted = false;
+
+public:
+    constexpr static size_t PAGE_SIZE = 4096;
+    constexpr static size_t HEADER_SIZE = 16;
+    constexpr static size_t KEY_SIZE = 24;
+    constexpr static size_t ENTRY_SIZE = 32;
+    constexpr static size_t MAX_ENTRIES = (PAGE_SIZE - HEADER_SIZE) / ENTRY_SIZE;
+    constexpr static char MAGIC[8] = { 'S', 'D', 'X', 'B', 'P', 'T', '0', '1' };
+
+    BPlusTree(const filesystem::path &file_path, size_t cache_pages = 64)
+        : file(file_path, PAGE_SIZE), pool(file, max<size_t>(cache_pages, 8))
+    {
+        PageHandle page = pool.fetch(0);
+        memcpy(&meta, page.data(), sizeof(meta));
+        if (memcmp(meta.magic, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            // new tree: an empty leaf as the root
+            memset(&meta, 0, sizeof(meta));
+            memcpy(meta.magic, MAGIC, sizeof(MAGIC));
+            meta.root = 1;
+            meta.page_count = 2;
+            meta.height = 1;
+            PageHandle root = pool.fetch(1);
+            memset(root.data(), 0, PAGE_SIZE);
+            set_u16(root.data(), 0, 1);
+            root.mark_dirty();
+            write_meta(page);
+        }
+    }
+
+    ~BPlusTree()
+    {
+        flush();
+    }
+
+    size_t size() const
+    {
+        return (size_t)meta.count;
+    }
+
+    size_t height() const
+    {
+        return (size_t)meta.height;
+    }
+
+    // A number stored alongside the tree for the owner's use.
+    uint64_t user_value() const
+    {
+        return meta.user_value;
+    }
+
+    void set_user_value(uint64_t value)
+    {
+        meta.user_value = value;
+        PageHandle page = pool.fetch(0);
+        write_meta(page);
+    }
+
+    void flush()
+    {
+        pool.flush();
+    }
+
+    const PoolStats &stats() const
+    {
+        return pool.stats();
+    }
+
+    bool find(const string &key, BlockSlot &value)
+    {
+        PageHandle page = find_leaf(key);
+        size_t count = get_u16(page.data(), 2);
+        size_t position = lower_bound(page.data(), count, key);
+        if (position < count && key_at(page.data(), position) == key)
+        {
+            value = leaf_value(page.data(), position);
+            return true;
+        }
+        return false;
+    }
+
+    // Adds key, or replaces its value if it is already there.
+    void insert(const string &key, BlockSlot value)
+    {
+        if (key.length() >= KEY_SIZE)
+        {
+            throw invalid_argument("key too long for BPlusTree: " + key);
+        }
+        inserted = false;
+        Split split = insert_into(meta.root, key, value);
+        if (split.happened)
+        {
+            uint64_t root_id = allocate();
+            PageHandle root = pool.fetch(root_id);
+            memset(root.data(), 0, PAGE_SIZE);
+            set_u64(root.data(), 8, meta.root);
+            set_u16(root.data(), 2, 1);
+            set_key(root.data(), 0, split.key);
+            set_u64(root.data(), entry(0) + KEY_SIZE, split.page);
+            root.mark_dirty();
+            meta.root = root_id;
+            meta.height++;
+        }
+        if (inserted)
+        {
+            meta.count++;
+        }
+        PageHandle page = pool.fetch(0);
+        write_meta(page);
+    }
+
+    // Removes key if it is there. Pages are not merged when they run low, an
+    // empty leaf stays linked in and is skipped by scans.
+    bool erase(const string &key)
+    {
+        PageHandle page = find_leaf(key);
+        char *data = page.data();
+        size_t count = get_u16(data, 2);
+        size_t position = lower_bound(data, count, key);
+        if (position == count || key_at(data, position) != key)
+        {
+            return false;
+        }
+        memmove(data + entry(position), data + entry(position + 1), (count - position - 1) * ENTRY_SIZE);
+        set_u16(data, 2, (uint16_t)(count - 1));
+        page.mark_dirty();
+        meta.count--;
+        PageHandle meta_page = pool.fetch(0);
+        write_meta(meta_page);
+        return true;
+    }
+
+    // Calls visit(key, value) for begin_key <= key < end_key in order, an empty
+    // end_key means no upper bound. Stops early if visit returns false.
+    template <typename Visit>
+    void scan(const string &begin_key, const string &end_key, Visit visit)
+    {
+        PageHandle page = find_leaf(begin_key);
+        size_t position = lower_bound(page.data(), get_u16(page.data(), 2), begin_key);
+        while (true)
+        {
+            size_t count = get_u16(page.data(), 2);
+            for (; position < count; position++)
+            {
+                string_view key = key_at(page.data(), position);
+                if (!end_key.empty() && key >= end_key)
+                {
+                    return;
+                }
+                if (!visit(key, leaf_value(page.data(), position)))
+                {
+                    return;
+                }
+            }
+            uint64_t next = get_u64(page.data(), 8);
+            if (next == 0)
+            {
+                return;
+            }
+            page = pool.fetch(next);
+            position = 0;
+        }
+    }
+
+private:
+    static size_t entry(size_t i) { return HEADER_SIZE + i * ENTRY_SIZE; }
+    static uint16_t get_u16(const char *page, size_t offset) { uint16_t v; memcpy(&v, page + offset, sizeof(v)); return v; }
+    static uint32_t get_u32(const char *page, size_t offset) { uint32_t v; memcpy(&v, page + offset, sizeof(v)); return v; }
+    static uint64_t get_u64(const char *page, size_t offset) { uint64_t v; memcpy(&v, page + offset, sizeof(v)); return v; }
+    static void set_u16(char *page, size_t offset, uint16_t v) { memcpy(page + offset, &v, sizeof(v)); }
+    static void set_u32(char *page, size_t offset, uint32_t v) { memcpy(page + offset, &v, sizeof(v)); }
+    static void set_u64(char *page, size_t offset, uint64_t v) { memcpy(page + offset, &v, sizeof(v)); }
+
+    static string_view key_at(const char *page, size_t i)
+    {
+        const char *key = page + entry(i);
+        return string_view(key + 1, (unsigned char)key[0]);
+    }
+
+    static void set_key(char *page, size_t i, string_view key)
+    {
+        char *target = page + entry(i);
+        memset(target, 0, KEY_SIZE);
+        target[0] = (char)key.length();
+        memcpy(target + 1, key.data(), key.length());
+    }
+
+    static BlockSlot leaf_value(const char *page, size_t i)
+    {
+        return { get_u32(page, entry(i) + KEY_SIZE), get_u32(page, entry(i) + KEY_SIZE + 4) };
+    }
+
+    // First entry with key >= the given one.
+    static size_t lower_bound(const char *page, size_t count, string_view key)
+    {
+        size_t low = 0, high = count;
+        while (low < high)
+        {
+            size_t mid = (low + high) / 2;
+            if (key_at(page, mid) < key)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    // Child of an internal page that covers key.
+    static uint64_t child_for(const char *page, string_view key, size_t &position)
+    {
+        size_t count = get_u16(page, 2);
+        position = lower_bound(page, count, key);
+        if (position < count && key_at(page, position) == key)
+        {
+            position++;
+        }
+        return position == 0 ? get_u64(page, 8) : get_u64(page, entry(position - 1) + KEY_SIZE);
+    }
+
+    PageHandle find_leaf(string_view key)
+    {
+        PageHandle page = pool.fetch(meta.root);
+        while (get_u16(page.data(), 0) == 0)
+        {
+            size_t position;
+            page = pool.fetch(child_for(page.data(), key, position));
+        }
+        return page;
+    }
+
+    uint64_t allocate()
+    {
+        return meta.page_count++;
+    }
+
+    void write_meta(PageHandle &page)
+    {
+        memset(page.data(), 0, PAGE_SIZE);
+        memcpy(page.data(), &meta, sizeof(meta));
+        page.mark_dirty();
+    }
+
+    // Inserts at position, shifting the rest of the entries right.
+    static void insert_entry(char *page, size_t position, string_view key, uint64_t value)
+    {
+        size_t count = get_u16(page, 2);
+        memmove(page + entry(position + 1), page + entry(position), (count - position) * ENTRY_SIZE);
+        set_key(page, position, key);
+        set_u64(page, entry(position) + KEY_SIZE, value);
+        set_u16(page, 2, (uint16_t)(count + 1));
+    }
+
+    Split insert_into(uint64_t page_id, const string &key, BlockSlot value)
+    {
+        PageHandle page = pool.fetch(page_id);
+        char *data = page.data();
+        bool leaf = get_u16(data, 0) != 0;
+        size_t count = get_u16(data, 2);
+        size_t position;
+        if (leaf)
+        {
+            position = lower_bound(data, count, key);
+            if (position < count && key_at(data, position) == key)
+            {
+                set_u32(data, entry(position) + KEY_SIZE, value.block);
+                set_u32(data, entry(position) + KEY_SIZE + 4, value.slot);
+                page.mark_dirty();
+                return {};
+            }
+            uint64_t packed = (uint64_t)value.block | (uint64_t)value.slot << 32;
+            insert_entry(data, position, key, packed);
+            inserted = true;
+        }
+        else
+        {
+            uint64_t child = child_for(data, key, position);
+            Split below = insert_into(child, key, value);
+            if (!below.happened)
+            {
+                return {};
+            }
+            insert_entry(data, position, below.key, below.page);
+        }
+        page.mark_dirty();
+        count = get_u16(data, 2);
+        if (count <= MAX_ENTRIES - 1)
+        {
+            return {};
+        }
+
+        // split in half, leaves copy the first key up, internal pages move the middle key up
+        uint64_t sibling_id = allocate();
+        PageHandle sibling = pool.fetch(sibling_id);
+        char *right = sibling.data();
+        memset(right, 0, PAGE_SIZE);
+        set_u16(right, 0, leaf ? 1 : 0);
+        size_t half = count / 2;
+        Split split{ true, string(key_at(data, half)), sibling_id };
+        if (leaf)
+        {
+            memcpy(right + entry(0), data + entry(half), (count - half) * ENTRY_SIZE);
+            set_u16(right, 2, (uint16_t)(count - half));
+            set_u64(right, 8, get_u64(data, 8));
+            set_u64(data, 8, sibling_id);
+            set_u16(data, 2, (uint16_t)half);
+        }
+        else
+        {
+            set_u64(right, 8, get_u64(data, entry(half) + KEY_SIZE));
+            memcpy(right + entry(0), data + entry(half + 1), (count - half - 1) * ENTRY_SIZE);
+            set_u16(right, 2, (uint16_t)(count - half - 1));
+            set_u16(data, 2, (uint16_t)half);
+        }
+        sibling.mark_dirty();
+        return split;
+    }
+};
+
+class BlockDb : public Database
+{
+protected:
+    size_t next_id = 0;
+    map<string, size_t> index;
+    vector<map<size_t, BasicRecord>> blocks;
+
+public:
+    constexpr static size_t records_per_block = 2;
+
+    size_t size()
+    {
+        return records_per_block;
+    }
+
+    size_t num_blocks()
+    {
+        return blocks.size();
+    }
+
+    size_t num_records()
+    {
+        return index.size();
+    }
+
+    size_t get_block_id(size_t seq_id)
+    {
+        return seq_id / records_per_block;
+    }
+
+    map<size_t, BasicRecord>& get_block(size_t bloq_id)
+    {
+        while (bloq_id >= blocks.size())
+        {
+            blocks.push_back({});
+        }
+        return blocks.at(bloq_id);
+    }
+
+    virtual void add(const BasicRecord & record) override
+    {
+        string key = record.key();
+        auto [it, added] = index.emplace(key, next_id);
+        if (added)
+        {
+            next_id++;
+        }
+        size_t seq_id = it->second;
+        size_t block_id = get_block_id(seq_id);
+        auto &block = get_block(block_id);
+        block[seq_id] = record;
+    }
+
+    virtual BasicRecord get(const string & key) override
+    {
+        BasicRecord result;
+        if (index.count(key) == 0)
+        {
+            return result;
+        }
+        size_t seq_id = index.at(key);
+        size_t block_id = get_block_id(seq_id);
+        auto &block = get_block(block_id);
+        result = block.at(seq_id);
+        return result;
+    }
+
+    virtual vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        vector<BasicRecord> result;
+        for (auto it = index.lower_bound(begin_key); it != index.end() && (end_key.empty() || it->first < end_key); ++it)
+        {
+            result.push_back(get_block(get_block_id(it->second)).at(it->second));
+        }
+        return result;
+    }
+};
+
+// Bloom filter made of 64-byte blocks. All of a key's bits are in one block,
+// one in each of its eight words, so a lookup reads a single cache line.
+class BlockedBloomFilter
+{
+    vector<uint64_t> words;
+    size_t capacity = 0;
+
+public:
+    constexpr static size_t WORDS_PER_BLOCK = 8;
+    constexpr static char MAGIC[8] = { 'S', 'D', 'X', 'B', 'L', 'M', '0', '1' };
+
+    BlockedBloomFilter() = default;
+
+    BlockedBloomFilter(size_t keys, size_t bits_per_key) : capacity(keys)
+    {
+        size_t blocks = max<size_t>((keys * bits_per_key + 511) / 512, 1);
+        words.assign(blocks * WORDS_PER_BLOCK, 0);
+    }
+
+    // The number of keys it was sized for.
+    size_t max_keys() const
+    {
+        return capacity;
+    }
+
+    void add(string_view key)
+    {
+        uint64_t hash = mix(stable_hash(key));
+        uint64_t *block = &words[block_of(hash) * WORDS_PER_BLOCK];
+        for (size_t i = 0; i < WORDS_PER_BLOCK; i++)
+        {
+            block[i] |= bit_of(hash, i);
+        }
+    }
+
+    bool may_contain(string_view key) const
+    {
+        uint64_t hash = mix(stable_hash(key));
+        const uint64_t *block = &words[block_of(hash) * WORDS_PER_BLOCK];
+        for (size_t i = 0; i < WORDS_PER_BLOCK; i++)
+        {
+            if ((block[i] & bit_of(hash, i)) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Written with the number of keys the owner had then, to spot a stale filter on load.
+    void save(const filesystem::path &file_path, uint64_t keys) const
+    {
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp";
+        {
+            ofstream writer(temp_path, ios_base::binary);
+            uint64_t header[3] = { keys, capacity, words.size() };
+            writer.write(MAGIC, sizeof(MAGIC));
+            writer.write((const char *)header, sizeof(header));
+            writer.write((const char *)words.data(), words.size() * sizeof(uint64_t));
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, file_path);
+    }
+
+    // False if there is no usable filter for exactly that many keys.
+    bool load(const filesystem::path &file_path, uint64_t keys)
+    {
+        ifstream reader(file_path, ios_base::binary);
+        char magic[sizeof(MAGIC)];
+        uint64_t header[3];
+        if (!reader.read(magic, sizeof(magic)) || !reader.read((char *)header, sizeof(header))
+            || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || header[0] != keys
+            || header[2] == 0 || header[2] % WORDS_PER_BLOCK != 0)
+        {
+            return false;
+        }
+        vector<uint64_t> loaded((size_t)header[2]);
+        if (!reader.read((char *)loaded.data(), loaded.size() * sizeof(uint64_t)))
+        {
+            return false;
+        }
+        words = move(loaded);
+        capacity = (size_t)header[1];
+        return true;
+    }
+
+private:
+    static uint64_t mix(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    size_t block_of(uint64_t hash) const
+    {
+        return (size_t)(((hash >> 32) * (words.size() / WORDS_PER_BLOCK)) >> 32);
+    }
+
+    // One bit per word, picked by the top bits of the low half of the hash times an odd constant.
+    static uint64_t bit_of(uint64_t hash, size_t word)
+    {
+        static const uint32_t salts[WORDS_PER_BLOCK] = {
+            0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+            0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u };
+        uint32_t product = (uint32_t)hash * salts[word];
+        return 1ull << (product >> 26);
+    }
+};
+
+// Prefixes shared by many keys, such as "sensor-12-" in "sensor-12-3456",
+// numbered in the order they are first seen. New prefixes are appended to a
+// file (length byte, then the characters) before any page that uses them can
+// be written back, so records can refer to them by number.
+class KeyDictionary
+{
+    vector<string> prefixes;
+    unordered_map<string, uint32_t> ids;
+    AppendFile file;
+
+public:
+    constexpr static size_t MAX_PREFIXES = 1 << 16;
+    constexpr static size_t MAX_PREFIX = 255;
+
+    KeyDictionary(const filesystem::path &file_path)
+    {
+        ifstream reader(file_path, ios_base::binary);
+        string contents((istreambuf_iterator<char>(reader)), istreambuf_iterator<char>());
+        // a torn entry at the end is dropped
+        for (size_t offset = 0; offset < contents.size() && offset + 1 + (unsigned char)contents[offset] <= contents.size();)
+        {
+            size_t length = (unsigned char)contents[offset];
+            string prefix = contents.substr(offset + 1, length);
+            ids.emplace(prefix, (uint32_t)prefixes.size());
+            prefixes.push_back(prefix);
+            offset += 1 + length;
+        }
+        file.open(file_path);
+    }
+
+    size_t size() const
+    {
+        return prefixes.size();
+    }
+
+    const string &prefix(uint32_t id) const
+    {
+        if (id >= prefixes.size())
+        {
+            throw runtime_error("unknown key prefix " + to_string(id));
+        }
+        return prefixes[id];
+    }
+
+    // The number of key's prefix, adding it if needed, or -1 if key has none worth sharing.
+    int64_t find_or_add(string_view key)
+    {
+        size_t length = key.length();
+        while (length > 0 && isdigit((unsigned char)key[length - 1]))
+        {
+            length--;
+        }
+        if (length < 2 || length > MAX_PREFIX)
+        {
+            return -1;
+        }
+        string prefix(key.substr(0, length));
+        auto found = ids.find(prefix);
+        if (found != ids.end())
+        {
+            return found->second;
+        }
+        if (prefixes.size() >= MAX_PREFIXES)
+        {
+            return -1;
+        }
+        string entry(1, (char)length);
+        entry += prefix;
+        file.write(entry.data(), entry.size());
+        ids.emplace(prefix, (uint32_t)prefixes.size());
+        prefixes.push_back(prefix);
+        return prefixes.size() - 1;
+    }
+};
+
+// Variable-length record layout, used in slotted pages:
+//   varint  key prefix number + 1, or 0 for none
+//   varint  length of the rest of the key, then its characters
+//   varint  timestamp, zigzag encoded
+//   varint  each reading, zigzag encoded
+struct VarRecord
+{
+    static void put_varint(string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out += (char)((value & 0x7F) | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static uint64_t get_varint(const char *&cursor, const char *end)
+    {
+        uint64_t result = 0;
+        for (int shift = 0; cursor < end && shift < 64; shift += 7)
+        {
+            uint8_t byte = (uint8_t)*cursor++;
+            result |= (uint64_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return result;
+            }
+        }
+        throw runtime_error("truncated record");
+    }
+
+    static uint64_t zigzag(int64_t value)
+    {
+        return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value)
+    {
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    static string encode(const BasicRecord &record, KeyDictionary &dictionary)
+    {
+        string result;
+        int64_t prefix = dictionary.find_or_add(record.name);
+        size_t shared = prefix < 0 ? 0 : dictionary.prefix((uint32_t)prefix).length();
+        put_varint(result, (uint64_t)(prefix + 1));
+        put_varint(result, record.name.length() - shared);
+        result.append(record.name, shared, string::npos);
+        put_varint(result, zigzag(record.timestamp));
+        for (int reading : record.readings)
+        {
+            put_varint(result, zigzag(reading));
+        }
+        return result;
+    }
+
+    static BasicRecord decode(string_view encoded, const KeyDictionary &dictionary)
+    {
+        BasicRecord result;
+        const char *cursor = encoded.data(), *end = encoded.data() + encoded.size();
+        result.name = decode_key(cursor, end, dictionary);
+        result.timestamp = (int)unzigzag(get_varint(cursor, end));
+        for (int &reading : result.readings)
+        {
+            reading = (int)unzigzag(get_varint(cursor, end));
+        }
+        return result;
+    }
+
+    static string decode_key(const char *&cursor, const char *end, const KeyDictionary &dictionary)
+    {
+        uint64_t prefix = get_varint(cursor, end);
+        uint64_t length = get_varint(cursor, end);
+        if (length > (uint64_t)(end - cursor))
+        {
+            throw runtime_error("truncated record");
+        }
+        string result = prefix == 0 ? string() : dictionary.prefix((uint32_t)(prefix - 1));
+        result.append(cursor, (size_t)length);
+        cursor += length;
+        return result;
+    }
+};
+
+// Records of any length in one page: a header (uint16 slot count, uint16 start
+// of the record bytes), a directory of slots (uint16 offset, uint16 length)
+// growing from the front and the record bytes growing from the back. A record
+// keeps its slot number while it stays in the page, so an index can point at
+// (page, slot) while the page moves bytes around to reuse freed space. An
+// all-zero page is empty; offset 0 marks a free slot.
+class SlottedPage
+{
+    char *page;
+    size_t size;
+
+public:
+    constexpr static size_t HEADER_SIZE = 4;
+    constexpr static size_t SLOT_SIZE = 4;
+
+    SlottedPage(char *page, size_t size) : page(page), size(size)
+    {
+        assert(size < 65536);
+    }
+
+    // The largest record an empty page can hold.
+    static size_t max_record(size_t page_size)
+    {
+        return page_size - HEADER_SIZE - SLOT_SIZE;
+    }
+
+    size_t slot_count() const
+    {
+        return get(0);
+    }
+
+    string_view record(size_t slot) const
+    {
+        if (slot >= slot_count() || offset(slot) == 0)
+        {
+            return string_view();
+        }
+        return string_view(page + offset(slot), length(slot));
+    }
+
+    // Bytes free for records, counting space left by records that were erased or shrunk.
+    size_t free_space() const
+    {
+        size_t used = HEADER_SIZE + slot_count() * SLOT_SIZE;
+        for (size_t slot = 0; slot < slot_count(); slot++)
+        {
+            used += length(slot);
+        }
+        return size - used;
+    }
+
+    bool insert(string_view bytes, uint32_t &slot)
+    {
+        size_t count = slot_count();
+        for (slot = 0; slot < count && offset(slot) != 0; slot++)
+        {
+        }
+        size_t needed = bytes.size() + (slot == count ? SLOT_SIZE : 0);
+        if (bytes.empty() || free_space() < needed)
+        {
+            return false;
+        }
+        if (slot == count)
+        {
+            // the new slot may only take the gap if the record fits after it
+            if (data_start() - (HEADER_SIZE + count * SLOT_SIZE) < needed)
+            {
+                compact();
+            }
+            set(0, (uint16_t)(count + 1));
+            set_slot(slot, 0, 0);
+        }
+        place(slot, bytes);
+        return true;
+    }
+
+    bool update(uint32_t slot, string_view bytes)
+    {
+        size_t old_length = length(slot);
+        if (bytes.size() <= old_length)
+        {
+            memcpy(page + offset(slot), bytes.data(), bytes.size());
+            set_slot(slot, offset(slot), bytes.size());
+            return true;
+        }
+        if (free_space() + old_length < bytes.size())
+        {
+            return false;
+        }
+        set_slot(slot, 0, 0);
+        place(slot, bytes);
+        return true;
+    }
+
+    void erase(uint32_t slot)
+    {
+        set_slot(slot, 0, 0);
+    }
+
+private:
+    uint16_t get(size_t position) const
+    {
+        uint16_t value;
+        memcpy(&value, page + position, sizeof(value));
+        return value;
+    }
+
+    void set(size_t position, uint16_t value)
+    {
+        memcpy(page + position, &value, sizeof(value));
+    }
+
+    size_t data_start() const
+    {
+        uint16_t start = get(2);
+        return start == 0 ? size : start;
+    }
+
+    size_t offset(size_t slot) const { return get(HEADER_SIZE + slot * SLOT_SIZE); }
+    size_t length(size_t slot) const { return get(HEADER_SIZE + slot * SLOT_SIZE + 2); }
+
+    void set_slot(size_t slot, size_t offset, size_t length)
+    {
+        set(HEADER_SIZE + slot * SLOT_SIZE, (uint16_t)offset);
+        set(HEADER_SIZE + slot * SLOT_SIZE + 2, (uint16_t)length);
+    }
+
+    // Caller has checked that the bytes fit once the page is compacted.
+    void place(uint32_t slot, string_view bytes)
+    {
+        if (data_start() - (HEADER_SIZE + slot_count() * SLOT_SIZE) < bytes.size())
+        {
+            compact();
+        }
+        size_t start = data_start() - bytes.size();
+        memcpy(page + start, bytes.data(), bytes.size());
+        set(2, (uint16_t)start);
+        set_slot(slot, start, bytes.size());
+    }
+
+    // Moves the live records to the back of the page, closing the gaps between them.
+    void compact()
+    {
+        vector<pair<uint32_t, string>> live;
+        for (uint32_t slot = 0; slot < slot_count(); slot++)
+        {
+            if (offset(slot) != 0)
+            {
+                live.push_back({ slot, string(record(slot)) });
+            }
+        }
+        size_t start = size;
+        for (const auto &[slot, bytes] : live)
+        {
+            start -= bytes.size();
+            memcpy(page + start, bytes.data(), bytes.size());
+            set_slot(slot, start, bytes.size());
+        }
+        set(2, (uint16_t)start);
+    }
+};
+
+// A block per file, <id>.db. Each file starts with "SDXB" and the CRC-32C of
+// the block, and is replaced by writing <id>.db.tmp, syncing it and renaming
+// it over the old file, so a crash leaves either the old block or the new one.
+// A block that fails its check throws on read. Files without the header are
+// from before there were checksums and are read as they are.
+class BlockFileStore : public PageStore
+{
+    filesystem::path db_dir;
+    size_t block_size;
+    size_t fault_after = SIZE_MAX;
+
+public:
+    constexpr static size_t BLOCK_SIZE = BlockDb::records_per_block * BasicRecord::packed_size;
+    constexpr static size_t SLOTTED_BLOCK_SIZE = 4096;
+    constexpr static char MAGIC[4] = { 'S', 'D', 'X', 'B' };
+    constexpr static size_t HEADER_SIZE = 8;
+
+    BlockFileStore(const filesystem::path &db_dir, size_t block_size = BLOCK_SIZE) : db_dir(db_dir), block_size(block_size) {}
+
+    size_t page_size() const override
+    {
+        return block_size;
+    }
+
+    filesystem::path get_file_path(uint64_t block_id) const
+    {
+        filesystem::path result(db_dir);
+        result /= to_string(block_id);
+        result += ".db";
+        return result;
+    }
+
+    // Blocks written before they were fixed size may be short, the rest reads as empty slots.
+    void read_page(uint64_t block_id, char *buffer) override
+    {
+        if (!read_block(get_file_path(block_id), buffer))
+        {
+            throw runtime_error("checksum mismatch in " + get_file_path(block_id).string());
+        }
+    }
+
+    void write_page(uint64_t block_id, const char *buffer) override
+    {
+        filesystem::path file_path = get_file_path(block_id);
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp";
+        string contents(MAGIC, sizeof(MAGIC));
+        uint32_t crc = Crc32c::compute(buffer, block_size);
+        contents.append((const char *)&crc, sizeof(crc));
+        contents.append(buffer, block_size);
+
+        filesystem::remove(temp_path);
+        AppendFile writer;
+        writer.open(temp_path);
+        if (fault_after < contents.size())
+        {
+            writer.write(contents.data(), fault_after);
+            fault_after = SIZE_MAX;
+            throw runtime_error("injected fault writing " + temp_path.string());
+        }
+        writer.write(contents.data(), contents.size());
+        writer.sync();
+        writer.close();
+        filesystem::rename(temp_path, file_path);
+    }
+
+    // Checks every block with up to the given number of threads and returns the
+    // ids of the bad ones in order. Temp files left by interrupted writes are removed.
+    vector<uint64_t> verify(size_t threads = thread::hardware_concurrency())
+    {
+        vector<filesystem::path> files;
+        for (const auto &entry : filesystem::directory_iterator(db_dir))
+        {
+            if (entry.path().extension() == L".tmp")
+            {
+                filesystem::remove(entry.path());
+            }
+            else if (entry.path().extension() == L".db")
+            {
+                files.push_back(entry.path());
+            }
+        }
+        atomic<size_t> next{ 0 };
+        mutex result_lock;
+        vector<uint64_t> corrupt;
+        auto check = [&]()
+        {
+            vector<char> buffer(block_size);
+            for (size_t i; (i = next++) < files.size();)
+            {
+                if (!read_block(files[i], buffer.data()))
+                {
+                    lock_guard<mutex> guard(result_lock);
+                    corrupt.push_back((uint64_t)stoull(files[i].stem().string()));
+                }
+            }
+        };
+        vector<thread> workers;
+        for (size_t t = 1; t < min(max<size_t>(threads, 1), files.size()); t++)
+        {
+            workers.emplace_back(check);
+        }
+        check();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        sort(corrupt.begin(), corrupt.end());
+        return corrupt;
+    }
+
+    // For tests: the next write stops after this many bytes of the temp file and throws.
+    void inject_write_fault(size_t bytes)
+    {
+        fault_after = bytes;
+    }
+
+private:
+    bool read_block(const filesystem::path &file_path, char *buffer) const
+    {
+        memset(buffer, 0, block_size);
+        ifstream reader(file_path, ios_base::binary);
+        if (!reader.is_open())
+        {
+            return true;
+        }
+        char header[HEADER_SIZE];
+        reader.read(header, sizeof(header));
+        size_t got = (size_t)reader.gcount();
+        if (got == 0)
+        {
+            return true;
+        }
+        if (got < sizeof(header))
+        {
+            // even an old block holds a whole record
+            return false;
+        }
+        if (memcmp(header, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            // no checksum to check, but an old block is never longer than a
+            // block, so a longer file is a new one with a damaged header
+            memcpy(buffer, header, min(got, block_size));
+            if (block_size > got)
+            {
+                reader.read(buffer + got, block_size - got);
+            }
+            return got <= block_size && reader.peek() == char_traits<char>::eof();
+        }
+        uint32_t crc;
+        memcpy(&crc, header + sizeof(MAGIC), sizeof(crc));
+        reader.read(buffer, block_size);
+        return (size_t)reader.gcount() == block_size && Crc32c::compute(buffer, block_size) == crc;
+    }
+};
+
+enum class RecordFormat
+{
+    fixed,      // BasicRecord::pack, records_per_block to a block
+    slotted,    // VarRecord in 4 KB slotted pages
+};
+
+// A record field with a secondary index on it.
+struct IndexSpec
+{
+    constexpr static int TIMESTAMP = -1;
+
+    int field = TIMESTAMP;              // TIMESTAMP or a reading number
+
+    static IndexSpec timestamp()
+    {
+        return { TIMESTAMP };
+    }
+
+    static IndexSpec reading(int number)
+    {
+        if (number < 0 || number >= (int)(sizeof(BasicRecord::readings) / sizeof(int)))
+        {
+            throw invalid_argument("no reading " + to_string(number));
+        }
+        return { number };
+    }
+
+    string name() const
+    {
+        return field == TIMESTAMP ? "timestamp" : "reading" + to_string(field);
+    }
+
+    int value(const BasicRecord &record) const
+    {
+        return field == TIMESTAMP ? record.timestamp : record.readings[field];
+    }
+};
+
+struct BlockFileOptions
+{
+    size_t cache_blocks = 1024;
+    size_t cache_pages = 64;            // for the index
+    RecordFormat format = RecordFormat::fixed;
+    size_t bloom_bits_per_key = 10;     // 0 for no filter in front of the index
+    vector<IndexSpec> indexes;          // secondary indexes to keep
+    size_t index_batch = 1024;          // changes buffered per secondary index
+    size_t verify_threads = 0;          // checks every block on open when not 0
+};
+
+struct QueryResult
+{
+    vector<BasicRecord> records;
+    size_t rows_examined = 0;           // records read to answer the query
+    bool used_index = false;
+};
+
+struct BloomStats
+{
+    size_t checks = 0;
+    size_t negatives = 0;
+    size_t rebuilds = 0;
+};
+
+// Blocks of records in numbered .db files, found through a B+tree index
+// (index.bpt) from key to block and slot, so opening the database reads
+// nothing but the tree's root. Blocks are cached in a fixed number of frames
+// with CLOCK eviction; changed blocks are written when evicted or flushed.
+//
+// The record format is chosen when the database is created and kept in a
+// "format" file. Fixed blocks place record n at block n / records_per_block;
+// slotted records are appended to the last page and the index's user value
+// counts pages instead of records.
+//
+// A blocked bloom filter of every key (keys.bloom) answers most gets for
+// missing keys without reading the index. It is saved on flush together with
+// the number of keys it covers and rebuilt from the index, at twice the size,
+// when it fills up or doesn't match the index on open.
+//
+// Each secondary index is a B+tree (index.<field>.bpt) from the field value
+// and key to the record's block and slot. Changes are buffered and applied in
+// key order once enough have built up, before a query and on flush. The
+// "indexes" file names the indexes that were current at the last flush; it is
+// removed on the first change after that, so an index missing from it is
+// rebuilt on open.
+class BlockFileDb : public Database
+{
+    struct IndexChange
+    {
+        string key;
+        bool erase;
+        BlockSlot location;
+    };
+
+    struct SecondaryIndex
+    {
+        IndexSpec spec;
+        unique_ptr<BPlusTree> tree;
+        vector<IndexChange> pending;
+    };
+
+    filesystem::path db_dir;
+    RecordFormat format;
+    size_t next_id = 0;
+    unique_ptr<BPlusTree> tree;
+    unique_ptr<BlockFileStore> store;
+    unique_ptr<BufferPool> pool;
+    unique_ptr<KeyDictionary> dictionary;
+    size_t bloom_bits_per_key;
+    BlockedBloomFilter bloom;
+    BloomStats bloom_counters;
+    vector<SecondaryIndex> indexes;
+    size_t index_batch;
+    bool indexes_clean = false;
+
+public:
+    constexpr static size_t records_per_block = BlockDb::records_per_block;
+
+    BlockFileDb(const filesystem::path &db_dir, const BlockFileOptions &options = {})
+        : db_dir(db_dir), format(options.format), bloom_bits_per_key(options.bloom_bits_per_key),
+          index_batch(max<size_t>(options.index_batch, 1))
+    {
+        check_format();
+        tree = make_unique<BPlusTree>(db_dir / "index.bpt", options.cache_pages);
+        if (format == RecordFormat::slotted)
+        {
+            store = make_unique<BlockFileStore>(db_dir, BlockFileStore::SLOTTED_BLOCK_SIZE);
+            dictionary = make_unique<KeyDictionary>(db_dir / "keys.dict");
+        }
+        else
+        {
+            store = make_unique<BlockFileStore>(db_dir);
+        }
+        if (options.verify_threads > 0)
+        {
+            vector<uint64_t> corrupt = store->verify(options.verify_threads);
+            if (!corrupt.empty())
+            {
+                throw runtime_error(db_dir.string() + " has " + to_string(corrupt.size()) + " corrupt blocks, the first is " + to_string(corrupt[0]));
+            }
+        }
+        pool = make_unique<BufferPool>(*store, options.cache_blocks);
+        next_id = (size_t)tree->user_value();
+        if (tree->size() == 0)
+        {
+            build_index();
+        }
+        if (bloom_bits_per_key > 0 && !bloom.load(db_dir / "keys.bloom", tree->size()))
+        {
+            rebuild_bloom();
+        }
+        open_indexes(options);
+    }
+
+    ~BlockFileDb()
+    {
+        flush();
+    }
+
+    size_t num_records()
+    {
+        return tree->size();
+    }
+
+    const PoolStats &block_stats() const
+    {
+        return pool->stats();
+    }
+
+    const PoolStats &index_stats() const
+    {
+        return tree->stats();
+    }
+
+    const BloomStats &bloom_stats() const
+    {
+        return bloom_counters;
+    }
+
+    void flush()
+    {
+        pool->flush();
+        tree->flush();
+        if (bloom_bits_per_key > 0)
+        {
+            bloom.save(db_dir / "keys.bloom", tree->size());
+        }
+        if (!indexes.empty() && !indexes_clean)
+        {
+            ofstream writer(db_dir / "indexes");
+            for (auto &index : indexes)
+            {
+                apply_changes(index);
+                index.tree->flush();
+                writer << index.spec.name() << endl;
+            }
+            indexes_clean = true;
+        }
+    }
+
+    // Records with begin <= timestamp < end, in timestamp order when indexed.
+    QueryResult find_by_timestamp_range(int begin, int end)
+    {
+        return find_range(IndexSpec::TIMESTAMP, begin, end);
+    }
+
+    // Records with readings[reading] > value, in reading order when indexed.
+    QueryResult find_where_reading_gt(int reading, int value)
+    {
+        return find_range(IndexSpec::reading(reading).field, (int64_t)value + 1, (int64_t)INT_MAX + 1);
+    }
+
+    virtual void add(const BasicRecord & record) override
+    {
+        if (format == RecordFormat::slotted)
+        {
+            add_slotted(record);
+            return;
+        }
+        string key = record.key();
+        check_indexable(key);
+        BlockSlot location;
+        if (!tree->find(key, location))
+        {
+            size_t seq_id = next_id++;
+            location = { (uint32_t)(seq_id / records_per_block), (uint32_t)(seq_id % records_per_block) };
+            tree->set_user_value(next_id);
+            tree->insert(key, location);
+            add_to_bloom(key);
+        }
+        PageHandle block = pool->fetch(location.block);
+        char *slot = block.data() + location.slot * BasicRecord::packed_size;
+        update_indexes(slot, record, location);
+        record.pack(slot);
+        block.mark_dirty();
+    }
+
+    // Keys are looked up in the index in key order and the records written
+    // block by block, so each block is fetched and dirtied once per batch.
+    void add_batch(const BasicRecord *records, size_t count) override
+    {
+        if (format == RecordFormat::slotted)
+        {
+            Database::add_batch(records, count);
+            return;
+        }
+        vector<size_t> order(count);
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [&](size_t left, size_t right) { return records[left].name < records[right].name; });
+        vector<pair<BlockSlot, size_t>> placed;
+        placed.reserve(count);
+        for (size_t i : order)
+        {
+            check_indexable(records[i].key());
+        }
+        for (size_t i : order)
+        {
+            BlockSlot location;
+            if (!tree->find(records[i].key(), location))
+            {
+                size_t seq_id = next_id++;
+                location = { (uint32_t)(seq_id / records_per_block), (uint32_t)(seq_id % records_per_block) };
+                tree->insert(records[i].key(), location);
+                add_to_bloom(records[i].name);
+            }
+            placed.push_back({ location, i });
+        }
+        tree->set_user_value(next_id);
+        // a later record for the same key is written last
+        sort(placed.begin(), placed.end(), [](const pair<BlockSlot, size_t> &left, const pair<BlockSlot, size_t> &right)
+        {
+            return make_tuple(left.first.block, left.first.slot, left.second) < make_tuple(right.first.block, right.first.slot, right.second);
+        });
+        for (size_t start = 0; start < placed.size();)
+        {
+            PageHandle block = pool->fetch(placed[start].first.block);
+            for (; start < placed.size() && placed[start].first.block == block.id(); start++)
+            {
+                char *slot = block.data() + placed[start].first.slot * BasicRecord::packed_size;
+                update_indexes(slot, records[placed[start].second], placed[start].first);
+                records[placed[start].second].pack(slot);
+            }
+            block.mark_dirty();
+        }
+    }
+
+    virtual BasicRecord get(const string & key) override
+    {
+        BlockSlot location;
+        if (!might_exist(key) || !tree->find(key, location))
+        {
+            return BasicRecord();
+        }
+        return read(location);
+    }
+
+    // Records are read block by block in block order; each run of blocks that
+    // fits in half the cache is prefetched before its records are copied out.
+    void get_batch(const string *keys, size_t count, BasicRecord *result) override
+    {
+        vector<size_t> order(count);
+        iota(order.begin(), order.end(), 0);
+        sort(order.begin(), order.end(), [&](size_t left, size_t right) { return keys[left] < keys[right]; });
+        vector<pair<BlockSlot, size_t>> found;
+        for (size_t i : order)
+        {
+            BlockSlot location;
+            if (might_exist(keys[i]) && tree->find(keys[i], location))
+            {
+                found.push_back({ location, i });
+            }
+            else
+            {
+                result[i] = BasicRecord();
+            }
+        }
+        sort(found.begin(), found.end(), [](const pair<BlockSlot, size_t> &left, const pair<BlockSlot, size_t> &right)
+        {
+            return make_pair(left.first.block, left.first.slot) < make_pair(right.first.block, right.first.slot);
+        });
+        size_t run_blocks = max<size_t>(pool->capacity() / 2, 1);
+        for (size_t start = 0; start < found.size();)
+        {
+            vector<uint64_t> blocks;
+            size_t end = start;
+            for (; end < found.size() && (blocks.size() < run_blocks || found[end].first.block == blocks.back()); end++)
+            {
+                if (blocks.empty() || found[end].first.block != blocks.back())
+                {
+                    blocks.push_back(found[end].first.block);
+                }
+            }
+            pool->prefetch(blocks);
+            for (; start < end; start++)
+            {
+                result[found[start].second] = read(found[start].first);
+            }
+        }
+    }
+
+    virtual vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        vector<BasicRecord> result;
+        tree->scan(begin_key, end_key, [&](string_view, BlockSlot location)
+        {
+            result.push_back(read(location));
+            return true;
+        });
+        return result;
+    }
+
+private:
+    void check_format()
+    {
+        const char *names[] = { "fixed", "slotted" };
+        filesystem::path format_path = db_dir / "format";
+        ifstream reader(format_path);
+        if (reader.is_open())
+        {
+            string stored;
+            reader >> stored;
+            if (stored != names[(int)format])
+            {
+                throw runtime_error(db_dir.string() + " uses the " + stored + " record format");
+            }
+        }
+        else if (format != RecordFormat::fixed && filesystem::exists(db_dir / "0.db"))
+        {
+            // blocks from before there was a choice
+            throw runtime_error(db_dir.string() + " uses the fixed record format");
+        }
+        else
+        {
+            ofstream(format_path) << names[(int)format] << endl;
+        }
+    }
+
+    bool might_exist(const string &key)
+    {
+        if (bloom_bits_per_key == 0)
+        {
+            return true;
+        }
+        bloom_counters.checks++;
+        if (bloom.may_contain(key))
+        {
+            return true;
+        }
+        bloom_counters.negatives++;
+        return false;
+    }
+
+    // Called once key is in the index.
+    // Call after the key is in the tree, a rebuild only sees what is there.
+    void add_to_bloom(const string &key)
+    {
+        if (bloom_bits_per_key == 0)
+        {
+            return;
+        }
+        if (tree->size() > bloom.max_keys())
+        {
+            rebuild_bloom();
+        }
+        else
+        {
+            bloom.add(key);
+        }
+    }
+
+    void rebuild_bloom()
+    {
+        bloom = BlockedBloomFilter(max<size_t>(2 * tree->size(), 1024), bloom_bits_per_key);
+        tree->scan("", "", [&](string_view key, BlockSlot)
+        {
+            bloom.add(key);
+            return true;
+        });
+        bloom_counters.rebuilds++;
+    }
+
+    BasicRecord read(BlockSlot location)
+    {
+        PageHandle block = pool->fetch(location.block);
+        if (format == RecordFormat::slotted)
+        {
+            return VarRecord::decode(SlottedPage(block.data(), store->page_size()).record(location.slot), *dictionary);
+        }
+        return BasicRecord::unpack(block.data() + location.slot * BasicRecord::packed_size);
+    }
+
+    // Rewrites the record in its page if it still fits, otherwise moves it to the last page.
+    void add_slotted(const BasicRecord &record)
+    {
+        string encoded = VarRecord::encode(record, *dictionary);
+        if (encoded.size() > SlottedPage::max_record(store->page_size()))
+        {
+            throw invalid_argument("record too large for a page: " + record.name);
+        }
+        check_indexable(record.key());
+        BlockSlot location;
+        BasicRecord old;
+        bool exists = tree->find(record.key(), location);
+        if (exists)
+        {
+            PageHandle block = pool->fetch(location.block);
+            SlottedPage page(block.data(), store->page_size());
+            if (!indexes.empty())
+            {
+                old = VarRecord::decode(page.record(location.slot), *dictionary);
+            }
+            block.mark_dirty();
+            if (page.update(location.slot, encoded))
+            {
+                update_indexes(&old, record, location);
+                return;
+            }
+            page.erase(location.slot);
+        }
+        location = append_slotted(encoded);
+        tree->insert(record.key(), location);
+        if (!exists)
+        {
+            add_to_bloom(record.name);
+        }
+        update_indexes(exists ? &old : nullptr, record, location);
+    }
+
+    // Adds an encoded record to the last page, or a new one if it doesn't fit.
+    BlockSlot append_slotted(const string &encoded)
+    {
+        BlockSlot location;
+        // next_id counts pages here
+        if (next_id > 0)
+        {
+            PageHandle block = pool->fetch(next_id - 1);
+            if (SlottedPage(block.data(), store->page_size()).insert(encoded, location.slot))
+            {
+                block.mark_dirty();
+                location.block = (uint32_t)(next_id - 1);
+                return location;
+            }
+        }
+        PageHandle block = pool->fetch(next_id);
+        SlottedPage(block.data(), store->page_size()).insert(encoded, location.slot);
+        block.mark_dirty();
+        location.block = (uint32_t)next_id++;
+        tree->set_user_value(next_id);
+        return location;
+    }
+
+    // Opens the declared secondary indexes, rebuilding any that may be stale.
+    void open_indexes(const BlockFileOptions &options)
+    {
+        set<string> current;
+        ifstream reader(db_dir / "indexes");
+        for (string name; reader >> name;)
+        {
+            current.insert(name);
+        }
+        reader.close();
+        for (const IndexSpec &spec : options.indexes)
+        {
+            filesystem::path index_path = db_dir / ("index." + spec.name() + ".bpt");
+            bool stale = current.count(spec.name()) == 0;
+            if (stale)
+            {
+                filesystem::remove(index_path);
+            }
+            indexes.push_back({ spec, make_unique<BPlusTree>(index_path, options.cache_pages), {} });
+            if (stale)
+            {
+                SecondaryIndex &index = indexes.back();
+                tree->scan("", "", [&](string_view key, BlockSlot location)
+                {
+                    index.pending.push_back({ index_key(spec.value(read(location)), key), false, location });
+                    return true;
+                });
+                apply_changes(index);
+            }
+        }
+        filesystem::remove(db_dir / "indexes");
+        flush();
+    }
+
+    // The value in sign-flipped big-endian order so that keys sort by value first.
+    static string index_key(int value, string_view key)
+    {
+        uint32_t ordered = (uint32_t)value ^ 0x80000000u;
+        char prefix[4] = { (char)(ordered >> 24), (char)(ordered >> 16), (char)(ordered >> 8), (char)ordered };
+        string result(prefix, sizeof(prefix));
+        result.append(key);
+        return result;
+    }
+
+    void check_indexable(const string &key)
+    {
+        if (!indexes.empty() && index_key(0, key).length() >= BPlusTree::KEY_SIZE)
+        {
+            throw invalid_argument("key too long for a secondary index: " + key);
+        }
+    }
+
+    // Called before a fixed size record is packed over its slot.
+    void update_indexes(const char *slot, const BasicRecord &record, BlockSlot location)
+    {
+        if (!indexes.empty())
+        {
+            BasicRecord old = BasicRecord::unpack(slot);
+            update_indexes(old.name.empty() ? nullptr : &old, record, location);
+        }
+    }
+
+    void update_indexes(const BasicRecord *old, const BasicRecord &record, BlockSlot location)
+    {
+        if (indexes.empty())
+        {
+            return;
+        }
+        if (indexes_clean)
+        {
+            filesystem::remove(db_dir / "indexes");
+            indexes_clean = false;
+        }
+        for (auto &index : indexes)
+        {
+            if (old != nullptr)
+            {
+                index.pending.push_back({ index_key(index.spec.value(*old), old->name), true, {} });
+            }
+            index.pending.push_back({ index_key(index.spec.value(record), record.name), false, location });
+            if (index.pending.size() >= index_batch)
+            {
+                apply_changes(index);
+            }
+        }
+    }
+
+    // In key order, so the tree's pages are visited once per batch. The sort is
+    // stable so a key's changes are applied in the order they were made.
+    void apply_changes(SecondaryIndex &index)
+    {
+        stable_sort(index.pending.begin(), index.pending.end(), [](const IndexChange &left, const IndexChange &right)
+        {
+            return left.key < right.key;
+        });
+        for (const IndexChange &change : index.pending)
+        {
+            if (change.erase)
+            {
+                index.tree->erase(change.key);
+            }
+            else
+            {
+                index.tree->insert(change.key, change.location);
+            }
+        }
+        index.pending.clear();
+    }
+
+    // Records with low <= field < high, through the field's index if there is one.
+    QueryResult find_range(int field, int64_t low, int64_t high)
+    {
+        QueryResult result;
+        if (low >= high)
+        {
+            return result;
+        }
+        for (auto &index : indexes)
+        {
+            if (index.spec.field == field)
+            {
+                apply_changes(index);
+                string end_key = high > INT_MAX ? "" : index_key((int)high, "");
+                index.tree->scan(index_key((int)low, ""), end_key, [&](string_view, BlockSlot location)
+                {
+                    result.records.push_back(read(location));
+                    result.rows_examined++;
+                    return true;
+                });
+                result.used_index = true;
+                return result;
+            }
+        }
+        IndexSpec spec{ field };
+        tree->scan("", "", [&](string_view, BlockSlot location)
+        {
+            BasicRecord record = read(location);
+            result.rows_examined++;
+            if (spec.value(record) >= low && spec.value(record) < high)
+            {
+                result.records.push_back(record);
+            }
+            return true;
+        });
+        return result;
+    }
+
+    // Indexes the .db files of a database written before the tree existed.
+    void build_index()
+    {
+        set<filesystem::path> files;
+        for (const auto &entry : filesystem::directory_iterator(db_dir))
+        {
+            if (entry.is_regular_file())
+            {
+                auto extension = entry.path().extension();
+                if (extension == L".db")
+                {
+                    files.emplace(entry.path());
+                }
+            }
+        }
+        for (const auto &file : files)
+        {
+            uint32_t block_id = (uint32_t)_wtoi(file.stem().c_str());
+            PageHandle block = pool->fetch(block_id);
+            if (format == RecordFormat::slotted)
+            {
+                SlottedPage page(block.data(), store->page_size());
+                for (uint32_t slot = 0; slot < page.slot_count(); slot++)
+                {
+                    string_view encoded = page.record(slot);
+                    if (!encoded.empty())
+                    {
+                        const char *cursor = encoded.data();
+                        tree->insert(VarRecord::decode_key(cursor, encoded.data() + encoded.size(), *dictionary), { block_id, slot });
+                    }
+                }
+                next_id = max(next_id, (size_t)block_id + 1);
+                continue;
+            }
+            for (uint32_t slot = 0; slot < records_per_block; slot++)
+            {
+                BasicRecordView record{ block.data() + slot * BasicRecord::packed_size };
+                if (!record.name().empty())
+                {
+                    tree->insert(string(record.name()), { block_id, slot });
+                    next_id = max(next_id, (size_t)block_id * records_per_block + slot + 1);
+                }
+            }
+        }
+        tree->set_user_value(next_id);
+        tree->flush();
+    }
+};
+
+// Bloom filter over keys. The k probes come from one 64-bit hash by double hashing.
+class BloomFilter
+{
+    vector<uint8_t> bits;
+    uint32_t hashes = 1;
+
+public:
+    BloomFilter() = default;
+
+    BloomFilter(size_t keys, size_t bits_per_key)
+        : bits((max<size_t>(keys * bits_per_key, 64) + 7) / 8),
+          hashes((uint32_t)min<size_t>(max<size_t>(bits_per_key * 69 / 100, 1), 30))
+    {
+    }
+
+    BloomFilter(const char *data, size_t bytes, uint32_t hashes)
+        : bits((const uint8_t *)data, (const uint8_t *)data + bytes), hashes(hashes)
+    {
+    }
+
+    const vector<uint8_t> &data() const
+    {
+        return bits;
+    }
+
+    uint32_t num_hashes() const
+    {
+        return hashes;
+    }
+
+    void add(string_view key)
+    {
+        uint64_t hash = mix(stable_hash(key));
+        uint64_t delta = (hash >> 33) | (hash << 31);
+        for (uint32_t i = 0; i < hashes; i++, hash += delta)
+        {
+            size_t bit = hash % (bits.size() * 8);
+            bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+    }
+
+    bool may_contain(string_view key) const
+    {
+        uint64_t hash = mix(stable_hash(key));
+        uint64_t delta = (hash >> 33) | (hash << 31);
+        for (uint32_t i = 0; i < hashes; i++, hash += delta)
+        {
+            size_t bit = hash % (bits.size() * 8);
+            if ((bits[bit / 8] & (1 << (bit % 8))) == 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // FNV-1a of short, similar keys leaves the high bits poorly mixed.
+    static uint64_t mix(uint64_t hash)
+    {
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+};
+
+struct LsmOptions
+{
+    size_t memtable_records = 4096;
+    size_t table_records = 4096;        // records per table written by a compaction
+    size_t level0_tables = 4;           // level 0 tables that start a compaction into level 1
+    size_t level_ratio = 10;            // each level below 0 holds this many times the one above
+    size_t bloom_bits_per_key = 10;
+    size_t index_interval = 16;         // records per sparse index entry
+    bool sync = false;                  // sync the log after every add
+};
+
+struct LsmStats
+{
+    size_t records_added = 0;
+    size_t flushes = 0;
+    size_t compactions = 0;
+    size_t bytes_flushed = 0;
+    size_t bytes_compacted = 0;
+    size_t write_stalls = 0;
+    size_t gets = 0;
+    size_t tables_probed = 0;
+    size_t bloom_negatives = 0;
+    size_t records_read = 0;
+
+    // Bytes written to the log and tables for each byte added.
+    double write_amplification() const
+    {
+        size_t added = records_added * BasicRecord::packed_size;
+        return added == 0 ? 0.0 : (double)(added + bytes_flushed + bytes_compacted) / added;
+    }
+
+    // Tables whose key range and bloom filter had to be checked per get.
+    double tables_per_get() const
+    {
+        return gets == 0 ? 0.0 : (double)tables_probed / gets;
+    }
+};
+
+// Immutable file of records sorted by key, memory-mapped while open:
+//   packed records
+//   bloom filter of the keys
+//   sparse index, one 32-byte entry per index_interval records: key (length byte, then the characters) and record number
+//   footer
+// A table that a compaction has replaced is deleted when the last reader lets go of it.
+class SSTable
+{
+    struct Footer
+    {
+        char magic[8];
+        uint64_t count;
+        uint64_t bloom_offset;
+        uint64_t bloom_bytes;
+        uint64_t bloom_hashes;
+        uint64_t index_offset;
+        uint64_t index_count;
+    };
+
+    filesystem::path file_path;
+    uint64_t table_id;
+    MappedFile file;
+    Footer footer;
+    BloomFilter bloom;
+    vector<pair<string, uint64_t>> index;
+    string first, last;
+    atomic<bool> obsolete{ false };
+
+public:
+    constexpr static char MAGIC[8] = { 'S', 'D', 'X', 'S', 'S', 'T', '0', '1' };
+    constexpr static size_t INDEX_KEY_SIZE = 24;
+    constexpr static size_t INDEX_ENTRY_SIZE = 32;
+
+    SSTable(const filesystem::path &file_path, uint64_t table_id) : file_path(file_path), table_id(table_id), file(file_path)
+    {
+        if (file.size() < sizeof(Footer))
+        {
+            throw runtime_error("truncated table " + file_path.string());
+        }
+        memcpy(&footer, file.data() + file.size() - sizeof(Footer), sizeof(Footer));
+        if (memcmp(footer.magic, MAGIC, sizeof(MAGIC)) != 0 || footer.count == 0
+            || footer.index_offset + footer.index_count * INDEX_ENTRY_SIZE + sizeof(Footer) != file.size())
+        {
+            throw runtime_error("bad table " + file_path.string());
+        }
+        bloom = BloomFilter(file.data() + footer.bloom_offset, (size_t)footer.bloom_bytes, (uint32_t)footer.bloom_hashes);
+        for (uint64_t i = 0; i < footer.index_count; i++)
+        {
+            const char *entry = file.data() + footer.index_offset + i * INDEX_ENTRY_SIZE;
+            uint64_t position;
+            memcpy(&position, entry + INDEX_KEY_SIZE, sizeof(position));
+            index.emplace_back(string(entry + 1, (unsigned char)entry[0]), position);
+        }
+        first = string(record(0).name());
+        last = string(record(size() - 1).name());
+    }
+
+    ~SSTable()
+    {
+        file.close();
+        if (obsolete)
+        {
+            error_code ignored;
+            filesystem::remove(file_path, ignored);
+        }
+    }
+
+    uint64_t id() const { return table_id; }
+    size_t size() const { return (size_t)footer.count; }
+    size_t bytes() const { return file.size(); }
+    const string &smallest() const { return first; }
+    const string &largest() const { return last; }
+    void make_obsolete() { obsolete = true; }
+
+    BasicRecordView record(size_t i) const
+    {
+        return { file.data() + i * BasicRecord::packed_size };
+    }
+
+    // Position of the first record with a key >= key, counting the records looked at.
+    size_t lower_bound(string_view key, size_t &records_read) const
+    {
+        auto entry = upper_bound(index.begin(), index.end(), key,
+            [](string_view key, const pair<string, uint64_t> &entry) { return key < entry.first; });
+        size_t position = entry == index.begin() ? 0 : (size_t)prev(entry)->second;
+        for (; position < size(); position++)
+        {
+            records_read++;
+            if (record(position).name() >= key)
+            {
+                break;
+            }
+        }
+        return position;
+    }
+
+    bool find(const string &key, BasicRecord &result, LsmStats &stats) const
+    {
+        if (key < first || key > last)
+        {
+            return false;
+        }
+        stats.tables_probed++;
+        if (!bloom.may_contain(key))
+        {
+            stats.bloom_negatives++;
+            return false;
+        }
+        size_t position = lower_bound(key, stats.records_read);
+        if (position < size() && record(position).name() == key)
+        {
+            result = record(position).record();
+            return true;
+        }
+        return false;
+    }
+};
+
+// Collects packed records in key order and writes them out as an SSTable.
+class SSTableBuilder
+{
+    string records;
+
+public:
+    size_t size() const
+    {
+        return records.size() / BasicRecord::packed_size;
+    }
+
+    void add(const char *packed)
+    {
+        records.append(packed, BasicRecord::packed_size);
+    }
+
+    void add(const BasicRecord &record)
+    {
+        size_t offset = records.size();
+        records.resize(offset + BasicRecord::packed_size);
+        record.pack(&records[offset]);
+    }
+
+    // Writes to a temporary file first, so a table either exists whole or not at all.
+    void finish(const filesystem::path &file_path, const LsmOptions &options)
+    {
+        size_t count = size();
+        BloomFilter bloom(count, options.bloom_bits_per_key);
+        string index;
+        for (size_t i = 0; i < count; i++)
+        {
+            string_view key = BasicRecordView{ records.data() + i * BasicRecord::packed_size }.name();
+            bloom.add(key);
+            if (i % options.index_interval == 0)
+            {
+                char entry[SSTable::INDEX_ENTRY_SIZE] = {};
+                entry[0] = (char)key.length();
+                memcpy(entry + 1, key.data(), key.length());
+                uint64_t position = i;
+                memcpy(entry + SSTable::INDEX_KEY_SIZE, &position, sizeof(position));
+                index.append(entry, sizeof(entry));
+            }
+        }
+        uint64_t footer[7];
+        memcpy(footer, SSTable::MAGIC, sizeof(SSTable::MAGIC));
+        footer[1] = count;
+        footer[2] = records.size();
+        footer[3] = bloom.data().size();
+        footer[4] = bloom.num_hashes();
+        footer[5] = records.size() + bloom.data().size();
+        footer[6] = index.size() / SSTable::INDEX_ENTRY_SIZE;
+
+        filesystem::path temp_path = file_path;
+        temp_path += ".tmp";
+        {
+            ofstream writer(temp_path, ios_base::binary);
+            writer.write(records.data(), records.size());
+            writer.write((const char *)bloom.data().data(), bloom.data().size());
+            writer.write(index.data(), index.size());
+            writer.write((const char *)footer, sizeof(footer));
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, file_path);
+        records.clear();
+    }
+};
+
+// Log-structured merge tree. Adds go to a log and a sorted in-memory memtable;
+// a full memtable is frozen and a background thread writes it out as a level 0
+// SSTable, then merges tables down through levels 1, 2, ... where each level's
+// tables have disjoint key ranges and the level holds level_ratio times more
+// records than the one above. Files in db_dir:
+//   <id>.log     the log of the memtable that will become table <id>
+//   <id>.sst     tables
+//   MANIFEST     which table is in which level
+class LsmDb : public Database
+{
+    struct Version
+    {
+        // level 0 newest first, the others sorted by key
+        vector<vector<shared_ptr<SSTable>>> levels;
+    };
+
+    filesystem::path db_dir;
+    LsmOptions options;
+    mutex lock;
+    condition_variable wake, changed;
+    map<string, BasicRecord> memtable;
+    shared_ptr<const map<string, BasicRecord>> immutable;
+    uint64_t memtable_id = 0;
+    uint64_t immutable_id = 0;
+    uint64_t next_table_id = 1;
+    AppendFile log;
+    shared_ptr<const Version> current;
+    vector<string> compact_pointer;
+    LsmStats counters;
+    bool stopping = false;
+    thread background;
+
+public:
+    LsmDb(const filesystem::path &db_dir, const LsmOptions &options = {}) : db_dir(db_dir), options(options)
+    {
+        filesystem::create_directories(db_dir);
+        recover();
+        memtable_id = next_table_id++;
+        log.open(log_path(memtable_id));
+        background = thread([this] { run_background(); });
+    }
+
+    // The memtable is left in its log and replayed when the database is opened again.
+    ~LsmDb()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        background.join();
+    }
+
+    void add(const BasicRecord &record) override
+    {
+        unique_lock<mutex> guard(lock);
+        char packed[BasicRecord::packed_size];
+        record.pack(packed);
+        log.write(packed, sizeof(packed));
+        if (options.sync)
+        {
+            log.sync();
+        }
+        memtable[record.key()] = record;
+        counters.records_added++;
+        if (memtable.size() >= options.memtable_records)
+        {
+            freeze(guard);
+        }
+    }
+
+    // One log write per memtable the batch fills, so a record is never in
+    // the log of a different memtable than the one holding it.
+    void add_batch(const BasicRecord *records, size_t count) override
+    {
+        unique_lock<mutex> guard(lock);
+        string packed;
+        for (size_t start = 0; start < count;)
+        {
+            size_t room = options.memtable_records > memtable.size() ? options.memtable_records - memtable.size() : 1;
+            size_t end = start + min(room, count - start);
+            packed.resize((end - start) * BasicRecord::packed_size);
+            for (size_t i = start; i < end; i++)
+            {
+                records[i].pack(&packed[(i - start) * BasicRecord::packed_size]);
+                memtable[records[i].key()] = records[i];
+            }
+            log.write(packed.data(), packed.size());
+            if (options.sync)
+            {
+                log.sync();
+            }
+            counters.records_added += end - start;
+            start = end;
+            if (memtable.size() >= options.memtable_records)
+            {
+                freeze(guard);
+            }
+        }
+    }
+
+    BasicRecord get(const string &key) override
+    {
+        BasicRecord result;
+        shared_ptr<const map<string, BasicRecord>> frozen;
+        shared_ptr<const Version> version;
+        {
+            lock_guard<mutex> guard(lock);
+            counters.gets++;
+            auto found = memtable.find(key);
+            if (found != memtable.end())
+            {
+                return found->second;
+            }
+            frozen = immutable;
+            version = current;
+        }
+        if (frozen && frozen->count(key))
+        {
+            return frozen->at(key);
+        }
+        // probed without the lock, the counts are added under it at the end
+        LsmStats probes;
+        bool found = false;
+        for (const auto &table : version->levels[0])
+        {
+            if (table->find(key, result, probes))
+            {
+                found = true;
+                break;
+            }
+        }
+        for (size_t level = 1; !found && level < version->levels.size(); level++)
+        {
+            const auto &tables = version->levels[level];
+            auto table = upper_bound(tables.begin(), tables.end(), key,
+                [](const string &key, const shared_ptr<SSTable> &table) { return key < table->smallest(); });
+            found = table != tables.begin() && (*prev(table))->find(key, result, probes);
+        }
+        lock_guard<mutex> guard(lock);
+        counters.tables_probed += probes.tables_probed;
+        counters.bloom_negatives += probes.bloom_negatives;
+        counters.records_read += probes.records_read;
+        return found ? result : BasicRecord();
+    }
+
+    vector<BasicRecord> scan(const string &begin_key, const string &end_key) override
+    {
+        map<string, BasicRecord> found;
+        map<string, BasicRecord> newest;
+        shared_ptr<const map<string, BasicRecord>> frozen;
+        shared_ptr<const Version> version;
+        {
+            lock_guard<mutex> guard(lock);
+            for (auto it = memtable.lower_bound(begin_key); it != memtable.end() && (end_key.empty() || it->first < end_key); ++it)
+            {
+                newest.insert(*it);
+            }
+            frozen = immutable;
+            version = current;
+        }
+        // oldest first, so newer versions of a key overwrite older ones
+        for (size_t level = version->levels.size(); level-- > 0;)
+        {
+            const auto &tables = version->levels[level];
+            for (auto table = tables.rbegin(); table != tables.rend(); ++table)
+            {
+                size_t ignored = 0;
+                for (size_t i = (*table)->lower_bound(begin_key, ignored); i < (*table)->size(); i++)
+                {
+                    BasicRecordView record = (*table)->record(i);
+                    if (!end_key.empty() && record.name() >= end_key)
+                    {
+                        break;
+                    }
+                    found[string(record.name())] = record.record();
+                }
+            }
+        }
+        if (frozen)
+        {
+            for (auto it = frozen->lower_bound(begin_key); it != frozen->end() && (end_key.empty() || it->first < end_key); ++it)
+            {
+                found[it->first] = it->second;
+            }
+        }
+        for (auto &[key, record] : newest)
+        {
+            found[key] = move(record);
+        }
+        vector<BasicRecord> result;
+        for (auto &[key, record] : found)
+        {
+            result.push_back(move(record));
+        }
+        return result;
+    }
+
+    // Writes out the memtable and waits until no compaction is due.
+    void flush()
+    {
+        unique_lock<mutex> guard(lock);
+        if (!memtable.empty())
+        {
+            freeze(guard);
+        }
+        changed.wait(guard, [this] { return !immutable && pick_compaction(*current) < 0; });
+    }
+
+    LsmStats stats()
+    {
+        lock_guard<mutex> guard(lock);
+        return counters;
+    }
+
+    vector<size_t> level_tables()
+    {
+        lock_guard<mutex> guard(lock);
+        vector<size_t> result;
+        for (const auto &tables : current->levels)
+        {
+            result.push_back(tables.size());
+        }
+        return result;
+    }
+
+private:
+    filesystem::path table_path(uint64_t id) const
+    {
+        return db_dir / (to_string(id) + ".sst");
+    }
+
+    filesystem::path log_path(uint64_t id) const
+    {
+        return db_dir / (to_string(id) + ".log");
+    }
+
+    // Caller holds lock. Waits if the previous memtable is still being written.
+    void freeze(unique_lock<mutex> &guard)
+    {
+        if (immutable)
+        {
+            counters.write_stalls++;
+            changed.wait(guard, [this] { return !immutable; });
+        }
+        immutable = make_shared<const map<string, BasicRecord>>(move(memtable));
+        memtable.clear();
+        immutable_id = memtable_id;
+        memtable_id = next_table_id++;
+        log.close();
+        log.open(log_path(memtable_id));
+        wake.notify_all();
+    }
+
+    size_t level_limit(size_t level) const
+    {
+        size_t limit = options.table_records;
+        for (size_t i = 0; i < level; i++)
+        {
+            limit *= options.level_ratio;
+        }
+        return limit;
+    }
+
+    // The level most over its size, or -1 if none is.
+    int pick_compaction(const Version &version) const
+    {
+        int result = -1;
+        double worst = 1.0;
+        for (size_t level = 0; level < version.levels.size(); level++)
+        {
+            double score;
+            if (level == 0)
+            {
+                score = (double)version.levels[0].size() / options.level0_tables;
+            }
+            else
+            {
+                size_t records = 0;
+                for (const auto &table : version.levels[level])
+                {
+                    records += table->size();
+                }
+                score = (double)records / level_limit(level);
+            }
+            if (score >= worst && (level == 0 || score > 1.0))
+            {
+                worst = score;
+                result = (int)level;
+            }
+        }
+        return result;
+    }
+
+    void run_background()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            wake.wait(guard, [this] { return stopping || immutable || pick_compaction(*current) >= 0; });
+            if (immutable)
+            {
+                write_memtable(guard);
+            }
+            else if (stopping)
+            {
+                break;
+            }
+            else
+            {
+                compact(pick_compaction(*current), guard);
+            }
+            changed.notify_all();
+        }
+    }
+
+    // Only the background thread installs new versions, so it can read current unlocked.
+    void write_memtable(unique_lock<mutex> &guard)
+    {
+        auto records = immutable;
+        uint64_t id = immutable_id;
+        guard.unlock();
+        SSTableBuilder builder;
+        for (const auto &[key, record] : *records)
+        {
+            builder.add(record);
+        }
+        builder.finish(table_path(id), options);
+        auto table = make_shared<SSTable>(table_path(id), id);
+        auto version = make_shared<Version>(*current);
+        version->levels[0].insert(version->levels[0].begin(), table);
+        guard.lock();
+        install(version);
+        immutable.reset();
+        filesystem::remove(log_path(id));
+        counters.flushes++;
+        counters.bytes_flushed += table->bytes();
+    }
+
+    // Merges tables of level into the overlapping tables of the next level.
+    void compact(int level, unique_lock<mutex> &guard)
+    {
+        auto before = current;
+        const Version &from = *before;
+        vector<shared_ptr<SSTable>> inputs;
+        if (level == 0)
+        {
+            inputs = from.levels[0];
+        }
+        else
+        {
+            // round robin through the level's key range
+            if (compact_pointer.size() <= (size_t)level)
+            {
+                compact_pointer.resize(level + 1);
+            }
+            const auto &tables = from.levels[level];
+            auto next = find_if(tables.begin(), tables.end(),
+                [&](const shared_ptr<SSTable> &table) { return table->smallest() > compact_pointer[level]; });
+            inputs.push_back(next == tables.end() ? tables.front() : *next);
+            compact_pointer[level] = inputs.back()->largest();
+        }
+        string smallest = inputs.front()->smallest(), largest = inputs.front()->largest();
+        for (const auto &table : inputs)
+        {
+            smallest = min(smallest, table->smallest());
+            largest = max(largest, table->largest());
+        }
+        if ((size_t)level + 1 < from.levels.size())
+        {
+            for (const auto &table : from.levels[level + 1])
+            {
+                if (table->largest() >= smallest && table->smallest() <= largest)
+                {
+                    inputs.push_back(table);
+                }
+            }
+        }
+
+        guard.unlock();
+        vector<shared_ptr<SSTable>> outputs = merge(inputs);
+        auto version = make_shared<Version>(from);
+        if (version->levels.size() <= (size_t)level + 1)
+        {
+            version->levels.resize(level + 2);
+        }
+        auto is_input = [&](const shared_ptr<SSTable> &table) { return find(inputs.begin(), inputs.end(), table) != inputs.end(); };
+        for (int i : { level, level + 1 })
+        {
+            auto &tables = version->levels[i];
+            tables.erase(remove_if(tables.begin(), tables.end(), is_input), tables.end());
+        }
+        auto &below = version->levels[level + 1];
+        below.insert(below.end(), outputs.begin(), outputs.end());
+        sort(below.begin(), below.end(),
+            [](const shared_ptr<SSTable> &left, const shared_ptr<SSTable> &right) { return left->smallest() < right->smallest(); });
+
+        guard.lock();
+        install(version);
+        for (const auto &table : inputs)
+        {
+            table->make_obsolete();
+        }
+        counters.compactions++;
+        for (const auto &table : outputs)
+        {
+            counters.bytes_compacted += table->bytes();
+        }
+    }
+
+    // K-way merge, inputs are ordered newest first and the newest version of a key wins.
+    vector<shared_ptr<SSTable>> merge(const vector<shared_ptr<SSTable>> &inputs)
+    {
+        using Head = pair<string_view, size_t>;
+        auto later = [](const Head &left, const Head &right) { return left > right; };
+        priority_queue<Head, vector<Head>, decltype(later)> heads(later);
+        vector<size_t> positions(inputs.size(), 0);
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            heads.push({ inputs[i]->record(0).name(), i });
+        }
+
+        vector<shared_ptr<SSTable>> outputs;
+        SSTableBuilder builder;
+        auto finish_table = [&]()
+        {
+            uint64_t id;
+            {
+                lock_guard<mutex> guard(lock);
+                id = next_table_id++;
+            }
+            builder.finish(table_path(id), options);
+            outputs.push_back(make_shared<SSTable>(table_path(id), id));
+        };
+        while (!heads.empty())
+        {
+            auto [key, source] = heads.top();
+            builder.add(inputs[source]->record(positions[source]).buffer);
+            while (!heads.empty() && heads.top().first == key)
+            {
+                size_t i = heads.top().second;
+                heads.pop();
+                if (++positions[i] < inputs[i]->size())
+                {
+                    heads.push({ inputs[i]->record(positions[i]).name(), i });
+                }
+            }
+            if (builder.size() >= options.table_records)
+            {
+                finish_table();
+            }
+        }
+        if (builder.size() > 0)
+        {
+            finish_table();
+        }
+        return outputs;
+    }
+
+    // Caller holds lock. The manifest is replaced before any old table is deleted.
+    void install(shared_ptr<Version> version)
+    {
+        while (version->levels.size() > 1 && version->levels.back().empty())
+        {
+            version->levels.pop_back();
+        }
+        filesystem::path manifest_path = db_dir / "MANIFEST";
+        filesystem::path temp_path = db_dir / "MANIFEST.tmp";
+        {
+            ofstream writer(temp_path);
+            writer << "SDXLSM01" << endl;
+            writer << "next " << next_table_id << endl;
+            for (size_t level = 0; level < version->levels.size(); level++)
+            {
+                for (const auto &table : version->levels[level])
+                {
+                    writer << level << " " << table->id() << endl;
+                }
+            }
+            if (!writer)
+            {
+                throw runtime_error("can't write " + temp_path.string());
+            }
+        }
+        filesystem::rename(temp_path, manifest_path);
+        current = version;
+    }
+
+    // Opens the tables in the manifest, removes files a crash left behind and
+    // turns the logs of memtables that were never written into level 0 tables.
+    void recover()
+    {
+        auto version = make_shared<Version>();
+        version->levels.resize(1);
+        set<uint64_t> live;
+        ifstream reader(db_dir / "MANIFEST");
+        if (reader.is_open())
+        {
+            string magic, word;
+            reader >> magic >> word >> next_table_id;
+            if (magic != "SDXLSM01" || word != "next")
+            {
+                throw runtime_error("bad manifest in " + db_dir.string());
+            }
+            size_t level;
+            uint64_t id;
+            while (reader >> level >> id)
+            {
+                if (version->levels.size() <= level)
+                {
+                    version->levels.resize(level + 1);
+                }
+                version->levels[level].push_back(make_shared<SSTable>(table_path(id), id));
+                live.insert(id);
+            }
+        }
+
+        map<uint64_t, filesystem::path> logs;
+        for (const auto &entry : filesystem::directory_iterator(db_dir))
+        {
+            auto extension = entry.path().extension();
+            uint64_t id = strtoull(entry.path().stem().string().c_str(), nullptr, 10);
+            next_table_id = max(next_table_id, id + 1);
+            if (extension == ".log")
+            {
+                logs[id] = entry.path();
+            }
+            else if (extension == ".tmp" || (extension == ".sst" && live.count(id) == 0))
+            {
+                filesystem::remove(entry.path());
+            }
+        }
+        for (const auto &[id, path] : logs)
+        {
+            map<string, BasicRecord> records;
+            string contents;
+            {
+                ifstream log_reader(path, ios_base::binary);
+                contents.assign(istreambuf_iterator<char>(log_reader), istreambuf_iterator<char>());
+            }
+            // a torn record at the end of a log is dropped
+            for (size_t offset = 0; offset + BasicRecord::packed_size <= contents.size(); offset += BasicRecord::packed_size)
+            {
+                BasicRecord record = BasicRecord::unpack(contents.data() + offset);
+                records[record.key()] = record;
+            }
+            if (!records.empty())
+            {
+                SSTableBuilder builder;
+                for (const auto &[key, record] : records)
+                {
+                    builder.add(record);
+                }
+                builder.finish(table_path(id), options);
+                version->levels[0].insert(version->levels[0].begin(), make_shared<SSTable>(table_path(id), id));
+            }
+        }
+        install(version);
+        for (const auto &[id, path] : logs)
+        {
+            filesystem::remove(path);
+        }
+    }
+};
+
+struct Aggregate
+{
+    size_t count = 0;
+    int64_t sum = 0;
+    int min = INT_MAX;
+    int max = INT_MIN;
+
+    double avg() const
+    {
+        return count == 0 ? 0.0 : (double)sum / count;
+    }
+
+    void add(int value)
+    {
+        count++;
+        sum += value;
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+    }
+};
+
+// Records stored column by column, sorted by timestamp, in blocks of 128 rows.
+// Each block of a column keeps its min and max and the values bit-packed at
+// the smallest width that holds max - min (frame of reference). Timestamps are
+// packed as differences from the previous row instead, which stay small for
+// regular readings. The packing interleaves four lanes (row i in lane i % 4)
+// so that one SSE2 shift and mask unpacks four values at once.
+//
+// Aggregates over a time range read only the block headers for min and max,
+// sum whole blocks straight from the packed words, and unpack just the two
+// blocks at the edges of the range.
+class ColumnSegment
+{
+public:
+    constexpr static size_t BLOCK = 128;
+    constexpr static size_t LANES = 4;
+    constexpr static int NUM_READINGS = 10;
+    constexpr static int TIMESTAMP = -1;
+    constexpr static char MAGIC[8] = { 'S', 'D', 'X', 'C', 'O', 'L', '0', '1' };
+
+private:
+    struct BlockHeader
+    {
+        int32_t min;
+        int32_t max;
+        uint32_t offset;    // in words
+        uint32_t width;     // bits per value
+    };
+
+    struct Column
+    {
+        vector<BlockHeader> blocks;
+        vector<uint32_t> words;
+    };
+
+    size_t rows = 0;
+    Column columns[1 + NUM_READINGS];     // the timestamps, then each reading
+
+public:
+    ColumnSegment() = default;
+
+    ColumnSegment(vector<BasicRecord> records)
+    {
+        stable_sort(records.begin(), records.end(),
+            [](const BasicRecord &left, const BasicRecord &right) { return left.timestamp < right.timestamp; });
+        rows = records.size();
+        uint32_t values[BLOCK];
+        for (size_t start = 0; start < rows; start += BLOCK)
+        {
+            size_t count = min(BLOCK, rows - start);
+            int first = records[start].timestamp;
+            int last = records[start + count - 1].timestamp;
+            for (size_t i = 0; i < BLOCK; i++)
+            {
+                values[i] = i == 0 || i >= count ? 0 : (uint32_t)(records[start + i].timestamp - records[start + i - 1].timestamp);
+            }
+            append_block(column_of(TIMESTAMP), first, last, values);
+            for (int column = 0; column < NUM_READINGS; column++)
+            {
+                int low = INT_MAX, high = INT_MIN;
+                for (size_t i = 0; i < count; i++)
+                {
+                    low = min(low, records[start + i].readings[column]);
+                    high = max(high, records[start + i].readings[column]);
+                }
+                for (size_t i = 0; i < BLOCK; i++)
+                {
+                    values[i] = i < count ? (uint32_t)((int64_t)records[start + i].readings[column] - low) : 0;
+                }
+                append_block(column_of(column), low, high, values);
+            }
+        }
+    }
+
+    size_t size() const
+    {
+        return rows;
+    }
+
+    size_t bytes() const
+    {
+        size_t total = sizeof(uint64_t);
+        for (const Column &column : columns)
+        {
+            total += column.blocks.size() * sizeof(BlockHeader) + column.words.size() * sizeof(uint32_t);
+        }
+        return total;
+    }
+
+    int timestamp(size_t row) const
+    {
+        uint32_t values[BLOCK];
+        decode_timestamps(row / BLOCK, values);
+        return (int)values[row % BLOCK];
+    }
+
+    int reading(size_t row, int column) const
+    {
+        uint32_t values[BLOCK];
+        const Column &values_column = column_of(column);
+        const BlockHeader &header = values_column.blocks[row / BLOCK];
+        unpack(values_column.words.data() + header.offset, header.width, values);
+        return (int)(header.min + (int64_t)values[row % BLOCK]);
+    }
+
+    // Aggregate of a reading over the rows with begin_time <= timestamp < end_time.
+    Aggregate aggregate(int column, int begin_time, int end_time) const
+    {
+        Aggregate result;
+        size_t begin = lower_bound_time(begin_time);
+        size_t end = lower_bound_time(end_time);
+        if (begin >= end)
+        {
+            return result;
+        }
+        const Column &values = column_of(column);
+        uint32_t unpacked[BLOCK];
+        for (size_t block = begin / BLOCK; block <= (end - 1) / BLOCK; block++)
+        {
+            const BlockHeader &header = values.blocks[block];
+            size_t first = block * BLOCK;
+            size_t count = min(BLOCK, rows - first);
+            size_t low = max(begin, first) - first;
+            size_t high = min(end, first + count) - first;
+            if (low == 0 && high == count)
+            {
+                result.count += count;
+                result.sum += (int64_t)header.min * (int64_t)count + (int64_t)sum_packed(values.words.data() + header.offset, header.width);
+                result.min = min(result.min, (int)header.min);
+                result.max = max(result.max, (int)header.max);
+            }
+            else
+            {
+                unpack(values.words.data() + header.offset, header.width, unpacked);
+                for (size_t i = low; i < high; i++)
+                {
+                    result.add((int)(header.min + (int64_t)unpacked[i]));
+                }
+            }
+        }
+        return result;
+    }
+
+    void save(const filesystem::path &file_path) const
+    {
+        ofstream writer(file_path, ios_base::binary);
+        uint64_t count = rows;
+        writer.write(MAGIC, sizeof(MAGIC));
+        writer.write((const char *)&count, sizeof(count));
+        for (const Column &column : columns)
+        {
+            uint64_t num_words = column.words.size();
+            writer.write((const char *)&num_words, sizeof(num_words));
+            writer.write((const char *)column.blocks.data(), column.blocks.size() * sizeof(BlockHeader));
+            writer.write((const char *)column.words.data(), num_words * sizeof(uint32_t));
+        }
+        if (!writer)
+        {
+            throw runtime_error("can't write " + file_path.string());
+        }
+    }
+
+    static ColumnSegment load(const filesystem::path &file_path)
+    {
+        ifstream reader(file_path, ios_base::binary);
+        char magic[sizeof(MAGIC)];
+        uint64_t count = 0;
+        reader.read(magic, sizeof(magic));
+        reader.read((char *)&count, sizeof(count));
+        if (!reader || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        {
+            throw runtime_error("not a column segment: " + file_path.string());
+        }
+        ColumnSegment result;
+        result.rows = (size_t)count;
+        size_t num_blocks = (result.rows + BLOCK - 1) / BLOCK;
+        for (Column &column : result.columns)
+        {
+            uint64_t num_words = 0;
+            reader.read((char *)&num_words, sizeof(num_words));
+            column.blocks.resize(num_blocks);
+            column.words.resize((size_t)num_words);
+            reader.read((char *)column.blocks.data(), num_blocks * sizeof(BlockHeader));
+            reader.read((char *)column.words.data(), num_words * sizeof(uint32_t));
+        }
+        if (!reader)
+        {
+            throw runtime_error("truncated column segment: " + file_path.string());
+        }
+        return result;
+    }
+
+private:
+    Column &column_of(int column)
+    {
+        return columns[column + 1];
+    }
+
+    const Column &column_of(int column) const
+    {
+        return columns[column + 1];
+    }
+
+    static uint32_t bit_width(uint32_t value)
+    {
+        uint32_t width = 0;
+        for (; value != 0; value >>= 1)
+        {
+            width++;
+        }
+        return width;
+    }
+
+    static void append_block(Column &column, int low, int high, const uint32_t *values)
+    {
+        uint32_t width = 0;
+        for (size_t i = 0; i < BLOCK; i++)
+        {
+            width = max(width, bit_width(values[i]));
+        }
+        column.blocks.push_back({ low, high, (uint32_t)column.words.size(), width });
+        if (width == 0)
+        {
+            return;
+        }
+        size_t offset = column.words.size();
+        column.words.resize(offset + width * LANES, 0);
+        uint32_t *words = column.words.data() + offset;
+        for (size_t i = 0; i < BLOCK; i++)
+        {
+            size_t lane = i % LANES;
+            size_t bit = (i / LANES) * width;
+            words[(bit / 32) * LANES + lane] |= values[i] << (bit % 32);
+            if (bit % 32 + width > 32)
+            {
+                words[(bit / 32 + 1) * LANES + lane] |= values[i] >> (32 - bit % 32);
+            }
+        }
+    }
+
+    static void unpack(const uint32_t *words, uint32_t width, uint32_t *values)
+    {
+        if (width == 0)
+        {
+            memset(values, 0, BLOCK * sizeof(uint32_t));
+            return;
+        }
+#ifdef SDX_SSE2
+        const __m128i mask = _mm_set1_epi32(width == 32 ? -1 : (int)((1u << width) - 1));
+        for (size_t k = 0; k < BLOCK / LANES; k++)
+        {
+            size_t bit = k * width;
+            __m128i current = _mm_loadu_si128((const __m128i *)(words + (bit / 32) * LANES));
+            __m128i value = _mm_srl_epi32(current, _mm_cvtsi32_si128((int)(bit % 32)));
+            if (bit % 32 + width > 32)
+            {
+                __m128i next = _mm_loadu_si128((const __m128i *)(words + (bit / 32 + 1) * LANES));
+                value = _mm_or_si128(value, _mm_sll_epi32(next, _mm_cvtsi32_si128((int)(32 - bit % 32))));
+            }
+            _mm_storeu_si128((__m128i *)(values + k * LANES), _mm_and_si128(value, mask));
+        }
+#else
+        uint32_t mask = width == 32 ? ~0u : (1u << width) - 1;
+        for (size_t i = 0; i < BLOCK; i++)
+        {
+            size_t lane = i % LANES;
+            size_t bit = (i / LANES) * width;
+            uint64_t pair = words[(bit / 32) * LANES + lane];
+            if (bit % 32 + width > 32)
+            {
+                pair |= (uint64_t)words[(bit / 32 + 1) * LANES + lane] << 32;
+            }
+            values[i] = (uint32_t)(pair >> (bit % 32)) & mask;
+        }
+#endif
+    }
+
+    // Sum of a whole block of packed values, without storing them unpacked.
+    static uint64_t sum_packed(const uint32_t *words, uint32_t width)
+    {
+        if (width == 0)
+        {
+            return 0;
+        }
+#ifdef SDX_SSE2
+        const __m128i mask = _mm_set1_epi32(width == 32 ? -1 : (int)((1u << width) - 1));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i total = _mm_setzero_si128();
+        for (size_t k = 0; k < BLOCK / LANES; k++)
+        {
+            size_t bit = k * width;
+            __m128i current = _mm_loadu_si128((const __m128i *)(words + (bit / 32) * LANES));
+            __m128i value = _mm_srl_epi32(current, _mm_cvtsi32_si128((int)(bit % 32)));
+            if (bit % 32 + width > 32)
+            {
+                __m128i next = _mm_loadu_si128((const __m128i *)(words + (bit / 32 + 1) * LANES));
+                value = _mm_or_si128(value, _mm_sll_epi32(next, _mm_cvtsi32_si128((int)(32 - bit % 32))));
+            }
+            value = _mm_and_si128(value, mask);
+            // widen to 64 bits so 128 values of up to 32 bits can't overflow
+            total = _mm_add_epi64(total, _mm_unpacklo_epi32(value, zero));
+            total = _mm_add_epi64(total, _mm_unpackhi_epi32(value, zero));
+        }
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, total);
+        return lanes[0] + lanes[1];
+#else
+        uint32_t values[BLOCK];
+        unpack(words, width, values);
+        uint64_t total = 0;
+        for (size_t i = 0; i < BLOCK; i++)
+        {
+            total += values[i];
+        }
+        return total;
+#endif
+    }
+
+    void decode_timestamps(size_t block, uint32_t *values) const
+    {
+        const Column &timestamps = column_of(TIMESTAMP);
+        const BlockHeader &header = timestamps.blocks[block];
+        unpack(timestamps.words.data() + header.offset, header.width, values);
+        uint32_t running = (uint32_t)header.min;
+        for (size_t i = 0; i < BLOCK; i++)
+        {
+            running += values[i];
+            values[i] = running;
+        }
+    }
+
+    // First row with timestamp >= time.
+    size_t lower_bound_time(int time) const
+    {
+        const auto &blocks = column_of(TIMESTAMP).blocks;
+        auto block = partition_point(blocks.begin(), blocks.end(), [&](const BlockHeader &header) { return header.max < time; });
+        if (block == blocks.end())
+        {
+            return rows;
+        }
+        size_t index = block - blocks.begin();
+        uint32_t values[BLOCK];
+        decode_timestamps(index, values);
+        size_t count = min(BLOCK, rows - index * BLOCK);
+        size_t i = 0;
+        while (i < count && (int)values[i] < time)
+        {
+            i++;
+        }
+        return index * BLOCK + i;
+    }
+};
+
+enum class KeyDistribution
+{
+    uniform,
+    zipfian,        // scrambled, as in YCSB
+    sequential,
+};
+
+// Record numbers in [0, records) for a benchmark's operations. Zipfian ranks
+// are drawn with the method from Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", and hashed so that the hot records are
+// spread over the keys instead of being the first ones.
+class KeyGenerator
+{
+    KeyDistribution distribution;
+    uint64_t records;
+    double theta, alpha = 0, zeta_n = 0, eta = 0;
+    mt19937_64 random;
+    uint64_t next = 0;
+
+public:
+    KeyGenerator(KeyDistribution distribution, uint64_t records, double theta = 0.99)
+        : distribution(distribution), records(max<uint64_t>(records, 1)), theta(theta)
+    {
+        if (distribution == KeyDistribution::zipfian)
+        {
+            double zeta_2 = 1 + pow(0.5, theta);
+            for (uint64_t i = 1; i <= this->records; i++)
+            {
+                zeta_n += 1 / pow((double)i, theta);
+            }
+            alpha = 1 / (1 - theta);
+            eta = (1 - pow(2.0 / this->records, 1 - theta)) / (1 - zeta_2 / zeta_n);
+        }
+    }
+
+    // Sequential keys start at start and wrap around.
+    void seed(uint64_t seed, uint64_t start = 0)
+    {
+        random.seed(seed);
+        next = start;
+    }
+
+    uint64_t operator()()
+    {
+        switch (distribution)
+        {
+        case KeyDistribution::sequential:
+            return next++ % records;
+        case KeyDistribution::zipfian:
+            return scramble(zipf_rank()) % records;
+        default:
+            return random() % records;
+        }
+    }
+
+private:
+    uint64_t zipf_rank()
+    {
+        double u = uniform_real_distribution<double>(0, 1)(random);
+        double uz = u * zeta_n;
+        if (uz < 1)
+        {
+            return 0;
+        }
+        if (uz < 1 + pow(0.5, theta))
+        {
+            return 1;
+        }
+        return (uint64_t)(records * pow(eta * u - eta + 1, alpha));
+    }
+
+    static uint64_t scramble(uint64_t value)
+    {
+        value += 0x9E3779B97F4A7C15ull;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+        return value ^ (value >> 31);
+    }
+};
+
+// Latencies in nanoseconds, log-linear like an HDR histogram: exact below 128,
+// then 64 buckets per power of two, so a percentile is within 1.6% of the
+// recorded value.
+class LatencyHistogram
+{
+    constexpr static uint64_t LINEAR = 128;
+    constexpr static uint64_t SUB_BUCKETS = 64;
+
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t smallest = UINT64_MAX;
+    uint64_t largest = 0;
+    double sum = 0;
+
+public:
+    LatencyHistogram() : counts(LINEAR + 57 * SUB_BUCKETS) {}
+
+    void record(uint64_t value)
+    {
+        counts[bucket_of(value)]++;
+        total++;
+        smallest = min(smallest, value);
+        largest = max(largest, value);
+        sum += (double)value;
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        smallest = min(smallest, other.smallest);
+        largest = max(largest, other.largest);
+        sum += other.sum;
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    double mean() const
+    {
+        return total == 0 ? 0 : sum / total;
+    }
+
+    uint64_t max_value() const
+    {
+        return largest;
+    }
+
+    // The highest value that lands in the same bucket as the percentile.
+    uint64_t percentile(double percent) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = max<uint64_t>((uint64_t)ceil(percent / 100 * total), 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return min(highest_in(i), largest);
+            }
+        }
+        return largest;
+    }
+
+private:
+    static size_t bucket_of(uint64_t value)
+    {
+        if (value < LINEAR)
+        {
+            return (size_t)value;
+        }
+        int top = 7;
+        while (top < 63 && (value >> (top + 1)) != 0)
+        {
+            top++;
+        }
+        int shift = top - 6;
+        return (size_t)(LINEAR + (shift - 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS));
+    }
+
+    static uint64_t highest_in(size_t bucket)
+    {
+        if (bucket < LINEAR)
+        {
+            return bucket;
+        }
+        int shift = (int)((bucket - LINEAR) / SUB_BUCKETS) + 1;
+        uint64_t mantissa = (bucket - LINEAR) % SUB_BUCKETS + SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+};
+
+struct BenchmarkConfig
+{
+    string store;
+    size_t records = 100000;
+    size_t operations = 1000000;        // split between the threads
+    size_t threads = 1;
+    int read_percent = 50;
+    KeyDistribution distribution = KeyDistribution::uniform;
+    double zipf_theta = 0.99;
+    uint64_t seed = 1;
+};
+
+struct BenchmarkResult
+{
+    BenchmarkConfig config;
+    double load_ms = 0;
+    double run_ms = 0;
+    LatencyHistogram reads, writes;
+
+    double ops_per_second() const
+    {
+        return (reads.count() + writes.count()) / (run_ms / 1000);
+    }
+
+    json to_json() const
+    {
+        const char *distributions[] = { "uniform", "zipfian", "sequential" };
+        auto latencies = [](const LatencyHistogram &histogram)
+        {
+            return json{ { "count", histogram.count() }, { "mean_ns", histogram.mean() },
+                { "p50_ns", histogram.percentile(50) }, { "p90_ns", histogram.percentile(90) },
+                { "p99_ns", histogram.percentile(99) }, { "p999_ns", histogram.percentile(99.9) },
+                { "max_ns", histogram.max_value() } };
+        };
+        return json{
+            { "store", config.store }, { "records", config.records }, { "operations", config.operations },
+            { "threads", config.threads }, { "read_percent", config.read_percent },
+            { "distribution", distributions[(int)config.distribution] }, { "zipf_theta", config.zipf_theta },
+            { "load_ms", load_ms }, { "run_ms", run_ms }, { "ops_per_second", ops_per_second() },
+            { "reads", latencies(reads) }, { "writes", latencies(writes) } };
+    }
+};
+
+// Loads config.records records into db, then times config.operations gets and
+// adds over config.threads threads, each operation on its own. Calls go through
+// one lock unless the store is safe to use from many threads.
+BenchmarkResult run_benchmark(Database &db, const BenchmarkConfig &config, bool thread_safe)
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+    auto key_of = [](uint64_t i) { return "user" + to_string(i); };
+    BenchmarkResult result;
+    result.config = config;
+
+    auto start = chrono::steady_clock::now();
+    vector<BasicRecord> batch;
+    for (size_t i = 0; i < config.records; i++)
+    {
+        batch.push_back({ key_of(i), (int)i });
+        if (batch.size() == 1000 || i + 1 == config.records)
+        {
+            db.add_batch(batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+    result.load_ms = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+
+    KeyGenerator keys(config.distribution, config.records, config.zipf_theta);
+    size_t threads = max<size_t>(config.threads, 1);
+    vector<LatencyHistogram> reads(threads), writes(threads);
+    mutex lock;
+    vector<thread> workers;
+    start = chrono::steady_clock::now();
+    for (size_t t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t]()
+        {
+            KeyGenerator next_key = keys;
+            next_key.seed(config.seed + t, t * config.records / threads);
+            mt19937 random((unsigned)(config.seed * 31 + t));
+            size_t operations = config.operations / threads + (t < config.operations % threads ? 1 : 0);
+            for (size_t i = 0; i < operations; i++)
+            {
+                string key = key_of(next_key());
+                bool read = (int)(random() % 100) < config.read_percent;
+                auto began = chrono::steady_clock::now();
+                {
+                    unique_lock<mutex> guard(lock, defer_lock);
+                    if (!thread_safe)
+                    {
+                        guard.lock();
+                    }
+                    if (read)
+                    {
+                        db.get(key);
+                    }
+                    else
+                    {
+                        db.add({ key, (int)i });
+                    }
+                }
+                uint64_t elapsed = (uint64_t)(chrono::steady_clock::now() - began).count();
+                (read ? reads : writes)[t].record(elapsed);
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    result.run_ms = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+    for (size_t t = 0; t < threads; t++)
+    {
+        result.reads.merge(reads[t]);
+        result.writes.merge(writes[t]);
+    }
+    return result;
+}
+
+void test_get_nothing_from_empty_db()
+{
+    MemDb db;
+    BasicRecord result = db.get("something");
+    BasicRecord empty;
+    assert(result == empty);
+}
+
+void test_add_then_get()
+{
+    MemDb db;
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    db.add(ex01);
+    assert(db.get("ex01") == ex01);
+}
+
+void test_add_two_then_get_both()
+{
+    MemDb db;
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    BasicRecord ex02{ "ex02", 67890, {3, 4} };
+    db.add(ex01);
+    db.add(ex02);
+    assert(db.get("ex01") == ex01);
+    assert(db.get("ex02") == ex02);
+}
+
+void test_add_then_overwrite()
+{
+    MemDb db;
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    db.add(ex01);
+    ex01.timestamp = 67890;
+    db.add(ex01);
+    assert(db.get("ex01") == ex01);
+}
+
+void test_scan()
+{
+    MemDb db;
+    for (int i = 0; i < 10; i++)
+    {
+        db.add({ "ex" + to_string(i), i });
+    }
+    auto result = db.scan("ex3", "ex6");
+    assert(result.size() == 3);
+    assert(result[0].name == string("ex3") && result[2].name == string("ex5"));
+    assert(db.scan("ex8", "").size() == 2);
+    assert(db.scan("z", "").empty());
+}
+
+void test_concurrent_memdb()
+{
+    ConcurrentMemDb db(10);
+    assert(db.num_shards() == 16);
+    const int writers = 4, readers = 4, per_writer = 2000;
+    atomic<bool> done{ false };
+    atomic<int> bad_reads{ 0 };
+    vector<thread> threads;
+    for (int w = 0; w < writers; w++)
+    {
+        threads.emplace_back([&, w]()
+        {
+            for (int i = 0; i < per_writer; i++)
+            {
+                BasicRecord record{ "w" + to_string(w) + "-" + to_string(i % 500), i };
+                record.readings[0] = i;
+                db.add(record);
+            }
+        });
+    }
+    for (int r = 0; r < readers; r++)
+    {
+        threads.emplace_back([&, r]()
+        {
+            for (int i = 0; !done; i++)
+            {
+                // a record is never seen half written
+                BasicRecord record = db.get("w" + to_string(i % writers) + "-" + to_string(i % 500));
+                if (record.timestamp != record.readings[0])
+                {
+                    bad_reads++;
+                }
+            }
+        });
+    }
+    for (int w = 0; w < writers; w++)
+    {
+        threads[w].join();
+    }
+    done = true;
+    for (size_t t = writers; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+    assert(bad_reads == 0);
+    for (int w = 0; w < writers; w++)
+    {
+        for (int i = 0; i < 500; i++)
+        {
+            assert(db.get("w" + to_string(w) + "-" + to_string(i)).timestamp == 1500 + i);
+        }
+    }
+    auto result = db.scan("w1-", "w2-");
+    assert(result.size() == 500);
+    assert(is_sorted(result.begin(), result.end(), [](const BasicRecord &left, const BasicRecord &right) { return left.name < right.name; }));
+}
+
+void test_mvcc_memdb()
+{
+    MvccMemDb db(4);
+    db.add({ "a", 1 });
+    db.add({ "b", 1 });
+    {
+        auto before = db.snapshot();
+        db.add({ "a", 2 });
+        db.add({ "c", 2 });
+        assert(db.get("a").timestamp == 2);
+        assert(db.get("a", before).timestamp == 1);
+        assert(db.get("c", before) == BasicRecord());
+        auto old = db.scan("", "", before);
+        assert(old.size() == 2 && old[0].timestamp == 1 && old[1].name == "b");
+        assert(db.scan("", "").size() == 3);
+
+        for (int i = 3; i < 100; i++)
+        {
+            db.add({ "a", i });
+        }
+        // versions newer than the oldest snapshot stay until it is released
+        assert(db.get("a", before).timestamp == 1);
+        assert(db.stats().versions == 101 && db.stats().snapshots == 1);
+    }
+    assert(db.stats().snapshots == 0);
+    assert(db.stats().versions == 3 && db.stats().collected == 98);
+
+    // a batch is one commit, and a snapshot sees none of a later one
+    auto before = db.snapshot();
+    vector<BasicRecord> batch = { { "a", 200 }, { "d", 200 }, { "a", 201 } };
+    uint64_t commits = db.stats().commits;
+    db.add_batch(batch.data(), batch.size());
+    assert(db.stats().commits == commits + 1);
+    assert(db.get("a").timestamp == 201 && db.get("d").timestamp == 200);
+    assert(db.get("a", before).timestamp == 99 && db.get("d", before) == BasicRecord());
+    before.release();
+
+    // scans of a snapshot see whole batches while writers keep committing them
+    const int writers = 2, readers = 3, rounds = 300, keys = 200;
+    atomic<int> next_round{ 1 };
+    atomic<bool> done{ false };
+    atomic<int> torn_scans{ 0 };
+    atomic<int> scans{ 0 };
+    vector<int> last_rounds(writers, 0);
+    vector<thread> threads;
+    for (int w = 0; w < writers; w++)
+    {
+        threads.emplace_back([&, w]()
+        {
+            vector<BasicRecord> records(keys);
+            for (int round; (round = next_round++) <= rounds;)
+            {
+                for (int k = 0; k < keys; k++)
+                {
+                    records[k] = { "k" + to_string(k), round };
+                    records[k].readings[0] = round;
+                }
+                db.add_batch(records.data(), records.size());
+                last_rounds[w] = round;
+            }
+        });
+    }
+    for (int r = 0; r < readers; r++)
+    {
+        threads.emplace_back([&]()
+        {
+            while (!done)
+            {
+                auto snapshot = db.snapshot();
+                auto result = db.scan("k", "l", snapshot);
+                for (const auto &record : result)
+                {
+                    if (record.timestamp != result[0].timestamp || record.readings[0] != record.timestamp)
+                    {
+                        torn_scans++;
+                        break;
+                    }
+                }
+                assert(result.empty() || result.size() == keys);
+                scans++;
+            }
+        });
+    }
+    for (int w = 0; w < writers; w++)
+    {
+        threads[w].join();
+    }
+    done = true;
+    for (size_t t = writers; t < threads.size(); t++)
+    {
+        threads[t].join();
+    }
+    assert(torn_scans == 0 && scans > 0);
+    db.collect_garbage();
+    assert(db.stats().versions == 4 + keys);
+    // the batch committed last is some writer's last one, and it is there whole
+    auto last = db.scan("k", "l");
+    assert(last.size() == keys && count(last_rounds.begin(), last_rounds.end(), last[0].timestamp) > 0);
+    assert(all_of(last.begin(), last.end(), [&](const BasicRecord &record) { return record.timestamp == last[0].timestamp; }));
+
+    // single adds to different shards from several threads are all published in order
+    MvccMemDb singles(16);
+    vector<thread> adders;
+    for (int t = 0; t < 4; t++)
+    {
+        adders.emplace_back([&, t]()
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                singles.add({ "t" + to_string(t) + "_" + to_string(i), i });
+            }
+        });
+    }
+    for (auto &adder : adders)
+    {
+        adder.join();
+    }
+    assert(singles.stats().commits == 4000 && singles.scan("", "").size() == 4000);
+}
+
+void test_filedb()
+{
+    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExample.db");
+
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    BasicRecord ex02{ "ex02", 67890, {3, 4} };
+
+    {
+        FileDb db(db_file_path);
+        db.add(ex01);
+        db.add(ex02);
+
+        // a record that can't be packed is refused without a trace
+        BasicRecord too_long[] = { { "ex03", 1, {} }, { string(BasicRecord::max_name, 'x'), 2, {} } };
+        for (int batch = 0; batch < 2; batch++)
+        {
+            try
+            {
+                batch ? db.add_batch(too_long, 2) : db.add(too_long[1]);
+                assert(!"invalid_argument not thrown");
+            }
+            catch (const invalid_argument &)
+            {
+            }
+        }
+        assert(db.scan("", "").size() == 2);
+    }
+
+    {
+        FileDb db(db_file_path);
+        assert(db.get("ex01") == ex01);
+        assert(db.get("ex02") == ex02);
+        assert(db.scan("", "").size() == 2);
+    }
+
+    filesystem::remove(db_file_path);
+    filesystem::remove(filesystem::path(db_file_path) += ".wal");
+}
+
+void test_filedb_wal()
+{
+    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExampleWal.db");
+    filesystem::path wal_path = filesystem::path(db_file_path) += ".wal";
+
+    WalOptions options;
+    options.group_size = 4;
+    options.group_delay = chrono::milliseconds(1000);
+    options.checkpoint_records = 1000000;
+    {
+        FileDb db(db_file_path, options);
+        for (int i = 0; i < 10; i++)
+        {
+            db.add({ "ex" + to_string(i), i, { i } });
+        }
+        // two full groups committed, two records still pending
+        assert(filesystem::file_size(wal_path) == 8 * BasicRecord::packed_size);
+        assert(!filesystem::exists(db_file_path));
+        db.flush();
+        assert(filesystem::file_size(wal_path) == 10 * BasicRecord::packed_size);
+        db.add({ "ex0", 100, { 100 } });
+    }
+
+    {
+        // recovered from the log alone
+        FileDb db(db_file_path, options);
+        assert(db.get("ex0") == BasicRecord({ "ex0", 100, { 100 } }));
+        assert(db.get("ex9") == BasicRecord({ "ex9", 9, { 9 } }));
+        db.checkpoint();
+        assert(filesystem::file_size(db_file_path) == 10 * BasicRecord::packed_size + DataTrailer::SIZE);
+        assert(filesystem::file_size(wal_path) == 0);
+        db.add({ "ex10", 10, { 10 } });
+    }
+
+    {
+        // an interrupted checkpoint: data file, old log and log all replayed
+        ofstream(filesystem::path(db_file_path) += ".wal.old", ios_base::binary).close();
+        FileDb db(db_file_path, options);
+        assert(db.get("ex0") == BasicRecord({ "ex0", 100, { 100 } }));
+        assert(db.get("ex10") == BasicRecord({ "ex10", 10, { 10 } }));
+        assert(!filesystem::exists(filesystem::path(db_file_path) += ".wal.old"));
+    }
+
+    options.group_delay = chrono::milliseconds(1);
+    options.checkpoint_records = 8;
+    {
+        // background group commits and checkpoints
+        FileDb db(db_file_path, options);
+        for (int i = 0; i < 50; i++)
+        {
+            db.add({ "bg" + to_string(i), i, { i } });
+        }
+        for (int tries = 0; tries < 1000 && db.log_records() >= options.checkpoint_records; tries++)
+        {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        assert(db.log_records() < options.checkpoint_records);
+    }
+    {
+        FileDb db(db_file_path, options);
+        for (int i = 0; i < 50; i++)
+        {
+            assert(db.get("bg" + to_string(i)).timestamp == i);
+        }
+    }
+
+    filesystem::remove(db_file_path);
+    filesystem::remove(wal_path);
+}
+
+void test_mappeddb()
+{
+    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExampleMapped.db");
+    auto cleanup = [&]()
+    {
+        for (const char *suffix : { "", ".wal", ".wal.old", ".idx", ".log" })
+        {
+            filesystem::remove(filesystem::path(db_file_path) += suffix);
+        }
+    };
+    cleanup();
+
+    {
+        FileDb db(db_file_path);
+        for (int i = 0; i < 100; i++)
+        {
+            db.add({ "ex" + to_string(i), i, { i, -i } });
+        }
+        db.checkpoint();
+    }
+
+    {
+        // opens FileDb's data file as is, building the index once
+        MappedDb db(db_file_path);
+        assert(db.num_records() == 100);
+        for (int i = 0; i < 100; i++)
+        {
+            BasicRecordView view = db.view("ex" + to_string(i));
+            assert(view && view.name() == "ex" + to_string(i));
+            assert(view.timestamp() == i && view.reading(0) == i && view.reading(1) == -i);
+        }
+        assert(!db.view("missing"));
+        assert(db.get("missing") == BasicRecord());
+
+        db.add({ "ex5", 500, { 5 } });
+        db.add({ "new", 1, { 1 } });
+        assert(db.get("ex5") == BasicRecord({ "ex5", 500, { 5 } }));
+    }
+
+    {
+        // the overlay comes back from the log
+        MappedDb db(db_file_path);
+        assert(db.get("ex5") == BasicRecord({ "ex5", 500, { 5 } }));
+        assert(db.get("new") == BasicRecord({ "new", 1, { 1 } }));
+        db.compact();
+        assert(db.num_records() == 101);
+        assert(filesystem::file_size(filesystem::path(db_file_path) += ".log") == 0);
+        assert(db.get("ex5") == BasicRecord({ "ex5", 500, { 5 } }));
+        assert(db.get("ex6") == BasicRecord({ "ex6", 6, { 6, -6 } }));
+    }
+
+    {
+        MappedDb db(db_file_path);
+        assert(db.num_records() == 101);
+        assert(db.get("new") == BasicRecord({ "new", 1, { 1 } }));
+    }
+
+    // records still in FileDb's log are seen, and compact() takes them over
+    {
+        FileDb db(db_file_path);
+        db.add({ "logged", 7, { 7 } });
+        db.add({ "ex7", 700, { 7 } });
+    }
+    {
+        MappedDb db(db_file_path);
+        assert(db.get("logged") == BasicRecord({ "logged", 7, { 7 } }));
+        assert(db.get("ex7") == BasicRecord({ "ex7", 700, { 7 } }));
+        db.compact();
+        assert(!filesystem::exists(filesystem::path(db_file_path) += ".wal"));
+    }
+    {
+        FileDb db(db_file_path);
+        assert(db.get("logged") == BasicRecord({ "logged", 7, { 7 } }));
+        assert(db.get("ex7") == BasicRecord({ "ex7", 700, { 7 } }));
+        assert(db.get("new") == BasicRecord({ "new", 1, { 1 } }));
+    }
+
+    // a data file rewritten in another order with the same size gets a new index
+    {
+        uintmax_t size = filesystem::file_size(db_file_path);
+        string before;
+        {
+            ifstream reader(db_file_path, ios_base::binary);
+            before.assign(istreambuf_iterator<char>(reader), istreambuf_iterator<char>());
+        }
+        {
+            FileDb db(db_file_path);
+            db.checkpoint();
+        }
+        string after;
+        {
+            ifstream reader(db_file_path, ios_base::binary);
+            after.assign(istreambuf_iterator<char>(reader), istreambuf_iterator<char>());
+        }
+        size_t records_size = after.size() - DataTrailer::SIZE;
+        assert(filesystem::file_size(db_file_path) == size && after.compare(0, records_size, before, 0, records_size) != 0);
+        MappedDb db(db_file_path);
+        for (int i = 0; i < 100; i++)
+        {
+            assert(db.view("ex" + to_string(i)));
+        }
+        assert(db.get("logged") == BasicRecord({ "logged", 7, { 7 } }));
+    }
+    cleanup();
+}
+
+void test_blockdb()
+{
+    BlockDb db;
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
     BasicRecord ex02{ "ex02", 67890, {3, 4} };
     BasicRecord ex03{ "ex03", 77777, {7, 7} };
     db.add(ex01);
@@ -409,30 +5295,1793 @@ void test_blockdb()
     assert(db.get("ex03") == ex03);
 }
 
-void test_blockfiledb()
+void test_blockfiledb()
+{
+    filesystem::path db_dir_path = filesystem::temp_directory_path();
+    db_dir_path.append("sdbxdb");
+    filesystem::create_directory(db_dir_path);
+
+    BasicRecord ex01{ "ex01", 12345, {1, 2} };
+    BasicRecord ex02{ "ex02", 67890, {3, 4} };
+    BasicRecord ex03{ "ex03", 77777, {7, 7} };
+
+    {
+        BlockFileDb db(db_dir_path);
+        db.add(ex01);
+        db.add(ex02);
+        db.add(ex03);
+    }
+
+    {
+        BlockFileDb db(db_dir_path);
+        assert(db.get("ex01") == ex01);
+        assert(db.get("ex02") == ex02);
+        assert(db.get("ex03") == ex03);
+        assert(db.get("ex04") == BasicRecord());
+        ex02.timestamp = 11111;
+        db.add(ex02);
+        db.add({ "ex00", 0 });
+    }
+
+    {
+        BlockFileDb db(db_dir_path);
+        assert(db.num_records() == 4);
+        auto result = db.scan("ex01", "ex03");
+        assert(result.size() == 2);
+        assert(result[0] == ex01 && result[1] == ex02);
+        assert(db.scan("", "").size() == 4);
+    }
+
+    {
+        // a database from before the index is indexed when opened
+        filesystem::remove(db_dir_path / "index.bpt");
+        BlockFileDb db(db_dir_path);
+        assert(db.num_records() == 4);
+        assert(db.get("ex02") == ex02);
+        db.add({ "ex05", 5 });
+        assert(db.get("ex05").timestamp == 5);
+        assert(db.get("ex00").timestamp == 0);
+    }
+
+    {
+        // far more blocks than the cache holds
+        BlockFileOptions options;
+        options.cache_blocks = 4;
+        BlockFileDb db(db_dir_path, options);
+        for (int i = 0; i < 200; i++)
+        {
+            db.add({ "many" + to_string(i), i });
+        }
+        for (int i = 0; i < 200; i += 7)
+        {
+            assert(db.get("many" + to_string(i)).timestamp == i);
+        }
+        assert(db.block_stats().evictions > 90);
+        assert(db.block_stats().write_backs >= 100);
+        assert(db.get("ex02") == ex02);
+    }
+
+    {
+        BlockFileOptions options;
+        options.cache_blocks = 4;
+        BlockFileDb db(db_dir_path, options);
+        assert(db.num_records() == 205);
+        assert(db.get("many199").timestamp == 199);
+        assert(db.block_stats().misses == 1 && db.block_stats().bytes_read == BlockFileStore::BLOCK_SIZE);
+    }
+    
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_buffer_pool()
+{
+    class MemPageStore : public PageStore
+    {
+    public:
+        map<uint64_t, string> pages;
+
+        size_t page_size() const override
+        {
+            return 16;
+        }
+
+        void read_page(uint64_t page_id, char *buffer) override
+        {
+            string page = pages.count(page_id) ? pages[page_id] : string(16, '\0');
+            memcpy(buffer, page.data(), 16);
+        }
+
+        void write_page(uint64_t page_id, const char *buffer) override
+        {
+            pages[page_id] = string(buffer, 16);
+        }
+    };
+
+    MemPageStore store;
+    {
+        BufferPool pool(store, 3);
+        {
+            PageHandle page = pool.fetch(0);
+            strcpy(page.data(), "page 0");
+            page.mark_dirty();
+        }
+        pool.fetch(1);
+        pool.fetch(1);
+        assert(pool.stats().hits == 1 && pool.stats().misses == 2);
+        assert(store.pages.empty());
+
+        // a pinned page survives while every other page is cycled through
+        PageHandle pinned = pool.fetch(2);
+        for (uint64_t page_id = 3; page_id < 10; page_id++)
+        {
+            pool.fetch(page_id);
+        }
+        assert(pool.resident() == 3);
+        assert(pool.stats().evictions == 7);
+        assert(store.pages.size() == 1 && store.pages[0] == string("page 0", 6) + string(10, '\0'));
+        assert(pool.fetch(2).data() == pinned.data());
+
+        PageHandle other = pool.fetch(0);
+        PageHandle third = pool.fetch(1);
+        bool threw = false;
+        try
+        {
+            pool.fetch(11);
+        }
+        catch (const runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+        assert(string(other.data()) == "page 0");
+        other.mark_dirty();
+    }
+    // written back when the pool closes, clean pages are not
+    assert(store.pages.size() == 1);
+}
+
+void test_bloom_filter()
+{
+    BloomFilter bloom(1000, 10);
+    for (int i = 0; i < 1000; i++)
+    {
+        bloom.add("in" + to_string(i));
+    }
+    int false_positives = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        assert(bloom.may_contain("in" + to_string(i)));
+        false_positives += bloom.may_contain("out" + to_string(i));
+    }
+    // about 1% expected at 10 bits per key
+    assert(false_positives < 30);
+}
+
+void test_lsmdb()
+{
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxlsm");
+    filesystem::remove_all(db_dir_path);
+    LsmOptions options;
+    options.memtable_records = 8;
+    options.table_records = 8;
+    options.level0_tables = 2;
+    options.level_ratio = 2;
+    options.index_interval = 4;
+
+    {
+        LsmDb db(db_dir_path, options);
+        for (int i = 0; i < 1000; i++)
+        {
+            db.add({ "k" + to_string(i % 300), i });
+        }
+        db.flush();
+        auto levels = db.level_tables();
+        assert(levels.size() >= 3);
+        assert(levels[0] < options.level0_tables);
+        LsmStats stats = db.stats();
+        assert(stats.flushes == 125 && stats.compactions > 0);
+        assert(stats.write_amplification() > 2.0);
+        for (int i = 0; i < 300; i++)
+        {
+            assert(db.get("k" + to_string(i)).timestamp == (i < 100 ? 900 : 600) + i);
+        }
+        LsmStats before = db.stats();
+        for (int i = 0; i < 300; i++)
+        {
+            // inside the tables' key ranges, so only the bloom filters keep them out
+            assert(db.get("k" + to_string(i) + "x") == BasicRecord());
+        }
+        stats = db.stats();
+        assert(stats.bloom_negatives > 0);
+
+        // gets on several threads are all counted
+        vector<thread> readers;
+        for (int t = 0; t < 4; t++)
+        {
+            readers.emplace_back([&db]()
+            {
+                for (int i = 0; i < 300; i++)
+                {
+                    db.get("k" + to_string(i) + "x");
+                }
+            });
+        }
+        for (auto &reader : readers)
+        {
+            reader.join();
+        }
+        LsmStats after = db.stats();
+        assert(after.gets - stats.gets == 1200);
+        assert(after.tables_probed - stats.tables_probed == 4 * (stats.tables_probed - before.tables_probed));
+        assert(after.bloom_negatives - stats.bloom_negatives == 4 * (stats.bloom_negatives - before.bloom_negatives));
+        db.add({ "k1", -1 });
+        db.add({ "zz", 5 });
+    }
+
+    {
+        // the last adds come back from the log
+        LsmDb db(db_dir_path, options);
+        assert(db.get("k1").timestamp == -1);
+        assert(db.get("zz").timestamp == 5);
+        assert(db.get("k299").timestamp == 899);
+        auto result = db.scan("k10", "k11");
+        assert(result.size() == 11);
+        assert(result[0].name == string("k10") && result[0].timestamp == 910);
+        assert(result[10].name == string("k109"));
+        assert(db.scan("", "").size() == 301);
+    }
+
+    {
+        // deleted through a Database pointer, the background thread is still stopped
+        unique_ptr<Database> db = make_unique<LsmDb>(db_dir_path, options);
+        db->add({ "base", 3 });
+    }
+    assert(LsmDb(db_dir_path, options).get("base").timestamp == 3);
+
+    {
+        // a table left behind by an interrupted compaction is ignored
+        ofstream(db_dir_path / "999.sst", ios_base::binary) << "junk";
+        LsmDb db(db_dir_path, options);
+        assert(!filesystem::exists(db_dir_path / "999.sst"));
+        assert(db.get("k2").timestamp == 902);
+    }
+
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_column_segment()
+{
+    mt19937 random(7);
+    vector<BasicRecord> records;
+    for (int i = 0; i < 1000; i++)
+    {
+        // irregular times, some repeated
+        BasicRecord record{ "r" + to_string(i), i * 60 + (int)(random() % 90) };
+        record.readings[0] = 200 + (int)(random() % 50);
+        record.readings[1] = -1000 + i;
+        record.readings[2] = 42;
+        record.readings[3] = (int)random();
+        records.push_back(record);
+    }
+    shuffle(records.begin(), records.end(), random);
+    ColumnSegment segment(records);
+    assert(segment.size() == 1000);
+    assert(segment.bytes() < 1000 * BasicRecord::packed_size / 2);
+
+    auto check = [&](const ColumnSegment &segment)
+    {
+        vector<BasicRecord> sorted = records;
+        stable_sort(sorted.begin(), sorted.end(), [](const BasicRecord &left, const BasicRecord &right) { return left.timestamp < right.timestamp; });
+        for (size_t row = 0; row < sorted.size(); row += 37)
+        {
+            assert(segment.timestamp(row) == sorted[row].timestamp);
+            assert(segment.reading(row, 3) == sorted[row].readings[3]);
+        }
+        for (int query = 0; query < 200; query++)
+        {
+            int begin = (int)(random() % 62000) - 1000;
+            int end = begin + (int)(random() % (query < 100 ? 2000 : 70000));
+            for (int column : { 0, 1, 2, 3, 9 })
+            {
+                Aggregate expected;
+                for (const auto &record : records)
+                {
+                    if (record.timestamp >= begin && record.timestamp < end)
+                    {
+                        expected.add(record.readings[column]);
+                    }
+                }
+                Aggregate actual = segment.aggregate(column, begin, end);
+                assert(actual.count == expected.count && actual.sum == expected.sum);
+                assert(actual.min == expected.min && actual.max == expected.max);
+            }
+        }
+    };
+    check(segment);
+
+    filesystem::path segment_path = filesystem::temp_directory_path().append("SoftwareDesignByExample.col");
+    segment.save(segment_path);
+    check(ColumnSegment::load(segment_path));
+    filesystem::remove(segment_path);
+
+    assert(ColumnSegment(vector<BasicRecord>()).aggregate(0, 0, 100).count == 0);
+}
+
+void test_batches()
+{
+    auto check = [](Database &db)
+    {
+        vector<BasicRecord> records;
+        for (int i = 0; i < 300; i++)
+        {
+            records.push_back({ "b" + to_string((i * 37) % 250), i });
+        }
+        db.add_batch(records.data(), 100);
+        db.add_batch(records.data() + 100, records.size() - 100);
+        db.add_batch(records.data(), 0);
+        vector<string> keys;
+        for (int i = 0; i < 300; i++)
+        {
+            keys.push_back("b" + to_string(i));
+        }
+        vector<BasicRecord> result(keys.size());
+        db.get_batch(keys.data(), keys.size(), result.data());
+        for (int i = 0; i < 300; i++)
+        {
+            // the last of the duplicates wins
+            int expected = -1;
+            for (int j = 0; j < 300; j++)
+            {
+                expected = (j * 37) % 250 == i ? j : expected;
+            }
+            assert(expected < 0 ? result[i] == BasicRecord() : result[i].timestamp == expected);
+            assert(result[i] == db.get(keys[i]));
+        }
+    };
+
+    MemDb memdb;
+    check(memdb);
+    ConcurrentMemDb concurrent(8);
+    check(concurrent);
+
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxbatch");
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+    {
+        BlockFileOptions options;
+        options.cache_blocks = 8;
+        BlockFileDb db(db_dir_path, options);
+        check(db);
+        assert(db.block_stats().prefetches > 0);
+    }
+    {
+        BlockFileOptions options;
+        options.cache_blocks = 8;
+        BlockFileDb db(db_dir_path, options);
+        assert(db.num_records() == 250);
+        assert(db.get("b37").timestamp == 251);
+    }
+    filesystem::remove_all(db_dir_path);
+
+    LsmOptions options;
+    options.memtable_records = 64;
+    options.table_records = 64;
+    {
+        LsmDb db(db_dir_path, options);
+        check(db);
+    }
+    {
+        LsmDb db(db_dir_path, options);
+        assert(db.get("b37").timestamp == 251);
+        assert(db.get("b249").timestamp == 277);
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_slotted_page()
+{
+    char buffer[256] = {};
+    SlottedPage page(buffer, sizeof(buffer));
+    assert(page.slot_count() == 0 && page.free_space() == 256 - SlottedPage::HEADER_SIZE);
+    vector<uint32_t> slots;
+    uint32_t slot;
+    for (int i = 0; page.insert(string(20, (char)('a' + i)), slot); i++)
+    {
+        assert(slot == (uint32_t)i);
+        slots.push_back(slot);
+    }
+    assert(slots.size() == 10);
+    assert(page.record(3) == string(20, 'd'));
+
+    // freed space is reused, the slots of the other records don't change
+    page.erase(2);
+    page.erase(5);
+    assert(page.update(3, string(30, 'D')));
+    assert(page.insert("short", slot) && slot == 2);
+    assert(!page.update(4, string(60, 'E')));
+    assert(page.update(4, string(40, 'E')));
+    assert(page.record(3) == string(30, 'D'));
+    assert(page.record(4) == string(40, 'E'));
+    assert(page.record(2) == "short");
+    assert(page.record(5).empty());
+    assert(page.record(9) == string(20, 'j'));
+    assert(page.update(9, "j"));
+    assert(page.record(9) == "j");
+
+    // a new slot on a full directory when the space is only free after compacting
+    char small[64] = {};
+    SlottedPage tight(small, sizeof(small));
+    assert(tight.insert(string(20, 'a'), slot) && tight.insert(string(20, 'b'), slot) && tight.insert(string(8, 'c'), slot));
+    assert(tight.update(0, string(10, 'A')));
+    assert(tight.insert("ddddd", slot) && slot == 3);
+    assert(tight.record(0) == string(10, 'A') && tight.record(1) == string(20, 'b'));
+    assert(tight.record(2) == string(8, 'c') && tight.record(3) == "ddddd");
+    assert(tight.free_space() == 1);
+}
+
+void test_var_record()
+{
+    filesystem::path dictionary_path = filesystem::temp_directory_path().append("SoftwareDesignByExample.dict");
+    filesystem::remove(dictionary_path);
+    BasicRecord first{ "sensor-12-000345", -7, { 1, -1, 300, INT_MAX, INT_MIN } };
+    BasicRecord second{ "sensor-12-000346", 1700000000 };
+    BasicRecord long_name{ string(100, 'x') + "1", 1 };
+    string encoded;
+    {
+        KeyDictionary dictionary(dictionary_path);
+        encoded = VarRecord::encode(first, dictionary);
+        assert(VarRecord::decode(encoded, dictionary) == first);
+        assert(VarRecord::decode(VarRecord::encode(second, dictionary), dictionary) == second);
+        assert(VarRecord::decode(VarRecord::encode(long_name, dictionary), dictionary) == long_name);
+        assert(VarRecord::decode(VarRecord::encode({ "7", 0 }, dictionary), dictionary).name == "7");
+        assert(dictionary.size() == 2);
+        assert(encoded.size() < 30);
+    }
+    {
+        KeyDictionary dictionary(dictionary_path);
+        assert(dictionary.size() == 2 && dictionary.prefix(0) == "sensor-12-");
+        assert(VarRecord::decode(encoded, dictionary) == first);
+    }
+    filesystem::remove(dictionary_path);
+
+    bool threw = false;
+    try
+    {
+        char packed[BasicRecord::packed_size];
+        long_name.pack(packed);
+    }
+    catch (const invalid_argument &)
+    {
+        threw = true;
+    }
+    assert(threw);
+}
+
+void test_blockfiledb_slotted()
+{
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxslotted");
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+    BlockFileOptions options;
+    options.cache_blocks = 2;
+    options.format = RecordFormat::slotted;
+
+    {
+        BlockFileDb db(db_dir_path, options);
+        for (int i = 0; i < 1000; i++)
+        {
+            db.add({ "sensor-" + to_string(i % 7) + "-" + to_string(i), i, { i % 100 } });
+        }
+        // grown in place and moved out of a full page
+        db.add({ "sensor-0-0", 5, { 1000000, 1000000, 1000000, 1000000, 1000000, 1000000 } });
+        db.add({ "sensor-1-1", 6 });
+    }
+
+    {
+        BlockFileDb db(db_dir_path, options);
+        assert(db.num_records() == 1000);
+        assert(db.get("sensor-0-0").readings[5] == 1000000);
+        assert(db.get("sensor-1-1").timestamp == 6);
+        assert(db.get("sensor-5-999").timestamp == 999);
+        auto result = db.scan("sensor-4-", "sensor-5-");
+        assert(result.size() == 143);
+        // far fewer blocks than records_per_block would need
+        size_t blocks = 0;
+        for (const auto &entry : filesystem::directory_iterator(db_dir_path))
+        {
+            blocks += entry.path().extension() == ".db";
+        }
+        assert(blocks < 20);
+    }
+
+    {
+        filesystem::remove(db_dir_path / "index.bpt");
+        BlockFileDb db(db_dir_path, options);
+        assert(db.num_records() == 1000);
+        assert(db.get("sensor-0-0").readings[5] == 1000000);
+    }
+
+    bool threw = false;
+    try
+    {
+        BlockFileDb db(db_dir_path);
+    }
+    catch (const runtime_error &)
+    {
+        threw = true;
+    }
+    assert(threw);
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_blockfiledb_bloom()
+{
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxbloom");
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+
+    {
+        BlockFileDb db(db_dir_path);
+        for (int i = 0; i < 3000; i++)
+        {
+            db.add({ "k" + to_string(i), i });
+        }
+        // outgrew the first filter
+        assert(db.bloom_stats().rebuilds >= 2);
+    }
+
+    {
+        BlockFileDb db(db_dir_path);
+        assert(db.bloom_stats().rebuilds == 0);
+        size_t index_reads = db.index_stats().misses + db.index_stats().hits;
+        for (int i = 0; i < 1000; i++)
+        {
+            assert(db.get("k" + to_string(i) + "x") == BasicRecord());
+        }
+        assert(db.bloom_stats().negatives > 950);
+        assert(db.index_stats().misses + db.index_stats().hits - index_reads < 200);
+        for (int i = 0; i < 3000; i += 3)
+        {
+            assert(db.get("k" + to_string(i)).timestamp == i);
+        }
+        db.add({ "new", 1 });
+    }
+
+    {
+        // a filter that doesn't cover every key isn't used
+        filesystem::copy_file(db_dir_path / "keys.bloom", db_dir_path / "old.bloom");
+        {
+            BlockFileDb db(db_dir_path);
+            db.add({ "newer", 2 });
+        }
+        filesystem::rename(db_dir_path / "old.bloom", db_dir_path / "keys.bloom");
+        BlockFileDb db(db_dir_path);
+        assert(db.bloom_stats().rebuilds == 1);
+        assert(db.get("newer").timestamp == 2);
+    }
+
+    // the key whose add outgrows the filter is in the rebuilt one, slotted records too
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+    BlockFileOptions options;
+    options.format = RecordFormat::slotted;
+    {
+        BlockFileDb db(db_dir_path, options);
+        for (int i = 0; i < 3000; i++)
+        {
+            db.add({ "s" + to_string(i), i });
+        }
+        assert(db.bloom_stats().rebuilds >= 2);
+        for (int i = 0; i < 3000; i++)
+        {
+            assert(db.get("s" + to_string(i)).timestamp == i);
+        }
+    }
+    {
+        BlockFileDb db(db_dir_path, options);
+        assert(db.bloom_stats().rebuilds == 0);
+        for (int i = 0; i < 3000; i++)
+        {
+            assert(db.get("s" + to_string(i)).timestamp == i);
+        }
+    }
+
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_blockfiledb_indexes()
+{
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxindexes");
+    auto sensor = [](int i)
+    {
+        BasicRecord record{ "s" + to_string(i), i };
+        record.readings[2] = i % 50 - 25;
+        return record;
+    };
+    auto names = [](const QueryResult &result)
+    {
+        vector<string> names;
+        for (const auto &record : result.records)
+        {
+            names.push_back(record.name);
+        }
+        return names;
+    };
+
+    for (RecordFormat format : { RecordFormat::fixed, RecordFormat::slotted })
+    {
+        filesystem::remove_all(db_dir_path);
+        filesystem::create_directory(db_dir_path);
+        BlockFileOptions options;
+        options.format = format;
+        options.indexes = { IndexSpec::timestamp(), IndexSpec::reading(2) };
+        options.index_batch = 64;
+
+        {
+            BlockFileDb db(db_dir_path, options);
+            for (int i = 0; i < 1000; i++)
+            {
+                db.add(sensor(i));
+            }
+            QueryResult range = db.find_by_timestamp_range(100, 200);
+            assert(range.used_index);
+            assert(range.records.size() == 100 && range.rows_examined == 100);
+            assert(range.records.front().name == "s100" && range.records.back().name == "s199");
+            QueryResult greater = db.find_where_reading_gt(2, 20);
+            assert(greater.used_index);
+            assert(greater.records.size() == 80 && greater.rows_examined == 80);
+            assert(greater.records.front().readings[2] == 21 && greater.records.back().readings[2] == 24);
+            QueryResult negative = db.find_where_reading_gt(2, -26);
+            assert(negative.records.size() == 1000);
+            assert(db.find_by_timestamp_range(5, 5).records.empty());
+
+            // unindexed fields are answered by reading everything
+            QueryResult unindexed = db.find_where_reading_gt(3, -1);
+            assert(!unindexed.used_index && unindexed.rows_examined == 1000 && unindexed.records.size() == 1000);
+
+            // overwrites move the entries, a longer record may move to another page too
+            BasicRecord moved = sensor(5);
+            moved.timestamp = 5000;
+            moved.readings[2] = 100;
+            db.add(moved);
+            vector<BasicRecord> batch = { sensor(6), sensor(7) };
+            batch[0].timestamp = 5001;
+            batch[1].timestamp = -7;
+            db.add_batch(batch.data(), batch.size());
+            assert(names(db.find_by_timestamp_range(0, 10)) == vector<string>({ "s0", "s1", "s2", "s3", "s4", "s8", "s9" }));
+            assert(names(db.find_by_timestamp_range(INT_MIN, 0)) == vector<string>({ "s7" }));
+            assert(names(db.find_by_timestamp_range(5000, INT_MAX)) == vector<string>({ "s5", "s6" }));
+            assert(names(db.find_where_reading_gt(2, 24)) == vector<string>({ "s5" }));
+            assert(db.get("s5").readings[2] == 100);
+
+            // the value takes the first four bytes of an index key
+            bool thrown = false;
+            try
+            {
+                db.add({ "a-twenty-char-name-x", 1 });
+            }
+            catch (const invalid_argument &)
+            {
+                thrown = true;
+            }
+            assert(thrown && db.num_records() == 1000);
+        }
+
+        {
+            BlockFileDb db(db_dir_path, options);
+            assert(names(db.find_by_timestamp_range(5000, INT_MAX)) == vector<string>({ "s5", "s6" }));
+            assert(db.find_where_reading_gt(2, 20).records.size() == 81);
+        }
+
+        {
+            // changes made without the indexes open leave them stale, they are rebuilt
+            BlockFileOptions plain;
+            plain.format = format;
+            BlockFileDb db(db_dir_path, plain);
+            db.add({ "s1", 7000 });
+        }
+
+        {
+            BlockFileDb db(db_dir_path, options);
+            assert(names(db.find_by_timestamp_range(5000, INT_MAX)) == vector<string>({ "s5", "s6", "s1" }));
+            assert(db.find_by_timestamp_range(0, 1000).rows_examined == 996);
+        }
+    }
+
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_block_checksums()
+{
+    const char *check = "123456789";
+    assert(Crc32c::compute(check, 9) == 0xE3069283);
+    assert(Crc32c::software(check, 9) == 0xE3069283);
+    assert(Crc32c::compute(check + 4, 5, Crc32c::compute(check, 4)) == 0xE3069283);
+    mt19937 random(44);
+    string data(1000, '\0');
+    generate(data.begin(), data.end(), [&]() { return (char)random(); });
+    for (size_t size : { 0, 1, 7, 8, 9, 63, 1000 })
+    {
+        assert(Crc32c::compute(data.data(), size) == Crc32c::software(data.data(), size));
+    }
+
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxchecksums");
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+    const size_t block_size = 64;
+    BlockFileStore store(db_dir_path, block_size);
+    string old_block(block_size, 'a'), new_block(block_size, 'b');
+    store.write_page(1, old_block.data());
+    string buffer(block_size, '\0');
+    store.read_page(1, &buffer[0]);
+    assert(buffer == old_block);
+
+    // a write cut off anywhere leaves the old block
+    for (int trial = 0; trial < 50; trial++)
+    {
+        store.inject_write_fault(random() % (BlockFileStore::HEADER_SIZE + block_size));
+        bool thrown = false;
+        try
+        {
+            store.write_page(1, new_block.data());
+        }
+        catch (const runtime_error &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+        store.read_page(1, &buffer[0]);
+        assert(buffer == old_block);
+        assert(store.verify(2).empty());
+        assert(!filesystem::exists(db_dir_path / "1.db.tmp"));
+    }
+    store.write_page(1, new_block.data());
+    store.read_page(1, &buffer[0]);
+    assert(buffer == new_block);
+
+    // so is one cut off in place, or damaged on disk
+    for (int trial = 0; trial < 20; trial++)
+    {
+        store.write_page(2, old_block.data());
+        filesystem::path file_path = store.get_file_path(2);
+        if (trial % 2 == 0)
+        {
+            filesystem::resize_file(file_path, 1 + random() % (filesystem::file_size(file_path) - 1));
+        }
+        else
+        {
+            fstream file(file_path, ios_base::in | ios_base::out | ios_base::binary);
+            file.seekp(BlockFileStore::HEADER_SIZE + random() % block_size);
+            file.put('z');
+        }
+        assert(store.verify(4) == vector<uint64_t>({ 2 }));
+        bool thrown = false;
+        try
+        {
+            store.read_page(2, &buffer[0]);
+        }
+        catch (const runtime_error &)
+        {
+            thrown = true;
+        }
+        assert(thrown);
+    }
+
+    // blocks from before the checksums are read as they are
+    string legacy = "an old short block";
+    ofstream(store.get_file_path(3), ios_base::binary) << legacy;
+    store.read_page(3, &buffer[0]);
+    assert(buffer == legacy + string(block_size - legacy.size(), '\0'));
+    ofstream(store.get_file_path(3), ios_base::binary) << old_block;
+    store.read_page(3, &buffer[0]);
+    assert(buffer == old_block);
+
+    // but a checksummed block with a damaged magic isn't taken for one (block
+    // 2 is still damaged from above)
+    for (size_t position = 0; position < sizeof(BlockFileStore::MAGIC); position++)
+    {
+        store.write_page(4, old_block.data());
+        fstream file(store.get_file_path(4), ios_base::in | ios_base::out | ios_base::binary);
+        file.seekp(position);
+        file.put('z');
+        file.close();
+        assert(store.verify(2) == vector<uint64_t>({ 2, 4 }));
+    }
+    filesystem::remove_all(db_dir_path);
+
+    filesystem::create_directory(db_dir_path);
+    BlockFileOptions options;
+    options.verify_threads = 4;
+    {
+        BlockFileDb db(db_dir_path, options);
+        for (int i = 0; i < 100; i++)
+        {
+            db.add({ "v" + to_string(i), i });
+        }
+    }
+    {
+        BlockFileDb db(db_dir_path, options);
+        assert(db.get("v42").timestamp == 42);
+    }
+    filesystem::resize_file(db_dir_path / "7.db", 20);
+    bool thrown = false;
+    try
+    {
+        BlockFileDb db(db_dir_path, options);
+    }
+    catch (const runtime_error &)
+    {
+        thrown = true;
+    }
+    assert(thrown);
+    filesystem::remove_all(db_dir_path);
+}
+
+void test_benchmark_tools()
+{
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 100000; value++)
+    {
+        histogram.record(value);
+    }
+    assert(histogram.count() == 100000 && histogram.max_value() == 100000);
+    assert(histogram.percentile(0.05) == 50);
+    for (double percent : { 50.0, 90.0, 99.0, 99.9 })
+    {
+        double exact = percent * 1000;
+        assert(histogram.percentile(percent) >= exact && histogram.percentile(percent) <= exact * 1.016);
+    }
+    assert(histogram.percentile(100) == 100000);
+    LatencyHistogram other;
+    other.record(UINT64_MAX / 2);
+    histogram.merge(other);
+    assert(histogram.count() == 100001 && histogram.max_value() == UINT64_MAX / 2);
+
+    KeyGenerator sequential(KeyDistribution::sequential, 10);
+    sequential.seed(1, 8);
+    assert(sequential() == 8 && sequential() == 9 && sequential() == 0);
+
+    // the hottest zipfian key gets a large share, uniform keys don't
+    for (auto distribution : { KeyDistribution::uniform, KeyDistribution::zipfian })
+    {
+        KeyGenerator keys(distribution, 1000);
+        keys.seed(7);
+        map<uint64_t, size_t> counts;
+        for (int i = 0; i < 100000; i++)
+        {
+            uint64_t key = keys();
+            assert(key < 1000);
+            counts[key]++;
+        }
+        size_t hottest = 0;
+        for (const auto &[key, count] : counts)
+        {
+            hottest = max(hottest, count);
+        }
+        assert(distribution == KeyDistribution::zipfian ? hottest > 10000 : hottest < 200);
+    }
+
+    BenchmarkConfig config;
+    config.store = "MemDb";
+    config.records = 1000;
+    config.operations = 10000;
+    config.threads = 3;
+    config.read_percent = 90;
+    MemDb db;
+    BenchmarkResult result = run_benchmark(db, config, false);
+    assert(result.reads.count() + result.writes.count() == 10000);
+    assert(result.reads.count() > 8500 && result.reads.count() < 9500);
+    json entry = result.to_json();
+    assert(entry["threads"] == 3 && entry["distribution"] == "uniform");
+    assert(entry["reads"]["count"] == result.reads.count());
+}
+
+void test_bplustree()
+{
+    filesystem::path tree_path = filesystem::temp_directory_path().append("SoftwareDesignByExample.bpt");
+    filesystem::remove(tree_path);
+    const uint32_t count = 20000;
+    auto key = [](uint32_t i)
+    {
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "k%07u", i);
+        return string(buffer);
+    };
+
+    {
+        // a small cache, so pages are evicted and written back during the inserts
+        BPlusTree tree(tree_path, 8);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t shuffled = (i * 7919) % count;
+            tree.insert(key(shuffled), { shuffled, shuffled % 3 });
+        }
+        tree.insert(key(42), { 4242, 2 });
+        tree.set_user_value(count);
+        assert(tree.size() == count);
+        assert(tree.height() >= 3);
+    }
+
+    {
+        BPlusTree tree(tree_path, 8);
+        assert(tree.size() == count);
+        assert(tree.user_value() == count);
+        BlockSlot location;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            assert(tree.find(key(i), location));
+            assert(location.block == (i == 42 ? 4242 : i));
+        }
+        assert(!tree.find("k", location));
+        assert(!tree.find("z", location));
+
+        vector<string> keys;
+        tree.scan(key(1000), key(1300), [&](string_view k, BlockSlot)
+        {
+            keys.emplace_back(k);
+            return true;
+        });
+        assert(keys.size() == 300);
+        assert(keys.front() == key(1000) && keys.back() == key(1299));
+        assert(is_sorted(keys.begin(), keys.end()));
+        size_t total = 0;
+        tree.scan("", "", [&](string_view, BlockSlot) { total++; return true; });
+        assert(total == count);
+    }
+
+    filesystem::remove(tree_path);
+}
+
+void sweep_filedb()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 100000, 10000000 };
+#else
+    vector<size_t> sizes = { 1000, 100000 };
+#endif
+    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExampleSweep.db");
+    auto cleanup = [&]()
+    {
+        for (const char *suffix : { "", ".wal", ".wal.old", ".tmp" })
+        {
+            filesystem::remove(filesystem::path(db_file_path) += suffix);
+        }
+    };
+
+    cout << "FileDb inserts (inserts/sec)" << endl;
+    cout << "records\trewrite\twal\twal_sync" << endl;
+    for (auto size : sizes)
+    {
+        vector<double> rates;
+        // rewrite: the old behaviour, the whole file saved after every add
+        for (int mode = 0; mode < 3; mode++)
+        {
+            cleanup();
+            if (mode == 0 && size > 1000)
+            {
+                rates.push_back(0);
+                continue;
+            }
+            WalOptions options;
+            options.sync = mode == 2;
+            auto start = chrono::steady_clock::now();
+            {
+                FileDb db(db_file_path, options);
+                for (size_t i = 0; i < size; i++)
+                {
+                    db.add({ "k" + to_string(i), (int)i });
+                    if (mode == 0)
+                    {
+                        db.checkpoint();
+                    }
+                }
+            }
+            double ms = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            rates.push_back(size / ms * 1000);
+        }
+        cout << size << "\t" << rates[0] << "\t" << rates[1] << "\t" << rates[2] << endl;
+    }
+    cleanup();
+}
+
+void sweep_mvcc_memdb()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+    const size_t records = 100000;
+    const size_t ops_per_thread = 200000;
+    vector<size_t> thread_counts = { 1, 2, 4, 8 };
+
+    // one thread scans everything over and over while the writers run
+    cout << "Writers overwriting " << records << " uniform keys next to a full scan loop (million adds/sec, scans/sec)" << endl;
+    cout << "writers\tlocked_adds\tlocked_scans\tmvcc_adds\tmvcc_scans" << endl;
+    for (auto thread_count : thread_counts)
+    {
+        vector<double> rates;
+        auto run = [&](Database &db)
+        {
+            for (size_t i = 0; i < records; i++)
+            {
+                db.add({ "user" + to_string(i), (int)i });
+            }
+            atomic<bool> done{ false };
+            size_t scans = 0;
+            thread scanner([&]()
+            {
+                for (; !done; scans++)
+                {
+                    db.scan("", "");
+                }
+            });
+            vector<thread> threads;
+            auto start = chrono::steady_clock::now();
+            for (size_t t = 0; t < thread_count; t++)
+            {
+                threads.emplace_back([&, t]()
+                {
+                    mt19937 random((unsigned)t + 1);
+                    for (size_t i = 0; i < ops_per_thread; i++)
+                    {
+                        db.add({ "user" + to_string(random() % records), (int)i });
+                    }
+                });
+            }
+            for (auto &worker : threads)
+            {
+                worker.join();
+            }
+            double elapsed = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            done = true;
+            scanner.join();
+            rates.push_back(thread_count * ops_per_thread / elapsed / 1000.0);
+            rates.push_back(scans * 1000.0 / elapsed);
+        };
+        {
+            ConcurrentMemDb db;
+            run(db);
+        }
+        {
+            MvccMemDb db;
+            run(db);
+        }
+        cout << thread_count << "\t" << rates[0] << "\t" << rates[1] << "\t" << rates[2] << "\t" << rates[3] << endl;
+    }
+}
+
+void sweep_mappeddb()
 {
-    filesystem::path db_dir_path = filesystem::temp_directory_path();
-    db_dir_path.append("sdbxdb");
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 100000, 1000000, 10000000 };
+#else
+    vector<size_t> sizes = { 1000, 100000, 1000000 };
+#endif
+    const size_t lookups = 100000;
+    filesystem::path db_file_path = filesystem::temp_directory_path().append("SoftwareDesignByExampleSweep.db");
+    auto cleanup = [&]()
+    {
+        for (const char *suffix : { "", ".wal", ".idx", ".log" })
+        {
+            filesystem::remove(filesystem::path(db_file_path) += suffix);
+        }
+    };
+
+    cout << "Startup and lookups, FileDb vs MappedDb (times are in ms, " << lookups << " lookups)" << endl;
+    cout << "records\tfile_open\tfile_get\tmap_open\tmap_get" << endl;
+    for (auto size : sizes)
+    {
+        cleanup();
+        {
+            string contents(size * BasicRecord::packed_size, '\0');
+            for (size_t i = 0; i < size; i++)
+            {
+                BasicRecord record{ "k" + to_string(i), (int)i };
+                record.pack(&contents[i * BasicRecord::packed_size]);
+            }
+            ofstream(db_file_path, ios_base::binary).write(contents.data(), contents.size());
+            MappedDb index_builder(db_file_path);     // builds the index
+        }
+        vector<double> times;
+        {
+            auto start = chrono::steady_clock::now();
+            FileDb db(db_file_path);
+            auto opened = chrono::steady_clock::now();
+            long long total = 0;
+            for (size_t i = 0; i < lookups; i++)
+            {
+                total += db.get("k" + to_string((i * 7919) % size)).timestamp;
+            }
+            auto done = chrono::steady_clock::now();
+            times.push_back((opened - start).count() * NANO_TO_MS);
+            times.push_back((done - opened).count() * NANO_TO_MS);
+        }
+        {
+            auto start = chrono::steady_clock::now();
+            MappedDb db(db_file_path);
+            auto opened = chrono::steady_clock::now();
+            long long total = 0;
+            for (size_t i = 0; i < lookups; i++)
+            {
+                total += db.view("k" + to_string((i * 7919) % size)).timestamp();
+            }
+            auto done = chrono::steady_clock::now();
+            times.push_back((opened - start).count() * NANO_TO_MS);
+            times.push_back((done - opened).count() * NANO_TO_MS);
+        }
+        cout << size << "\t" << times[0] << "\t" << times[1] << "\t" << times[2] << "\t" << times[3] << endl;
+    }
+    cleanup();
+}
+
+void sweep_bptree()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 100000, 1000000, 10000000 };
+#else
+    vector<size_t> sizes = { 1000, 100000, 1000000 };
+#endif
+    const size_t lookups = 100000;
+    const size_t scans = 1000;
+    const size_t scan_length = 100;
+    const size_t cache_pages = 256;     // 1 MB of pages
+    filesystem::path tree_path = filesystem::temp_directory_path().append("SoftwareDesignByExampleSweep.bpt");
+    auto key = [](size_t i)
+    {
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "k%09zu", i);
+        return string(buffer);
+    };
+
+    cout << "B+tree (" << cache_pages << " cached pages) vs map, times are in ms for "
+        << lookups << " lookups and " << scans << " scans of " << scan_length << endl;
+    cout << "records\tmap_get\ttree_get\tmap_scan\ttree_scan\ttree_height" << endl;
+    for (auto size : sizes)
+    {
+        filesystem::remove(tree_path);
+        map<string, BlockSlot> in_memory;
+        {
+            BPlusTree tree(tree_path, cache_pages);
+            for (size_t i = 0; i < size; i++)
+            {
+                size_t shuffled = (i * 7919) % size;
+                BlockSlot location{ (uint32_t)(shuffled / BlockDb::records_per_block), (uint32_t)(shuffled % BlockDb::records_per_block) };
+                tree.insert(key(shuffled), location);
+                in_memory[key(shuffled)] = location;
+            }
+        }
+        vector<double> times;
+        uint64_t total = 0;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; i++)
+        {
+            total += in_memory.at(key((i * 104729) % size)).block;
+        }
+        times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+
+        BPlusTree tree(tree_path, cache_pages);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; i++)
+        {
+            BlockSlot location;
+            tree.find(key((i * 104729) % size), location);
+            total += location.block;
+        }
+        times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < scans; i++)
+        {
+            size_t n = 0;
+            for (auto it = in_memory.lower_bound(key((i * 104729) % size)); it != in_memory.end() && n < scan_length; ++it, ++n)
+            {
+                total += it->second.slot;
+            }
+        }
+        times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < scans; i++)
+        {
+            size_t n = 0;
+            tree.scan(key((i * 104729) % size), "", [&](string_view, BlockSlot location)
+            {
+                total += location.slot;
+                return ++n < scan_length;
+            });
+        }
+        times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+        cout << size << "\t" << times[0] << "\t" << times[1] << "\t" << times[2] << "\t" << times[3] << "\t" << tree.height() << endl;
+    }
+    filesystem::remove(tree_path);
+}
+
+void sweep_block_cache()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    const size_t size = 1000000;
+#else
+    const size_t size = 100000;
+#endif
+    const size_t lookups = 200000;
+    vector<size_t> cache_sizes = { 16, 256, 4096, 65536 };
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+    filesystem::remove_all(db_dir_path);
     filesystem::create_directory(db_dir_path);
+    {
+        BlockFileOptions options;
+        options.cache_blocks = 4096;
+        BlockFileDb db(db_dir_path, options);
+        for (size_t i = 0; i < size; i++)
+        {
+            db.add({ "k" + to_string(i), (int)i });
+        }
+    }
 
-    BasicRecord ex01{ "ex01", 12345, {1, 2} };
-    BasicRecord ex02{ "ex02", 67890, {3, 4} };
-    BasicRecord ex03{ "ex03", 77777, {7, 7} };
+    // skewed reads: 90% of them go to 10% of the keys
+    cout << "BlockFileDb block cache, " << size << " records, " << lookups << " lookups (times are in ms)" << endl;
+    cout << "cache_blocks\tcache_kb\ttime\thit_ratio\tevictions\tmb_read" << endl;
+    for (auto cache_size : cache_sizes)
+    {
+        BlockFileOptions options;
+        options.cache_blocks = cache_size;
+        BlockFileDb db(db_dir_path, options);
+        mt19937 random(42);
+        long long total = 0;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; i++)
+        {
+            size_t key = random() % (i % 10 == 0 ? size : size / 10);
+            total += db.get("k" + to_string(key)).timestamp;
+        }
+        auto elapsed = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        const PoolStats &stats = db.block_stats();
+        cout << cache_size << "\t" << cache_size * BlockFileStore::BLOCK_SIZE / 1024 << "\t" << elapsed << "\t"
+            << stats.hit_ratio() << "\t" << stats.evictions << "\t" << stats.bytes_read / 1048576.0 << endl;
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void sweep_lsmdb()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 10000, 100000, 1000000, 10000000 };
+#else
+    vector<size_t> sizes = { 10000, 100000, 1000000 };
+#endif
+    const size_t lookups = 100000;
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
 
+    // sensor readings arrive in time order, keyed by sensor and sequence number
+    auto reading = [](size_t i)
     {
-        BlockFileDb db(db_dir_path);
-        db.add(ex01);
-        db.add(ex02);
-        db.add(ex03);
+        BasicRecord record{ "s" + to_string(i % 64) + "-" + to_string(i / 64), (int)i };
+        for (int r = 0; r < 10; r++)
+        {
+            record.readings[r] = (int)(i * 31 + r);
+        }
+        return record;
+    };
+
+    cout << "Sustained writes and read amplification, BlockFileDb vs LsmDb (" << lookups << " lookups, half of them misses)" << endl;
+    cout << "records\tblock_add/s\tlsm_add/s\tlsm_write_amp\tlsm_stalls\tblock_pages/get\tlsm_tables/get\tlsm_records/get" << endl;
+    for (auto size : sizes)
+    {
+        vector<double> values;
+        {
+            filesystem::remove_all(db_dir_path);
+            filesystem::create_directory(db_dir_path);
+            auto start = chrono::steady_clock::now();
+            {
+                BlockFileDb db(db_dir_path);
+                for (size_t i = 0; i < size; i++)
+                {
+                    db.add(reading(i));
+                }
+            }
+            values.push_back(size / ((chrono::steady_clock::now() - start).count() * NANO_TO_MS / 1000.0));
+            BlockFileDb db(db_dir_path);
+            for (size_t i = 0; i < lookups; i++)
+            {
+                db.get(reading((i * 104729) % (2 * size)).name);
+            }
+            size_t pages = db.block_stats().misses + db.index_stats().misses;
+            values.push_back((double)pages / lookups);
+        }
+        {
+            filesystem::remove_all(db_dir_path);
+            LsmStats stats;
+            auto start = chrono::steady_clock::now();
+            {
+                LsmDb db(db_dir_path);
+                for (size_t i = 0; i < size; i++)
+                {
+                    db.add(reading(i));
+                }
+                db.flush();
+                stats = db.stats();
+            }
+            values.push_back(size / ((chrono::steady_clock::now() - start).count() * NANO_TO_MS / 1000.0));
+            values.push_back(stats.write_amplification());
+            values.push_back((double)stats.write_stalls);
+            LsmDb db(db_dir_path);
+            for (size_t i = 0; i < lookups; i++)
+            {
+                db.get(reading((i * 104729) % (2 * size)).name);
+            }
+            stats = db.stats();
+            values.push_back(stats.tables_per_get());
+            values.push_back((double)stats.records_read / lookups);
+        }
+        cout << size << "\t" << values[0] << "\t" << values[2] << "\t" << values[3] << "\t" << values[4]
+            << "\t" << values[1] << "\t" << values[5] << "\t" << values[6] << endl;
     }
+    filesystem::remove_all(db_dir_path);
+}
 
+void sweep_concurrent_memdb()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+    const size_t records = 100000;
+    const size_t ops_per_thread = 500000;
+    vector<size_t> thread_counts = { 1, 2, 4, 8, 16 };
+    struct Workload
     {
-        BlockFileDb db(db_dir_path);
-        assert(db.get("ex01") == ex01);
-        assert(db.get("ex02") == ex02);
-        assert(db.get("ex03") == ex03);
+        const char *name;
+        int read_percent;
+    };
+    vector<Workload> workloads = { { "read_heavy", 95 }, { "mixed", 50 }, { "write_heavy", 5 } };
+
+    // a single shard is one reader-writer lock around the whole table
+    cout << "ConcurrentMemDb, YCSB-style uniform keys over " << records << " records (million ops/sec)" << endl;
+    cout << "workload\tthreads\t1_shard\t64_shards" << endl;
+    for (const auto &workload : workloads)
+    {
+        for (auto thread_count : thread_counts)
+        {
+            vector<double> rates;
+            for (size_t num_shards : { 1, 64 })
+            {
+                ConcurrentMemDb db(num_shards);
+                for (size_t i = 0; i < records; i++)
+                {
+                    db.add({ "user" + to_string(i), (int)i });
+                }
+                vector<thread> threads;
+                auto start = chrono::steady_clock::now();
+                for (size_t t = 0; t < thread_count; t++)
+                {
+                    threads.emplace_back([&, t]()
+                    {
+                        mt19937 random((unsigned)t + 1);
+                        long long total = 0;
+                        for (size_t i = 0; i < ops_per_thread; i++)
+                        {
+                            string key = "user" + to_string(random() % records);
+                            if ((int)(random() % 100) < workload.read_percent)
+                            {
+                                total += db.get(key).timestamp;
+                            }
+                            else
+                            {
+                                db.add({ key, (int)i });
+                            }
+                        }
+                    });
+                }
+                for (auto &worker : threads)
+                {
+                    worker.join();
+                }
+                double elapsed = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+                rates.push_back(thread_count * ops_per_thread / elapsed / 1000.0);
+            }
+            cout << workload.name << "\t" << thread_count << "\t" << rates[0] << "\t" << rates[1] << endl;
+        }
+    }
+}
+
+void sweep_column_segment()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    const int interval = 1;             // a year of readings every second, 31.5M records
+#else
+    const int interval = 60;
+#endif
+    const int day = 24 * 60 * 60;
+    const int year = 365 * day;
+    const int queries = 20;
+    mt19937 random(1);
+    vector<BasicRecord> records;
+    for (int time = 0; time < year; time += interval)
+    {
+        // slowly varying sensor values with a little noise
+        BasicRecord record{ "s", time };
+        for (int r = 0; r < 10; r++)
+        {
+            record.readings[r] = 1000 * r + (time / 3600) % 240 + (int)(random() % 16);
+        }
+        records.push_back(record);
+    }
+    string rows(records.size() * BasicRecord::packed_size, '\0');
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        records[i].pack(&rows[i * BasicRecord::packed_size]);
+    }
+    auto start = chrono::steady_clock::now();
+    ColumnSegment segment(records);
+    double build_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+
+    cout << "Columnar aggregates over " << records.size() << " records (times are in ms per sum/min/max/avg query)" << endl;
+    cout << "bytes/record: rows " << BasicRecord::packed_size << ", columns " << (double)segment.bytes() / records.size()
+        << ", build " << build_time << " ms" << endl;
+    cout << "range\trecords\trows\tcolumns" << endl;
+    vector<pair<const char *, int>> ranges = { { "hour", 3600 }, { "day", day }, { "week", 7 * day }, { "month", 30 * day }, { "year", year } };
+    for (const auto &[name, length] : ranges)
+    {
+        vector<double> times;
+        long long total = 0;
+        size_t matched = 0;
+        for (int mode = 0; mode < 2; mode++)
+        {
+            start = chrono::steady_clock::now();
+            for (int query = 0; query < queries; query++)
+            {
+                int begin = length == year ? 0 : (int)(random() % (year - length));
+                Aggregate result;
+                if (mode == 0)
+                {
+                    // the packed rows are in time order, so only the range is unpacked
+                    size_t first = (size_t)((begin + interval - 1) / interval);
+                    for (size_t i = first; i < records.size(); i++)
+                    {
+                        BasicRecord record = BasicRecord::unpack(&rows[i * BasicRecord::packed_size]);
+                        if (record.timestamp >= begin + length)
+                        {
+                            break;
+                        }
+                        result.add(record.readings[5]);
+                    }
+                }
+                else
+                {
+                    result = segment.aggregate(5, begin, begin + length);
+                }
+                total += result.sum + result.min + result.max + (long long)result.avg();
+                matched = result.count;
+            }
+            times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS / queries);
+        }
+        cout << name << "\t" << matched << "\t" << times[0] << "\t" << times[1] << endl;
+    }
+}
+
+void sweep_batch()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    const size_t size = 1000000;
+#else
+    const size_t size = 100000;
+#endif
+    vector<size_t> batch_sizes = { 1, 10, 100, 1000, 10000 };
+    const size_t cache_blocks = 1024;
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+    vector<BasicRecord> records;
+    vector<string> keys;
+    mt19937 random(3);
+    for (size_t i = 0; i < size; i++)
+    {
+        records.push_back({ "k" + to_string(random() % (2 * size)), (int)i });
+        keys.push_back("k" + to_string(random() % (2 * size)));
+    }
+
+    // a batch size of 1 goes through add and get, the rest through add_batch and get_batch
+    cout << "BlockFileDb batches, " << size << " random adds and gets, " << cache_blocks << " cached blocks (times are in ms)" << endl;
+    cout << "batch\tadd\tadd_speedup\tadd_page_io\tget\tget_speedup\tget_page_io" << endl;
+    auto page_io = [](const BlockFileDb &db)
+    {
+        const PoolStats &blocks = db.block_stats(), &index = db.index_stats();
+        return blocks.misses + blocks.prefetches + blocks.write_backs + index.misses + index.write_backs;
+    };
+    double single_add = 0, single_get = 0;
+    for (auto batch_size : batch_sizes)
+    {
+        filesystem::remove_all(db_dir_path);
+        filesystem::create_directory(db_dir_path);
+        double add_time, get_time;
+        size_t add_io, get_io;
+        {
+            BlockFileOptions options;
+            options.cache_blocks = cache_blocks;
+            BlockFileDb db(db_dir_path, options);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < size; i += batch_size)
+            {
+                if (batch_size == 1)
+                {
+                    db.add(records[i]);
+                }
+                else
+                {
+                    db.add_batch(records.data() + i, min(batch_size, size - i));
+                }
+            }
+            db.flush();
+            add_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            add_io = page_io(db);
+        }
+        {
+            BlockFileOptions options;
+            options.cache_blocks = cache_blocks;
+            BlockFileDb db(db_dir_path, options);
+            vector<BasicRecord> result(batch_size);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < size; i += batch_size)
+            {
+                if (batch_size == 1)
+                {
+                    result[0] = db.get(keys[i]);
+                }
+                else
+                {
+                    db.get_batch(keys.data() + i, min(batch_size, size - i), result.data());
+                }
+            }
+            get_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            get_io = page_io(db);
+        }
+        if (batch_size == 1)
+        {
+            single_add = add_time;
+            single_get = get_time;
+        }
+        cout << batch_size << "\t" << add_time << "\t" << single_add / add_time << "\t" << add_io << "\t"
+            << get_time << "\t" << single_get / get_time << "\t" << get_io << endl;
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void sweep_record_format()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 10000, 100000, 1000000 };
+#else
+    vector<size_t> sizes = { 10000, 100000 };
+#endif
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+    mt19937 random(5);
+
+    cout << "BlockFileDb record formats, sensor readings (times are in ms)" << endl;
+    cout << "records\tfixed_bytes/rec\tslotted_bytes/rec\tfixed_add\tslotted_add\tfixed_scan\tslotted_scan" << endl;
+    for (auto size : sizes)
+    {
+        vector<BasicRecord> records;
+        for (size_t i = 0; i < size; i++)
+        {
+            BasicRecord record{ "sensor-" + to_string(i % 50) + "-" + to_string(i / 50), (int)(1700000000 + i * 60) };
+            for (int r = 0; r < 10; r++)
+            {
+                record.readings[r] = (int)(random() % 1000);
+            }
+            records.push_back(record);
+        }
+        vector<double> bytes, add_times, scan_times;
+        for (auto format : { RecordFormat::fixed, RecordFormat::slotted })
+        {
+            filesystem::remove_all(db_dir_path);
+            filesystem::create_directory(db_dir_path);
+            BlockFileOptions options;
+            options.format = format;
+            auto start = chrono::steady_clock::now();
+            {
+                BlockFileDb db(db_dir_path, options);
+                for (const auto &record : records)
+                {
+                    db.add(record);
+                }
+            }
+            add_times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+            size_t total = 0;
+            for (const auto &entry : filesystem::directory_iterator(db_dir_path))
+            {
+                if (entry.path().extension() == ".db" || entry.path().extension() == ".dict")
+                {
+                    total += (size_t)entry.file_size();
+                }
+            }
+            bytes.push_back((double)total / size);
+            BlockFileDb db(db_dir_path, options);
+            start = chrono::steady_clock::now();
+            size_t found = db.scan("", "").size();
+            scan_times.push_back((chrono::steady_clock::now() - start).count() * NANO_TO_MS);
+            assert(found == size);
+        }
+        cout << size << "\t" << bytes[0] << "\t" << bytes[1] << "\t" << add_times[0] << "\t" << add_times[1]
+            << "\t" << scan_times[0] << "\t" << scan_times[1] << endl;
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void sweep_bloom_misses()
+{
+#if 0
+    vector<size_t> sizes = { 10000, 100000, 1000000 };
+#else
+    vector<size_t> sizes = { 10000, 100000 };
+#endif
+    const size_t lookups = 100000;
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+    auto percentile = [](vector<double> &times, double fraction)
+    {
+        size_t position = (size_t)(fraction * (times.size() - 1));
+        nth_element(times.begin(), times.begin() + position, times.end());
+        return times[position];
+    };
+
+    // small caches so the index is mostly on disk, as it would be for a large database
+    cout << "BlockFileDb gets with 90% misses, " << lookups << " lookups (latencies are in us)" << endl;
+    cout << "records\tplain_p50\tplain_p99\tbloom_p50\tbloom_p99\tplain_index_reads\tbloom_index_reads" << endl;
+    for (auto size : sizes)
+    {
+        filesystem::remove_all(db_dir_path);
+        filesystem::create_directory(db_dir_path);
+        {
+            BlockFileOptions options;
+            options.cache_blocks = 4096;
+            BlockFileDb db(db_dir_path, options);
+            for (size_t i = 0; i < size; i++)
+            {
+                db.add({ "k" + to_string(i), (int)i });
+            }
+        }
+        vector<double> results;
+        vector<size_t> index_reads;
+        for (size_t bits : { 0, 10 })
+        {
+            BlockFileOptions options;
+            options.cache_blocks = 64;
+            options.cache_pages = 8;
+            options.bloom_bits_per_key = bits;
+            BlockFileDb db(db_dir_path, options);
+            mt19937 random(9);
+            vector<double> times;
+            times.reserve(lookups);
+            for (size_t i = 0; i < lookups; i++)
+            {
+                string key = "k" + to_string(random() % size);
+                if (i % 10 != 0)
+                {
+                    key += "x";
+                }
+                auto start = chrono::steady_clock::now();
+                db.get(key);
+                times.push_back((chrono::steady_clock::now() - start).count() / 1000.0);
+            }
+            results.push_back(percentile(times, 0.5));
+            results.push_back(percentile(times, 0.99));
+            index_reads.push_back(db.index_stats().misses);
+        }
+        cout << size << "\t" << results[0] << "\t" << results[1] << "\t" << results[2] << "\t" << results[3]
+            << "\t" << index_reads[0] << "\t" << index_reads[1] << endl;
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void sweep_secondary_index()
+{
+#if 0
+    vector<size_t> sizes = { 10000, 100000, 1000000 };
+#else
+    vector<size_t> sizes = { 10000, 100000 };
+#endif
+    const double NANO_TO_MS = 1e-6;
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+
+    // timestamps are a shuffle so a range is spread over the blocks, 1% of the records match
+    cout << "BlockFileDb timestamp range query for 1% of the records (times are in ms)" << endl;
+    cout << "records\tindexes\tadd_time\tscan_time\tscan_rows\tindex_time\tindex_rows\tspeedup" << endl;
+    for (auto size : sizes)
+    {
+        vector<int> timestamps(size);
+        iota(timestamps.begin(), timestamps.end(), 0);
+        shuffle(timestamps.begin(), timestamps.end(), mt19937(5));
+        for (bool indexed : { false, true })
+        {
+            filesystem::remove_all(db_dir_path);
+            filesystem::create_directory(db_dir_path);
+            BlockFileOptions options;
+            if (indexed)
+            {
+                options.indexes = { IndexSpec::timestamp(), IndexSpec::reading(0) };
+            }
+            BlockFileDb db(db_dir_path, options);
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < size; i++)
+            {
+                db.add({ "k" + to_string(i), timestamps[i] });
+            }
+            db.flush();
+            double add_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            int begin = (int)size / 2, end = begin + (int)size / 100;
+
+            start = chrono::steady_clock::now();
+            vector<BasicRecord> scanned;
+            size_t scan_rows = 0;
+            for (const auto &record : db.scan("", ""))
+            {
+                scan_rows++;
+                if (record.timestamp >= begin && record.timestamp < end)
+                {
+                    scanned.push_back(record);
+                }
+            }
+            double scan_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+
+            start = chrono::steady_clock::now();
+            QueryResult result = db.find_by_timestamp_range(begin, end);
+            double index_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+            assert(result.records.size() == scanned.size());
+            cout << size << "\t" << options.indexes.size() << "\t" << add_time << "\t" << scan_time << "\t" << scan_rows
+                << "\t" << index_time << "\t" << result.rows_examined << "\t" << scan_time / index_time << endl;
+        }
+    }
+    filesystem::remove_all(db_dir_path);
+}
+
+void sweep_block_verify()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    const size_t blocks = 100000;
+#else
+    const size_t blocks = 10000;
+#endif
+    string data(1 << 20, '\0');
+    mt19937 random(1);
+    generate(data.begin(), data.end(), [&]() { return (char)random(); });
+    uint32_t crc = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++)
+    {
+        crc += Crc32c::compute(data.data(), data.size());
+    }
+    double compute_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < 100; i++)
+    {
+        crc += Crc32c::software(data.data(), data.size());
+    }
+    double software_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+    cout << "CRC-32C of 100 MB (times are in ms)" << endl;
+    cout << "compute\tsoftware\tspeedup\t(" << crc << ")" << endl;
+    cout << compute_time << "\t" << software_time << "\t" << software_time / compute_time << endl;
+
+    filesystem::path db_dir_path = filesystem::temp_directory_path().append("sdbxdb_sweep");
+    filesystem::remove_all(db_dir_path);
+    filesystem::create_directory(db_dir_path);
+    BlockFileStore store(db_dir_path, BlockFileStore::SLOTTED_BLOCK_SIZE);
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < blocks; i++)
+    {
+        store.write_page(i, data.data() + i % 256 * BlockFileStore::SLOTTED_BLOCK_SIZE);
+    }
+    double write_time = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+    cout << "Verifying " << blocks << " 4 KB blocks, written in " << write_time << " ms (times are in ms)" << endl;
+    cout << "threads\tverify_time\tspeedup" << endl;
+    double single = 0;
+    for (size_t threads : { 1, 2, 4, 8 })
+    {
+        start = chrono::steady_clock::now();
+        assert(store.verify(threads).empty());
+        double elapsed = (chrono::steady_clock::now() - start).count() * NANO_TO_MS;
+        single = threads == 1 ? elapsed : single;
+        cout << threads << "\t" << elapsed << "\t" << single / elapsed << endl;
     }
-    
     filesystem::remove_all(db_dir_path);
 }
 
@@ -443,8 +7092,115 @@ void database_main()
     test_add_then_get();
     test_add_two_then_get_both();
     test_add_then_overwrite();
+    test_scan();
+    test_concurrent_memdb();
+    test_mvcc_memdb();
     test_filedb();
+    test_filedb_wal();
+    test_mappeddb();
     test_blockdb();
     test_blockfiledb();
+    test_buffer_pool();
+    test_bplustree();
+    test_bloom_filter();
+    test_lsmdb();
+    test_column_segment();
+    test_batches();
+    test_slotted_page();
+    test_var_record();
+    test_blockfiledb_slotted();
+    test_blockfiledb_bloom();
+    test_blockfiledb_indexes();
+    test_block_checksums();
+    test_benchmark_tools();
     cout << "All tests passed" << endl;
-}
\ No newline at end of file
+    //sweep_filedb();
+    //sweep_mappeddb();
+    //sweep_bptree();
+    //sweep_block_cache();
+    //sweep_lsmdb();
+    //sweep_concurrent_memdb();
+    //sweep_mvcc_memdb();
+    //sweep_column_segment();
+    //sweep_batch();
+    //sweep_record_format();
+    //sweep_bloom_misses();
+    //sweep_secondary_index();
+    //sweep_block_verify();
+}
+
+// Every store under YCSB-like workloads: A is half reads, B mostly reads over
+// zipfian keys, and a sequential write load. Prints a table and writes the
+// results to database_benchmark.json for comparing runs over time.
+void database_benchmark_main()
+{
+#if 0
+    const size_t records = 1000000, operations = 1000000;
+#else
+    const size_t records = 20000, operations = 100000;
+#endif
+    struct Workload
+    {
+        const char *name;
+        int read_percent;
+        KeyDistribution distribution;
+    };
+    vector<Workload> workloads = {
+        { "A", 50, KeyDistribution::zipfian },
+        { "B", 95, KeyDistribution::zipfian },
+        { "C", 100, KeyDistribution::uniform },
+        { "load", 0, KeyDistribution::sequential },
+    };
+    filesystem::path db_path = filesystem::temp_directory_path().append("sdbxdb_benchmark");
+    // a new store for each run, and whether it takes concurrent calls
+    auto open_store = [&](const string &name) -> pair<unique_ptr<Database>, bool>
+    {
+        filesystem::remove_all(db_path);
+        filesystem::create_directory(db_path);
+        if (name == "MemDb") return { make_unique<MemDb>(), false };
+        if (name == "FileDb") return { make_unique<FileDb>(db_path / "records.db"), false };
+        if (name == "BlockDb") return { make_unique<BlockDb>(), false };
+        if (name == "BlockFileDb") return { make_unique<BlockFileDb>(db_path), false };
+        if (name == "LsmDb") return { make_unique<LsmDb>(db_path), true };
+        if (name == "ConcurrentMemDb") return { make_unique<ConcurrentMemDb>(), true };
+        return { make_unique<MvccMemDb>(), true };
+    };
+
+    json results = json::array();
+    cout << "Database benchmark, " << records << " records, " << operations << " operations (latencies are in us)" << endl;
+    cout << "store\tworkload\tthreads\tkops_per_sec\tread_p50\tread_p99\twrite_p50\twrite_p99" << endl;
+    for (string store : { "MemDb", "FileDb", "BlockDb", "BlockFileDb", "LsmDb", "ConcurrentMemDb", "MvccMemDb" })
+    {
+        for (const auto &workload : workloads)
+        {
+            for (size_t threads : { 1, 4 })
+            {
+                BenchmarkConfig config;
+                config.store = store;
+                config.records = records;
+                config.operations = operations;
+                config.threads = threads;
+                config.read_percent = workload.read_percent;
+                config.distribution = workload.distribution;
+                BenchmarkResult result;
+                {
+                    auto [db, thread_safe] = open_store(store);
+                    result = run_benchmark(*db, config, thread_safe);
+                }
+                json entry = result.to_json();
+                entry["workload"] = workload.name;
+                results.push_back(entry);
+                cout << store << "\t" << workload.name << "\t" << threads << "\t" << result.ops_per_second() / 1000
+                    << "\t" << result.reads.percentile(50) / 1000.0 << "\t" << result.reads.percentile(99) / 1000.0
+                    << "\t" << result.writes.percentile(50) / 1000.0 << "\t" << result.writes.percentile(99) / 1000.0 << endl;
+            }
+        }
+    }
+    filesystem::remove_all(db_path);
+
+    json report{ { "hardware_threads", thread::hardware_concurrency() },
+        { "time", (long long)chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count() },
+        { "results", results } };
+    ofstream("database_benchmark.json") << report.dump(2) << endl;
+    cout << "Wrote database_benchmark.json" << endl;
+}
@@ -3,37 +3,71 @@
 // https://third-bit.com/sdxpy/archive/
 
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <stdexcept>
 #include <vector>
 #include <set>
 #include <map>
+#include <array>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
 
 // requires: /std:c++17
 #include <filesystem>
 
+#include "FileUtils.h"
+#include "MappedFile.h"
+
+// LZ4 and Zstandard installed with vcpkg, see README.md
+#include <lz4.h>
+#include <zstd.h>
+
 using namespace std;
 
 // from FindDuplicateFiles.cpp
 string sha_hash(const string &);
 
+// How a blob is stored in the archive, picked per file (see choose_codec).
+enum class Codec : uint8_t
+{
+    none = 0,
+    lz4 = 1,
+    zstd = 2,
+};
+
+const size_t NUM_CODECS = 3;
+
 struct file_hash
 {
     string filename;
     string hash;
+    Codec codec = Codec::none;
 };
 
+// Filenames are kept relative to root, root itself is always passed explicitly
+// because the current directory is shared by every thread in the process.
 void hash_all(vector<file_hash> &result, const string &root)
 {
-    filesystem::current_path(root);
-    for (const auto &file : filesystem::recursive_directory_iterator(""))
+    for (const auto &file : filesystem::recursive_directory_iterator(root))
     {
         if (file.is_regular_file())
         {
-            string filename = file.path().string();
-            string hash = sha_hash(filename.c_str());
+            string filename = file.path().lexically_relative(root).string();
+            string hash = sha_hash(file.path().string());
             result.push_back({ filename, hash });
         }
     }
@@ -50,51 +84,529 @@ string current_timestamp()
     return result;
 }
 
-void write_manifest(const string &target, vector<file_hash> &manifest, string &manifest_filename)
+// Quotes a CSV field only when it has to, so ordinary manifests stay readable.
+string csv_field(const string &text)
 {
-    if (!filesystem::exists(target))
+    if (text.find_first_of(",\"\r\n") == string::npos)
     {
-        filesystem::create_directory(target);
+        return text;
+    }
+    string result = "\"";
+    for (char c : text)
+    {
+        if (c == '"')
+        {
+            result += '"';
+        }
+        result += c;
+    }
+    result += '"';
+    return result;
+}
+
+// Reads one CSV record, quoted fields may contain commas, quotes and newlines.
+bool read_csv_record(istream &in, vector<string> &fields)
+{
+    fields.clear();
+    if (in.peek() == EOF)
+    {
+        return false;
+    }
+    string field;
+    bool quoted = false;
+    int c;
+    while ((c = in.get()) != EOF)
+    {
+        if (quoted)
+        {
+            if (c == '"' && in.peek() == '"')
+            {
+                field += (char)in.get();
+            }
+            else if (c == '"')
+            {
+                quoted = false;
+            }
+            else
+            {
+                field += (char)c;
+            }
+        }
+        else if (c == '"')
+        {
+            quoted = true;
+        }
+        else if (c == ',')
+        {
+            fields.push_back(field);
+            field.clear();
+        }
+        else if (c == '\n')
+        {
+            break;
+        }
+        else if (c != '\r')
+        {
+            field += (char)c;
+        }
+    }
+    fields.push_back(field);
+    return true;
+}
+
+const char *codec_name(Codec codec)
+{
+    switch (codec)
+    {
+        case Codec::lz4: return "lz4";
+        case Codec::zstd: return "zstd";
+        default: return "none";
     }
-    manifest_filename = target + '\\' + current_timestamp() + ".csv";
-    ofstream out(manifest_filename);
-    out << "filename,hash" << endl;
+}
+
+Codec codec_from_name(const string &name)
+{
+    if (name == "lz4") return Codec::lz4;
+    if (name == "zstd") return Codec::zstd;
+    return Codec::none;
+}
+
+void write_csv_manifest(const filesystem::path &file_path, const vector<file_hash> &manifest)
+{
+    ofstream out(file_path, ios_base::binary);
+    out << "filename,hash,codec\n";
     for (const auto &fh : manifest)
     {
-        out << fh.filename << "," << fh.hash << endl;
+        out << csv_field(fh.filename) << "," << csv_field(fh.hash) << "," << codec_name(fh.codec) << "\n";
     }
     out.close();
 }
 
+void write_manifest(const string &target, vector<file_hash> &manifest, string &manifest_filename)
+{
+    if (!filesystem::exists(target))
+    {
+        filesystem::create_directory(target);
+    }
+    manifest_filename = (filesystem::path(target) / (current_timestamp() + ".csv")).string();
+    write_csv_manifest(manifest_filename, manifest);
+}
+
 void read_manifest(vector<file_hash> &manifest, const string &manifest_filepath)
 {
-    ifstream in(manifest_filepath);
+    ifstream in(manifest_filepath, ios_base::binary);
     if (in.is_open())
     {
-        string line;
-        in >> line;
-        assert(line == "filename,hash");
-        while (true)
+        // older manifests have no codec column
+        vector<string> fields;
+        read_csv_record(in, fields);
+        assert(fields.size() >= 2 && fields[0] == "filename" && fields[1] == "hash");
+        while (read_csv_record(in, fields))
         {
-            in >> line;
-            if (in.eof())
+            if (fields.size() == 2)
             {
-                break;
+                manifest.push_back({ fields[0], fields[1] });
+            }
+            else if (fields.size() == 3)
+            {
+                manifest.push_back({ fields[0], fields[1], codec_from_name(fields[2]) });
             }
-            string filename = line.substr(0, line.find(","));
-            string hash = line.substr(line.find(",") + 1);
-            manifest.push_back({ filename, hash });
         }
         in.close();
     }
 }
 
+// Binary manifest, all integers little-endian, offsets from the start of the file:
+//
+//   header   "SDXMFT02", count, restart_interval, paths_offset, index_offset, digests_offset
+//   paths    sorted by filename, each entry is varint shared, varint suffix_len, suffix bytes,
+//            front-coded against the previous entry except every restart_interval-th
+//            entry (a restart point) which has shared == 0 and stores the full name
+//   index    one uint64 file offset per restart point
+//   digests  count * 32 bytes of raw SHA-256, in path order
+//   codecs   count bytes, the Codec each blob is stored with (not in "SDXMFT01" files)
+//
+// Lookups binary search the restart points and scan at most restart_interval entries.
+const char BINARY_MANIFEST_MAGIC[8] = { 'S', 'D', 'X', 'M', 'F', 'T', '0', '2' };
+const char BINARY_MANIFEST_MAGIC_V1[8] = { 'S', 'D', 'X', 'M', 'F', 'T', '0', '1' };
+const size_t DIGEST_SIZE = 32;
+
+class ManifestFormatError : public runtime_error
+{
+public:
+    ManifestFormatError(const string &what) : runtime_error(what) {}
+};
+
+struct BinaryManifestHeader
+{
+    char magic[8];
+    uint64_t count;
+    uint64_t restart_interval;
+    uint64_t paths_offset;
+    uint64_t index_offset;
+    uint64_t digests_offset;
+};
+
+void put_varint(string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out += (char)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+uint64_t get_varint(const char *&cursor, const char *end)
+{
+    uint64_t result = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7)
+    {
+        uint8_t byte = (uint8_t)*cursor++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return result;
+        }
+    }
+    throw ManifestFormatError("truncated varint");
+}
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void hex_to_digest(const string &hash, unsigned char *digest)
+{
+    if (hash.length() != DIGEST_SIZE * 2)
+    {
+        throw ManifestFormatError("not a SHA-256 digest: " + hash);
+    }
+    for (size_t i = 0; i < DIGEST_SIZE; i++)
+    {
+        int high = hex_value(hash[2 * i]), low = hex_value(hash[2 * i + 1]);
+        if (high < 0 || low < 0)
+        {
+            throw ManifestFormatError("not a SHA-256 digest: " + hash);
+        }
+        digest[i] = (unsigned char)(high << 4 | low);
+    }
+}
+
+string digest_to_hex(const unsigned char *digest)
+{
+    const char *digits = "0123456789abcdef";
+    string result(DIGEST_SIZE * 2, '0');
+    for (size_t i = 0; i < DIGEST_SIZE; i++)
+    {
+        result[2 * i] = digits[digest[i] >> 4];
+        result[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    return result;
+}
+
+void save_binary_manifest(const filesystem::path &file_path, vector<file_hash> manifest, size_t restart_interval = 16)
+{
+    sort(manifest.begin(), manifest.end(), [](const file_hash &left, const file_hash &right)
+    {
+        return left.filename < right.filename;
+    });
+
+    string paths;
+    vector<uint64_t> index;
+    string digests(manifest.size() * DIGEST_SIZE, '\0');
+    string codecs(manifest.size(), '\0');
+    uint64_t paths_offset = sizeof(BinaryManifestHeader);
+    const string *previous = nullptr;
+    for (size_t i = 0; i < manifest.size(); i++)
+    {
+        const string &filename = manifest[i].filename;
+        if (previous && *previous == filename)
+        {
+            throw ManifestFormatError("duplicate filename: " + filename);
+        }
+        size_t shared = 0;
+        if (i % restart_interval == 0)
+        {
+            index.push_back(paths_offset + paths.size());
+        }
+        else
+        {
+            size_t limit = min(previous->length(), filename.length());
+            while (shared < limit && (*previous)[shared] == filename[shared])
+            {
+                shared++;
+            }
+        }
+        put_varint(paths, shared);
+        put_varint(paths, filename.length() - shared);
+        paths.append(filename, shared, string::npos);
+        hex_to_digest(manifest[i].hash, (unsigned char *)&digests[i * DIGEST_SIZE]);
+        codecs[i] = (char)manifest[i].codec;
+        previous = &filename;
+    }
+
+    BinaryManifestHeader header;
+    memcpy(header.magic, BINARY_MANIFEST_MAGIC, sizeof(header.magic));
+    header.count = manifest.size();
+    header.restart_interval = restart_interval;
+    header.paths_offset = paths_offset;
+    // keep the index 8-byte aligned so it can be read straight from the mapping
+    size_t padding = (8 - (paths_offset + paths.size()) % 8) % 8;
+    header.index_offset = paths_offset + paths.size() + padding;
+    header.digests_offset = header.index_offset + index.size() * sizeof(uint64_t);
+
+    ofstream out(file_path, ios_base::binary);
+    out.write((const char *)&header, sizeof(header));
+    out.write(paths.data(), paths.size());
+    out.write("\0\0\0\0\0\0\0", padding);
+    out.write((const char *)index.data(), index.size() * sizeof(uint64_t));
+    out.write(digests.data(), digests.size());
+    out.write(codecs.data(), codecs.size());
+    out.close();
+    if (!out)
+    {
+        throw runtime_error("can't write " + file_path.string());
+    }
+}
+
+void write_binary_manifest(const string &target, const vector<file_hash> &manifest, string &manifest_filename)
+{
+    if (!filesystem::exists(target))
+    {
+        filesystem::create_directory(target);
+    }
+    manifest_filename = (filesystem::path(target) / (current_timestamp() + ".mft")).string();
+    save_binary_manifest(manifest_filename, manifest);
+}
+
+// Memory-mapped, read-only view of a binary manifest. Filenames and digests are
+// returned as views into the mapping; only front-coded names are rebuilt.
+class BinaryManifest
+{
+    MappedFile file;
+    BinaryManifestHeader header = {};
+    const char *paths_end = nullptr;
+    const unsigned char *digests = nullptr;
+    const unsigned char *codecs = nullptr;
+
+public:
+    // Walks the entries in filename order.
+    class Cursor
+    {
+        const BinaryManifest *manifest;
+        const char *next_entry;
+        size_t position = 0;
+        string current;
+
+    public:
+        Cursor(const BinaryManifest *manifest, size_t restart = 0)
+            : manifest(manifest), position(restart * manifest->header.restart_interval)
+        {
+            next_entry = manifest->header.count ? manifest->file.data() + manifest->restart_offset(restart) : nullptr;
+        }
+
+        // Moves to the next entry, the first call moves to the first entry.
+        bool next()
+        {
+            if (next_entry == nullptr || position >= manifest->header.count)
+            {
+                next_entry = nullptr;
+                return false;
+            }
+            uint64_t shared = get_varint(next_entry, manifest->paths_end);
+            uint64_t suffix = get_varint(next_entry, manifest->paths_end);
+            if (shared > current.length() || suffix > (uint64_t)(manifest->paths_end - next_entry))
+            {
+                throw ManifestFormatError("corrupt path table");
+            }
+            current.resize(shared);
+            current.append(next_entry, suffix);
+            next_entry += suffix;
+            position++;
+            return true;
+        }
+
+        const string &filename() const { return current; }
+        const unsigned char *digest() const { return manifest->digest_at(index()); }
+        string hash() const { return digest_to_hex(digest()); }
+        Codec codec() const { return manifest->codec_at(index()); }
+        size_t index() const { return position - 1; }
+    };
+
+    BinaryManifest(const filesystem::path &file_path) : file(file_path)
+    {
+        if (file.size() < sizeof(header))
+        {
+            throw ManifestFormatError("manifest too small: " + file_path.string());
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        bool has_codecs = memcmp(header.magic, BINARY_MANIFEST_MAGIC, sizeof(header.magic)) == 0;
+        if (!has_codecs && memcmp(header.magic, BINARY_MANIFEST_MAGIC_V1, sizeof(header.magic)) != 0)
+        {
+            throw ManifestFormatError("not a binary manifest: " + file_path.string());
+        }
+        uint64_t restarts = num_restarts();
+        if (header.restart_interval == 0
+            || header.paths_offset > header.index_offset
+            || header.index_offset + restarts * sizeof(uint64_t) > header.digests_offset
+            || header.digests_offset + header.count * (DIGEST_SIZE + (has_codecs ? 1 : 0)) > file.size())
+        {
+            throw ManifestFormatError("corrupt manifest header: " + file_path.string());
+        }
+        paths_end = file.data() + header.index_offset;
+        digests = (const unsigned char *)file.data() + header.digests_offset;
+        if (has_codecs)
+        {
+            codecs = digests + header.count * DIGEST_SIZE;
+        }
+    }
+
+    size_t size() const
+    {
+        return (size_t)header.count;
+    }
+
+    Cursor begin() const
+    {
+        return Cursor(this);
+    }
+
+    const unsigned char *digest_at(size_t i) const
+    {
+        return digests + i * DIGEST_SIZE;
+    }
+
+    Codec codec_at(size_t i) const
+    {
+        return codecs && codecs[i] < NUM_CODECS ? (Codec)codecs[i] : Codec::none;
+    }
+
+    string_view digest_key(size_t i) const
+    {
+        return string_view((const char *)digest_at(i), DIGEST_SIZE);
+    }
+
+    string filename_at(size_t i) const
+    {
+        Cursor cursor(this, i / header.restart_interval);
+        for (size_t skip = i % header.restart_interval; skip > 0; skip--)
+        {
+            cursor.next();
+        }
+        cursor.next();
+        return cursor.filename();
+    }
+
+    // Returns the raw digest stored for filename, or nullptr if it isn't there.
+    const unsigned char *find(const string &filename) const
+    {
+        if (header.count == 0)
+        {
+            return nullptr;
+        }
+        // last restart point whose (full) name is <= filename
+        size_t low = 0, high = num_restarts();
+        while (high - low > 1)
+        {
+            size_t mid = (low + high) / 2;
+            if (restart_name(mid) <= filename)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        Cursor cursor(this, low);
+        for (size_t i = 0; i < header.restart_interval && cursor.next(); i++)
+        {
+            int order = cursor.filename().compare(filename);
+            if (order == 0)
+            {
+                return cursor.digest();
+            }
+            if (order > 0)
+            {
+                break;
+            }
+        }
+        return nullptr;
+    }
+
+    bool find(const string &filename, string &hash) const
+    {
+        const unsigned char *digest = find(filename);
+        if (digest)
+        {
+            hash = digest_to_hex(digest);
+        }
+        return digest != nullptr;
+    }
+
+    void read(vector<file_hash> &manifest) const
+    {
+        manifest.reserve(manifest.size() + size());
+        Cursor cursor = begin();
+        while (cursor.next())
+        {
+            manifest.push_back({ cursor.filename(), cursor.hash(), cursor.codec() });
+        }
+    }
+
+    void export_csv(const filesystem::path &file_path) const
+    {
+        ofstream out(file_path, ios_base::binary);
+        out << "filename,hash,codec\n";
+        Cursor cursor = begin();
+        while (cursor.next())
+        {
+            out << csv_field(cursor.filename()) << "," << cursor.hash() << "," << codec_name(cursor.codec()) << "\n";
+        }
+    }
+
+private:
+    size_t num_restarts() const
+    {
+        return header.restart_interval ? (size_t)((header.count + header.restart_interval - 1) / header.restart_interval) : 0;
+    }
+
+    uint64_t restart_offset(size_t restart) const
+    {
+        uint64_t offset;
+        memcpy(&offset, file.data() + header.index_offset + restart * sizeof(uint64_t), sizeof(offset));
+        if (offset < header.paths_offset || offset >= header.index_offset)
+        {
+            throw ManifestFormatError("corrupt manifest index");
+        }
+        return offset;
+    }
+
+    // Restart points are stored in full, so their names are read in place.
+    string_view restart_name(size_t restart) const
+    {
+        const char *cursor = file.data() + restart_offset(restart);
+        get_varint(cursor, paths_end);
+        uint64_t length = get_varint(cursor, paths_end);
+        if (length > (uint64_t)(paths_end - cursor))
+        {
+            throw ManifestFormatError("corrupt path table");
+        }
+        return string_view(cursor, (size_t)length);
+    }
+};
+
 void copy_files(const string &source, const string &target, vector<file_hash> &manifest)
 {
     for (const auto &fh : manifest)
     {
-        string source_path = source + '\\' + fh.filename;
-        string target_path = target + '\\' + fh.hash + ".bck";
+        filesystem::path source_path = filesystem::path(source) / fh.filename;
+        filesystem::path target_path = filesystem::path(target) / (fh.hash + ".bck");
         if (!filesystem::exists(target_path))
         {
             filesystem::copy_file(source_path, target_path);
@@ -102,52 +614,1273 @@ void copy_files(const string &source, const string &target, vector<file_hash> &m
     }
 }
 
-void compare_manifest(const vector<file_hash> &left, const vector<file_hash> &right, vector<string> &changelog)
+// When several files share contents, a rename goes to the first of them by
+// filename, whatever order the manifest lists them in.
+void compare_manifest(const vector<file_hash> &left, const vector<file_hash> &right, vector<string> &changelog)
+{
+    map<string, string> left_file2hash, left_hash2file, right_file2hash, right_hash2file;
+    auto keep_first = [](map<string, string> &hash2file, const file_hash &fh)
+    {
+        auto found = hash2file.emplace(fh.hash, fh.filename).first;
+        found->second = min(found->second, fh.filename);
+    };
+
+    for (const auto &left_fh : left)
+    {
+        left_file2hash[left_fh.filename] = left_fh.hash;
+        keep_first(left_hash2file, left_fh);
+    }
+
+    for (const auto &right_fh : right)
+    {
+        right_file2hash[right_fh.filename] = right_fh.hash;
+        keep_first(right_hash2file, right_fh);
+    }
+
+    for (const auto &left_fh : left)
+    {
+        if (right_file2hash.count(left_fh.filename) == 0 && right_hash2file.count(left_fh.hash) == 0)
+        {
+            changelog.push_back(left_fh.filename + " deleted");
+        }
+        else if (right_file2hash.count(left_fh.filename) && right_file2hash[left_fh.filename] != left_fh.hash)
+        {
+            changelog.push_back(left_fh.filename + " updated");
+        }
+        else if (right_file2hash.count(left_fh.filename) == 0 && right_hash2file.count(left_fh.hash))
+        {
+            changelog.push_back(left_fh.filename + " renamed to " + right_hash2file[left_fh.hash]);
+        }
+    }
+
+    for (const auto &right_fh : right)
+    {
+        if (left_file2hash.count(right_fh.filename) == 0 && left_hash2file.count(right_fh.hash) == 0)
+        {
+            changelog.push_back(right_fh.filename + " added");
+        }
+    }
+}
+
+// Adapts an in-memory manifest to the interface diff_manifests shares with
+// BinaryManifest: entries sorted by filename, digests compared as raw bytes.
+class SortedManifest
+{
+    vector<file_hash> entries;
+
+public:
+    class Cursor
+    {
+        const vector<file_hash> *entries;
+        size_t position = 0;
+
+    public:
+        Cursor(const vector<file_hash> *entries) : entries(entries) {}
+
+        bool next()
+        {
+            if (position >= entries->size())
+            {
+                return false;
+            }
+            position++;
+            return true;
+        }
+
+        const string &filename() const { return (*entries)[position - 1].filename; }
+        size_t index() const { return position - 1; }
+    };
+
+    SortedManifest(vector<file_hash> manifest) : entries(move(manifest))
+    {
+        sort(entries.begin(), entries.end(), [](const file_hash &left, const file_hash &right)
+        {
+            return left.filename < right.filename;
+        });
+    }
+
+    size_t size() const { return entries.size(); }
+    Cursor begin() const { return Cursor(&entries); }
+    string_view digest_key(size_t i) const { return entries[i].hash; }
+    const string &filename_at(size_t i) const { return entries[i].filename; }
+};
+
+// Open-addressing digest -> entry position table, the only random-access
+// structure the diff needs. When several files share a digest the first one
+// wins, which for a manifest sorted by filename is compare_manifest's rule.
+template <typename Manifest>
+class DigestIndex
+{
+    const Manifest &manifest;
+    vector<uint32_t> slots;
+    size_t mask = 0;
+
+public:
+    constexpr static uint32_t npos = UINT32_MAX;
+
+    DigestIndex(const Manifest &manifest) : manifest(manifest)
+    {
+        if (manifest.size() >= npos)
+        {
+            throw length_error("manifest too large for DigestIndex");
+        }
+        size_t capacity = 16;
+        while (capacity < manifest.size() * 2)
+        {
+            capacity *= 2;
+        }
+        slots.assign(capacity, npos);
+        mask = capacity - 1;
+        for (size_t i = 0; i < manifest.size(); i++)
+        {
+            string_view digest = manifest.digest_key(i);
+            size_t slot = hash<string_view>()(digest) & mask;
+            while (slots[slot] != npos && manifest.digest_key(slots[slot]) != digest)
+            {
+                slot = (slot + 1) & mask;
+            }
+            if (slots[slot] == npos)
+            {
+                slots[slot] = (uint32_t)i;
+            }
+        }
+    }
+
+    uint32_t find(string_view digest) const
+    {
+        size_t slot = hash<string_view>()(digest) & mask;
+        while (slots[slot] != npos)
+        {
+            if (manifest.digest_key(slots[slot]) == digest)
+            {
+                return slots[slot];
+            }
+            slot = (slot + 1) & mask;
+        }
+        return npos;
+    }
+};
+
+enum class ChangeKind
+{
+    added,
+    deleted,
+    updated,
+    renamed,
+};
+
+struct ManifestChange
+{
+    ChangeKind kind;
+    string filename;
+    string new_filename;     // only for renamed
+
+    // Same wording as compare_manifest.
+    string describe() const
+    {
+        switch (kind)
+        {
+            case ChangeKind::added: return filename + " added";
+            case ChangeKind::deleted: return filename + " deleted";
+            case ChangeKind::updated: return filename + " updated";
+            case ChangeKind::renamed: return filename + " renamed to " + new_filename;
+        }
+        return filename;
+    }
+};
+
+// Same rules as compare_manifest, but a single merge over two manifests sorted
+// by filename. Each side gets a digest index for rename detection; changes are
+// passed to emit as soon as they are found, in filename order. Returns the
+// number of changes.
+template <typename Left, typename Right, typename Emit>
+size_t diff_manifests(const Left &left, const Right &right, Emit emit)
+{
+    DigestIndex<Left> left_digests(left);
+    DigestIndex<Right> right_digests(right);
+    size_t changes = 0;
+
+    auto left_cursor = left.begin();
+    auto right_cursor = right.begin();
+    bool has_left = left_cursor.next();
+    bool has_right = right_cursor.next();
+    while (has_left || has_right)
+    {
+        int order = !has_left ? 1 : !has_right ? -1 : left_cursor.filename().compare(right_cursor.filename());
+        if (order < 0)
+        {
+            uint32_t moved = right_digests.find(left.digest_key(left_cursor.index()));
+            if (moved == DigestIndex<Right>::npos)
+            {
+                emit(ManifestChange{ ChangeKind::deleted, left_cursor.filename(), string() });
+            }
+            else
+            {
+                emit(ManifestChange{ ChangeKind::renamed, left_cursor.filename(), string(right.filename_at(moved)) });
+            }
+            changes++;
+            has_left = left_cursor.next();
+        }
+        else if (order > 0)
+        {
+            if (left_digests.find(right.digest_key(right_cursor.index())) == DigestIndex<Left>::npos)
+            {
+                emit(ManifestChange{ ChangeKind::added, right_cursor.filename(), string() });
+                changes++;
+            }
+            has_right = right_cursor.next();
+        }
+        else
+        {
+            if (left.digest_key(left_cursor.index()) != right.digest_key(right_cursor.index()))
+            {
+                emit(ManifestChange{ ChangeKind::updated, left_cursor.filename(), string() });
+                changes++;
+            }
+            has_left = left_cursor.next();
+            has_right = right_cursor.next();
+        }
+    }
+    return changes;
+}
+
+// Blocking FIFO with a fixed capacity, so a fast stage can't run arbitrarily
+// far ahead of a slow one. Depth is sampled on every push for reporting.
+// Cancelling wakes every waiter on both ends, so a stage that failed doesn't
+// leave the ones around it blocked.
+template <typename T>
+class BoundedQueue
+{
+    mutex lock;
+    condition_variable not_empty, not_full;
+    deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    bool cancelled = false;
+    size_t depth_max = 0;
+    size_t depth_total = 0;
+    size_t depth_samples = 0;
+
+public:
+    BoundedQueue(size_t capacity) : capacity(max<size_t>(capacity, 1)) {}
+
+    // Returns false once the queue is cancelled.
+    bool push(T item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_full.wait(guard, [this] { return items.size() < capacity || cancelled; });
+        if (cancelled)
+        {
+            return false;
+        }
+        items.push_back(move(item));
+        depth_max = max(depth_max, items.size());
+        depth_total += items.size();
+        depth_samples++;
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and drained, or cancelled.
+    bool pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        not_empty.wait(guard, [this] { return !items.empty() || closed || cancelled; });
+        if (items.empty() || cancelled)
+        {
+            return false;
+        }
+        item = move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    void cancel()
+    {
+        lock_guard<mutex> guard(lock);
+        cancelled = true;
+        items.clear();
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    size_t max_depth()
+    {
+        lock_guard<mutex> guard(lock);
+        return depth_max;
+    }
+
+    double average_depth()
+    {
+        lock_guard<mutex> guard(lock);
+        return depth_samples ? (double)depth_total / depth_samples : 0.0;
+    }
+};
+
+// Compressed blobs: "SDXZ", codec byte, uint64 original size, then frames of
+// uint32 raw size, uint32 stored size and the stored bytes. Each frame holds up
+// to COMPRESSION_FRAME bytes of input so files are compressed as a stream; a
+// frame that doesn't shrink is kept raw (stored size == raw size). Uncompressed
+// blobs are plain copies, as before.
+const char COMPRESSED_BLOB_MAGIC[4] = { 'S', 'D', 'X', 'Z' };
+const size_t COMPRESSED_BLOB_HEADER = sizeof(COMPRESSED_BLOB_MAGIC) + 1 + sizeof(uint64_t);
+const size_t COMPRESSION_FRAME = 1024 * 1024;
+
+struct CompressionOptions
+{
+    bool enabled = true;
+    double store_above = 7.5;       // bits per byte, already compressed media
+    double zstd_below = 6.0;        // compresses well enough to pay for zstd
+    int zstd_level = 9;
+    size_t sample_size = 64 * 1024;
+    uintmax_t min_size = 512;       // smaller files aren't worth a header
+};
+
+const char *codec_extension(Codec codec)
+{
+    switch (codec)
+    {
+        case Codec::lz4: return ".lz4";
+        case Codec::zstd: return ".zst";
+        default: return ".bck";
+    }
+}
+
+filesystem::path blob_path(const filesystem::path &archive, const string &hash, Codec codec)
+{
+    return archive / (hash + codec_extension(codec));
+}
+
+// Shannon entropy in bits per byte of a few slices spread over the file.
+double sample_entropy(const filesystem::path &file_path, uintmax_t size, size_t sample_size)
+{
+    const size_t slices = 4;
+    size_t slice = max<size_t>(sample_size / slices, 1);
+    vector<char> buffer(slice);
+    size_t histogram[256] = {};
+    size_t total = 0;
+    ifstream in(file_path, ios_base::binary);
+    for (size_t i = 0; i < slices && in; i++)
+    {
+        uintmax_t offset = size > slice ? (size - slice) * i / (slices - 1) : 0;
+        in.seekg((streamoff)offset);
+        in.read(buffer.data(), slice);
+        for (streamsize j = 0; j < in.gcount(); j++)
+        {
+            histogram[(unsigned char)buffer[j]]++;
+        }
+        total += (size_t)in.gcount();
+        if (size <= slice)
+        {
+            break;
+        }
+    }
+    double entropy = 0;
+    for (size_t count : histogram)
+    {
+        if (count)
+        {
+            double p = (double)count / total;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+Codec choose_codec(const filesystem::path &file_path, uintmax_t size, const CompressionOptions &options)
+{
+    if (!options.enabled || size < options.min_size)
+    {
+        return Codec::none;
+    }
+    double entropy = sample_entropy(file_path, size, options.sample_size);
+    if (entropy >= options.store_above)
+    {
+        return Codec::none;
+    }
+    return entropy < options.zstd_below ? Codec::zstd : Codec::lz4;
+}
+
+// Compresses source into target with codec, returns the size of target.
+uintmax_t compress_file(const filesystem::path &source, const filesystem::path &target, Codec codec, int zstd_level)
+{
+    ifstream in(source, ios_base::binary);
+    ofstream out(target, ios_base::binary);
+    if (!in.is_open() || !out.is_open())
+    {
+        throw runtime_error("can't compress " + source.string());
+    }
+    uint64_t raw_size = filesystem::file_size(source);
+    out.write(COMPRESSED_BLOB_MAGIC, sizeof(COMPRESSED_BLOB_MAGIC));
+    out.put((char)codec);
+    out.write((const char *)&raw_size, sizeof(raw_size));
+    uintmax_t written = COMPRESSED_BLOB_HEADER;
+
+    vector<char> raw(COMPRESSION_FRAME);
+    vector<char> packed(max<size_t>(LZ4_compressBound((int)COMPRESSION_FRAME), ZSTD_compressBound(COMPRESSION_FRAME)));
+    while (in.read(raw.data(), raw.size()) || in.gcount() > 0)
+    {
+        uint32_t raw_length = (uint32_t)in.gcount();
+        size_t stored_length;
+        if (codec == Codec::lz4)
+        {
+            int result = LZ4_compress_default(raw.data(), packed.data(), (int)raw_length, (int)packed.size());
+            stored_length = result > 0 ? (size_t)result : raw_length;
+        }
+        else
+        {
+            size_t result = ZSTD_compress(packed.data(), packed.size(), raw.data(), raw_length, zstd_level);
+            stored_length = ZSTD_isError(result) ? raw_length : result;
+        }
+        const char *stored = packed.data();
+        if (stored_length >= raw_length)
+        {
+            stored_length = raw_length;
+            stored = raw.data();
+        }
+        uint32_t frame[2] = { raw_length, (uint32_t)stored_length };
+        out.write((const char *)frame, sizeof(frame));
+        out.write(stored, stored_length);
+        written += sizeof(frame) + stored_length;
+    }
+    out.close();
+    if (!out)
+    {
+        throw runtime_error("can't write " + target.string());
+    }
+    return written;
+}
+
+// Original size of a blob, without decompressing it.
+uintmax_t blob_raw_size(const filesystem::path &blob, Codec codec)
+{
+    if (codec == Codec::none)
+    {
+        return filesystem::file_size(blob);
+    }
+    ifstream in(blob, ios_base::binary);
+    char header[COMPRESSED_BLOB_HEADER];
+    uint64_t raw_size;
+    if (!in.read(header, sizeof(header)) || memcmp(header, COMPRESSED_BLOB_MAGIC, sizeof(COMPRESSED_BLOB_MAGIC)) != 0)
+    {
+        throw ManifestFormatError("not a compressed blob: " + blob.string());
+    }
+    memcpy(&raw_size, header + sizeof(COMPRESSED_BLOB_MAGIC) + 1, sizeof(raw_size));
+    return raw_size;
+}
+
+void decompress_file(const filesystem::path &source, const filesystem::path &target)
+{
+    ifstream in(source, ios_base::binary);
+    char header[COMPRESSED_BLOB_HEADER];
+    if (!in.read(header, sizeof(header)) || memcmp(header, COMPRESSED_BLOB_MAGIC, sizeof(COMPRESSED_BLOB_MAGIC)) != 0)
+    {
+        throw ManifestFormatError("not a compressed blob: " + source.string());
+    }
+    Codec codec = (Codec)header[sizeof(COMPRESSED_BLOB_MAGIC)];
+    ofstream out(target, ios_base::binary);
+    vector<char> raw(COMPRESSION_FRAME), packed(COMPRESSION_FRAME);
+    uint32_t frame[2];
+    while (in.read((char *)frame, sizeof(frame)))
+    {
+        uint32_t raw_length = frame[0], stored_length = frame[1];
+        if (raw_length > COMPRESSION_FRAME || stored_length > raw_length || !in.read(packed.data(), stored_length))
+        {
+            throw ManifestFormatError("corrupt compressed blob: " + source.string());
+        }
+        if (stored_length == raw_length)
+        {
+            out.write(packed.data(), raw_length);
+            continue;
+        }
+        size_t length;
+        if (codec == Codec::lz4)
+        {
+            int result = LZ4_decompress_safe(packed.data(), raw.data(), (int)stored_length, (int)raw.size());
+            length = result < 0 ? SIZE_MAX : (size_t)result;
+        }
+        else
+        {
+            size_t result = ZSTD_decompress(raw.data(), raw.size(), packed.data(), stored_length);
+            length = ZSTD_isError(result) ? SIZE_MAX : result;
+        }
+        if (length != raw_length)
+        {
+            throw ManifestFormatError("corrupt compressed blob: " + source.string());
+        }
+        out.write(raw.data(), raw_length);
+    }
+    out.close();
+    if (!out)
+    {
+        throw runtime_error("can't write " + target.string());
+    }
+}
+
+struct BackupOptions
+{
+    size_t hash_threads = 4;
+    size_t copy_threads = 2;        // also compress
+    size_t queue_capacity = 64;
+    CompressionOptions compression;
+};
+
+struct CodecStats
+{
+    size_t files = 0;
+    uintmax_t raw_bytes = 0;
+    uintmax_t stored_bytes = 0;
+    chrono::nanoseconds time{ 0 };
+
+    double ratio() const
+    {
+        return stored_bytes ? (double)raw_bytes / stored_bytes : 0.0;
+    }
+
+    // Per thread: time is summed over the copy workers.
+    double mb_per_sec() const
+    {
+        double seconds = chrono::duration<double>(time).count();
+        return seconds > 0 ? raw_bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    }
+};
+
+struct StageStats
+{
+    string name;
+    size_t threads = 0;
+    size_t files = 0;
+    uintmax_t bytes = 0;
+    chrono::nanoseconds wall{ 0 };
+    chrono::nanoseconds busy{ 0 };
+    size_t queue_max = 0;      // backlog waiting in front of this stage
+    double queue_average = 0;
+    size_t queue_capacity = 0;
+
+    double mb_per_sec() const
+    {
+        double seconds = chrono::duration<double>(wall).count();
+        return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    }
+
+    // Fraction of the stage's thread time spent doing work (not waiting).
+    double utilization() const
+    {
+        double available = chrono::duration<double>(wall).count() * threads;
+        return available > 0 ? chrono::duration<double>(busy).count() / available : 0.0;
+    }
+};
+
+struct BackupStats
+{
+    StageStats walk{ "walk" }, hash{ "hash" }, copy{ "copy" };
+    CodecStats codecs[NUM_CODECS];
+    chrono::nanoseconds elapsed{ 0 };
+
+    void print(ostream &out) const
+    {
+        const double NANO_TO_MS = 1.0 / 1000000.0;
+        out << "stage\tthreads\tfiles\tMB\tms\tMB/s\tbusy%\tq_max\tq_avg\tq_cap" << endl;
+        for (const StageStats *stage : { &walk, &hash, &copy })
+        {
+            out << stage->name << "\t" << stage->threads << "\t" << stage->files << "\t"
+                << stage->bytes / (1024.0 * 1024.0) << "\t" << stage->wall.count() * NANO_TO_MS << "\t"
+                << stage->mb_per_sec() << "\t" << (int)(stage->utilization() * 100) << "\t"
+                << stage->queue_max << "\t" << stage->queue_average << "\t" << stage->queue_capacity << endl;
+        }
+        out << "codec\tfiles\traw_MB\tstored_MB\tratio\tMB/s" << endl;
+        for (size_t i = 0; i < NUM_CODECS; i++)
+        {
+            const CodecStats &codec = codecs[i];
+            out << codec_name((Codec)i) << "\t" << codec.files << "\t" << codec.raw_bytes / (1024.0 * 1024.0) << "\t"
+                << codec.stored_bytes / (1024.0 * 1024.0) << "\t" << codec.ratio() << "\t" << codec.mb_per_sec() << endl;
+        }
+        out << "total\t" << elapsed.count() * NANO_TO_MS << " ms" << endl;
+    }
+};
+
+// Walks, hashes and copies concurrently: walk -> [queue] -> hash -> [queue] -> copy.
+// The walker is a single thread, hashing and copying use worker pools. A full queue
+// with an idle consumer behind it points at the slow stage. The copy workers also
+// pick a codec per file and compress.
+class BackupPipeline
+{
+    struct WalkItem
+    {
+        string filename;
+        uintmax_t size = 0;
+    };
+
+    struct CopyItem
+    {
+        file_hash fh;
+        uintmax_t size = 0;
+    };
+
+    filesystem::path source, target;
+    BackupOptions options;
+    BoundedQueue<WalkItem> walked;
+    BoundedQueue<CopyItem> hashed;
+
+    mutex lock;
+    vector<file_hash> manifest;
+    set<string> stored;          // hashes already claimed by a copier
+    exception_ptr error;
+
+public:
+    BackupStats stats;
+
+    BackupPipeline(const filesystem::path &source, const filesystem::path &target, const BackupOptions &options)
+        : source(source), target(target), options(options),
+          walked(options.queue_capacity), hashed(options.queue_capacity)
+    {
+    }
+
+    vector<file_hash> run()
+    {
+        auto start = chrono::steady_clock::now();
+        if (!filesystem::exists(target))
+        {
+            filesystem::create_directory(target);
+        }
+
+        stats.walk.threads = 1;
+        stats.hash.threads = max<size_t>(options.hash_threads, 1);
+        stats.copy.threads = max<size_t>(options.copy_threads, 1);
+
+        vector<thread> walkers, hashers, copiers;
+        walkers.emplace_back([this] { stage(stats.walk, [this](StageStats &s) { walk(s); }); });
+        for (size_t i = 0; i < stats.hash.threads; i++)
+        {
+            hashers.emplace_back([this] { stage(stats.hash, [this](StageStats &s) { hash(s); }); });
+        }
+        for (size_t i = 0; i < stats.copy.threads; i++)
+        {
+            copiers.emplace_back([this] { stage(stats.copy, [this](StageStats &s) { copy(s); }); });
+        }
+
+        join(walkers, stats.walk, start);
+        walked.close();
+        join(hashers, stats.hash, start);
+        hashed.close();
+        join(copiers, stats.copy, start);
+
+        stats.hash.queue_max = walked.max_depth();
+        stats.hash.queue_average = walked.average_depth();
+        stats.hash.queue_capacity = options.queue_capacity;
+        stats.copy.queue_max = hashed.max_depth();
+        stats.copy.queue_average = hashed.average_depth();
+        stats.copy.queue_capacity = options.queue_capacity;
+        stats.elapsed = chrono::steady_clock::now() - start;
+
+        if (error)
+        {
+            rethrow_exception(error);
+        }
+
+        // workers finish out of order, keep manifests stable between runs
+        sort(manifest.begin(), manifest.end(), [](const file_hash &left, const file_hash &right)
+        {
+            return left.filename < right.filename;
+        });
+        return manifest;
+    }
+
+private:
+    template <typename Work>
+    void stage(StageStats &stats, Work work)
+    {
+        StageStats local;
+        try
+        {
+            work(local);
+        }
+        catch (...)
+        {
+            {
+                lock_guard<mutex> guard(lock);
+                if (!error)
+                {
+                    error = current_exception();
+                }
+            }
+            // the stages before and after this one would wait on it forever
+            walked.cancel();
+            hashed.cancel();
+        }
+        lock_guard<mutex> guard(lock);
+        stats.files += local.files;
+        stats.bytes += local.bytes;
+        stats.busy += local.busy;
+    }
+
+    // All stages start together, so a stage's wall time runs from the pipeline start.
+    void join(vector<thread> &threads, StageStats &stats, chrono::steady_clock::time_point start)
+    {
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        stats.wall = chrono::steady_clock::now() - start;
+    }
+
+    void walk(StageStats &s)
+    {
+        for (const auto &file : filesystem::recursive_directory_iterator(source))
+        {
+            auto t0 = chrono::steady_clock::now();
+            if (file.is_regular_file())
+            {
+                WalkItem item{ file.path().lexically_relative(source).string(), file.file_size() };
+                s.files++;
+                s.bytes += item.size;
+                s.busy += chrono::steady_clock::now() - t0;
+                if (!walked.push(move(item)))
+                {
+                    return;
+                }
+            }
+        }
+    }
+
+    void hash(StageStats &s)
+    {
+        WalkItem item;
+        while (walked.pop(item))
+        {
+            auto t0 = chrono::steady_clock::now();
+            string hash = sha_hash((source / item.filename).string());
+            file_hash fh{ item.filename, hash };
+            s.files++;
+            s.bytes += item.size;
+            s.busy += chrono::steady_clock::now() - t0;
+            if (!hashed.push({ fh, item.size }))
+            {
+                return;
+            }
+        }
+    }
+
+    Codec existing_codec(const string &hash, const filesystem::path &source_path, uintmax_t size)
+    {
+        for (Codec codec : { Codec::none, Codec::lz4, Codec::zstd })
+        {
+            if (filesystem::exists(blob_path(target, hash, codec)))
+            {
+                return codec;
+            }
+        }
+        return choose_codec(source_path, size, options.compression);
+    }
+
+    void copy(StageStats &s)
+    {
+        CodecStats codecs[NUM_CODECS];
+        CopyItem item;
+        while (hashed.pop(item))
+        {
+            auto t0 = chrono::steady_clock::now();
+            filesystem::path source_path = source / item.fh.filename;
+            // a blob stored by an earlier backup keeps its codec
+            item.fh.codec = existing_codec(item.fh.hash, source_path, item.size);
+            filesystem::path target_path = blob_path(target, item.fh.hash, item.fh.codec);
+            bool claimed;
+            {
+                lock_guard<mutex> guard(lock);
+                claimed = stored.insert(item.fh.hash).second;
+                manifest.push_back(item.fh);
+            }
+            // identical contents found under two names are only stored once
+            if (claimed && !filesystem::exists(target_path))
+            {
+                // written under a temporary name so a partial blob is never mistaken for a stored one
+                filesystem::path partial = target_path;
+                partial += ".tmp";
+                auto c0 = chrono::steady_clock::now();
+                uintmax_t stored_size = item.size;
+                if (item.fh.codec == Codec::none)
+                {
+                    copy_file_fast(source_path, partial);
+                }
+                else
+                {
+                    stored_size = compress_file(source_path, partial, item.fh.codec, options.compression.zstd_level);
+                }
+                filesystem::rename(partial, target_path);
+                CodecStats &codec = codecs[(size_t)item.fh.codec];
+                codec.files++;
+                codec.raw_bytes += item.size;
+                codec.stored_bytes += stored_size;
+                codec.time += chrono::steady_clock::now() - c0;
+                s.files++;
+                s.bytes += item.size;
+            }
+            s.busy += chrono::steady_clock::now() - t0;
+        }
+        lock_guard<mutex> guard(lock);
+        for (size_t i = 0; i < NUM_CODECS; i++)
+        {
+            stats.codecs[i].files += codecs[i].files;
+            stats.codecs[i].raw_bytes += codecs[i].raw_bytes;
+            stats.codecs[i].stored_bytes += codecs[i].stored_bytes;
+            stats.codecs[i].time += codecs[i].time;
+        }
+    }
+};
+
+// Per-file history across snapshots. For every path only the snapshots where
+// its digest changed are kept (a change point), deletions are change points
+// with an all-zero digest. Looking up a path is a hash lookup and finding its
+// state at a snapshot is a binary search over that path's change points, so
+// neither depends on how many snapshots exist.
+//
+// On disk it is an append-only log next to the manifests, each backup appends
+// a snapshot record followed by the paths that changed in it:
+//   'S' varint length, snapshot name, varint number of 'C' records that follow
+//   'C' varint length, filename, 32-byte digest
+// A snapshot only counts once all of its changes have been read, so a backup
+// cut off part way through its append is dropped as a whole.
+class Timeline
+{
+public:
+    typedef array<unsigned char, DIGEST_SIZE> Digest;
+
+    struct ChangePoint
+    {
+        uint32_t snapshot;
+        Digest digest;
+
+        bool deleted() const
+        {
+            return digest == Digest{};
+        }
+    };
+
+    Timeline(const filesystem::path &file_path) : file_path(file_path)
+    {
+        load();
+    }
+
+    const vector<string> &snapshots() const
+    {
+        return snapshot_names;
+    }
+
+    size_t num_paths() const
+    {
+        return paths.size();
+    }
+
+    // Records the full manifest of a new snapshot and appends only the paths
+    // that changed since the previous one. Snapshot names must not go backwards
+    // (current_timestamp() names sort by time). Returns the number of changes.
+    size_t add_snapshot(const string &snapshot, const vector<file_hash> &manifest)
+    {
+        if (!snapshot_names.empty() && snapshot < snapshot_names.back())
+        {
+            throw invalid_argument("snapshot " + snapshot + " is older than " + snapshot_names.back());
+        }
+        uint32_t id = (uint32_t)snapshot_names.size();
+        string changed;
+        size_t changes = 0;
+        unordered_set<string_view> present;
+        present.reserve(manifest.size());
+        for (const auto &fh : manifest)
+        {
+            present.insert(fh.filename);
+            Digest digest;
+            hex_to_digest(fh.hash, digest.data());
+            auto &points = paths[fh.filename];
+            if (points.empty() || points.back().digest != digest)
+            {
+                points.push_back({ id, digest });
+                append_change(changed, fh.filename, digest);
+                changes++;
+            }
+        }
+        for (auto &[filename, points] : paths)
+        {
+            if (!points.back().deleted() && present.count(filename) == 0)
+            {
+                points.push_back({ id, Digest{} });
+                append_change(changed, filename, Digest{});
+                changes++;
+            }
+        }
+        snapshot_names.push_back(snapshot);
+
+        string record;
+        record += 'S';
+        put_varint(record, snapshot.length());
+        record += snapshot;
+        put_varint(record, changes);
+        record += changed;
+
+        ofstream out(file_path, ios_base::binary | ios_base::app);
+        out.write(record.data(), record.size());
+        out.close();
+        if (!out)
+        {
+            throw runtime_error("can't append to " + file_path.string());
+        }
+        return changes;
+    }
+
+    // Last snapshot taken at or before time (same format as current_timestamp),
+    // -1 if there is none.
+    int snapshot_at(const string &time) const
+    {
+        auto after = upper_bound(snapshot_names.begin(), snapshot_names.end(), time);
+        return (int)(after - snapshot_names.begin()) - 1;
+    }
+
+    // The hash filename had as of time, false if it didn't exist then.
+    bool hash_at(const string &filename, const string &time, string &hash) const
+    {
+        int snapshot = snapshot_at(time);
+        auto found = paths.find(filename);
+        if (snapshot < 0 || found == paths.end())
+        {
+            return false;
+        }
+        const auto &points = found->second;
+        auto after = upper_bound(points.begin(), points.end(), (uint32_t)snapshot, [](uint32_t snapshot, const ChangePoint &point)
+        {
+            return snapshot < point.snapshot;
+        });
+        if (after == points.begin() || prev(after)->deleted())
+        {
+            return false;
+        }
+        hash = digest_to_hex(prev(after)->digest.data());
+        return true;
+    }
+
+    // (snapshot, hash) for every change to filename, hash is empty for a deletion.
+    vector<pair<string, string>> history(const string &filename) const
+    {
+        vector<pair<string, string>> result;
+        auto found = paths.find(filename);
+        if (found != paths.end())
+        {
+            for (const auto &point : found->second)
+            {
+                result.push_back({ snapshot_names[point.snapshot], point.deleted() ? "" : digest_to_hex(point.digest.data()) });
+            }
+        }
+        return result;
+    }
+
+private:
+    filesystem::path file_path;
+    vector<string> snapshot_names;
+    unordered_map<string, vector<ChangePoint>> paths;
+
+    static void append_change(string &record, const string &filename, const Digest &digest)
+    {
+        record += 'C';
+        put_varint(record, filename.length());
+        record += filename;
+        record.append((const char *)digest.data(), digest.size());
+    }
+
+    // False when the name runs past the end, as in a torn record.
+    static bool read_name(const char *&cursor, const char *end, string &name)
+    {
+        uint64_t length = get_varint(cursor, end);
+        if (length > (uint64_t)(end - cursor))
+        {
+            return false;
+        }
+        name.assign(cursor, (size_t)length);
+        cursor += length;
+        return true;
+    }
+
+    void load()
+    {
+        if (!filesystem::exists(file_path))
+        {
+            return;
+        }
+        MappedFile file(file_path);
+        const char *cursor = file.data(), *end = file.data() + file.size();
+        const char *whole = cursor;     // end of the last complete snapshot
+        try
+        {
+            while (cursor < end)
+            {
+                string snapshot;
+                if (*cursor++ != 'S')
+                {
+                    throw ManifestFormatError("corrupt timeline " + file_path.string());
+                }
+                if (!read_name(cursor, end, snapshot))
+                {
+                    break;      // torn final snapshot from an interrupted append
+                }
+                uint64_t count = get_varint(cursor, end);
+                uint32_t id = (uint32_t)snapshot_names.size();
+                vector<pair<string, ChangePoint>> changes;
+                for (uint64_t i = 0; i < count && cursor < end; i++)
+                {
+                    if (*cursor++ != 'C')
+                    {
+                        throw ManifestFormatError("corrupt timeline " + file_path.string());
+                    }
+                    string filename;
+                    if (!read_name(cursor, end, filename) || DIGEST_SIZE > (size_t)(end - cursor))
+                    {
+                        break;
+                    }
+                    ChangePoint point{ id, Digest{} };
+                    memcpy(point.digest.data(), cursor, DIGEST_SIZE);
+                    cursor += DIGEST_SIZE;
+                    changes.push_back({ move(filename), point });
+                }
+                if (changes.size() < count)
+                {
+                    break;
+                }
+                snapshot_names.push_back(snapshot);
+                for (auto &[filename, point] : changes)
+                {
+                    paths[filename].push_back(point);
+                }
+                whole = cursor;
+            }
+        }
+        catch (const ManifestFormatError &)
+        {
+            if (cursor < end)
+            {
+                throw;
+            }
+        }
+        // cut off a torn snapshot so the next append doesn't land after it
+        size_t valid = whole - file.data();
+        size_t size = file.size();
+        file.close();
+        if (valid < size)
+        {
+            filesystem::resize_file(file_path, valid);
+        }
+    }
+};
+
+const char *TIMELINE_FILENAME = "timeline.log";
+
+void backup(const string &source, const string &target, vector<file_hash> &manifest, string &manifest_filename,
+            BackupStats *stats = nullptr, const BackupOptions &options = {})
+{
+    BackupPipeline pipeline(source, target, options);
+    manifest = pipeline.run();
+    // the manifest is written last so it never refers to a blob that wasn't stored
+    write_binary_manifest(target, manifest, manifest_filename);
+    Timeline timeline(filesystem::path(target) / TIMELINE_FILENAME);
+    timeline.add_snapshot(filesystem::path(manifest_filename).stem().string(), manifest);
+    if (stats)
+    {
+        *stats = pipeline.stats;
+    }
+}
+
+// Loads either manifest format, picked by extension.
+void load_manifest(vector<file_hash> &manifest, const filesystem::path &manifest_filepath)
+{
+    if (manifest_filepath.extension() == ".mft")
+    {
+        BinaryManifest(manifest_filepath).read(manifest);
+    }
+    else
+    {
+        read_manifest(manifest, manifest_filepath.string());
+    }
+}
+
+struct RestoreOptions
+{
+    size_t threads = 8;
+    bool verify_existing = true;                 // skip files already restored with the right hash
+    ostream *progress = nullptr;                 // periodic progress lines, if set
+    chrono::milliseconds progress_interval{ 1000 };
+};
+
+struct RestoreStats
+{
+    size_t files = 0;
+    size_t restored = 0;
+    size_t skipped = 0;
+    uintmax_t bytes_restored = 0;
+    uintmax_t bytes_skipped = 0;
+    chrono::nanoseconds elapsed{ 0 };
+
+    double mb_per_sec() const
+    {
+        double seconds = chrono::duration<double>(elapsed).count();
+        return seconds > 0 ? bytes_restored / (1024.0 * 1024.0) / seconds : 0.0;
+    }
+
+    void print(ostream &out) const
+    {
+        out << "restored " << restored << " files (" << bytes_restored / (1024.0 * 1024.0) << " MB), "
+            << "skipped " << skipped << " up to date (" << bytes_skipped / (1024.0 * 1024.0) << " MB) in "
+            << chrono::duration<double, milli>(elapsed).count() << " ms, " << mb_per_sec() << " MB/s" << endl;
+    }
+};
+
+// A manifest entry names a file under the restore target, so it must be
+// relative and can't climb out with "..".
+bool inside_target(const string &filename)
+{
+    filesystem::path path(filename);
+    if (filename.empty() || path.has_root_path())
+    {
+        return false;
+    }
+    for (const auto &part : path)
+    {
+        if (part == "..")
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Recreates the files listed in a manifest under target from the blobs
+// stored next to the manifest. Files are spread over a pool of threads, each
+// taking the next entry from a shared counter. A file already present with
+// the right size and hash is left alone, so an interrupted restore can just
+// be run again.
+void restore(const string &manifest_filename, const string &target, RestoreStats *stats = nullptr, const RestoreOptions &options = {})
 {
-    map<string, string> left_file2hash, left_hash2file, right_file2hash, right_hash2file;
+    auto start = chrono::steady_clock::now();
+    filesystem::path archive = filesystem::path(manifest_filename).parent_path();
+    filesystem::path root(target);
+    vector<file_hash> manifest;
+    load_manifest(manifest, manifest_filename);
 
-    for (const auto &left_fh : left)
+    set<filesystem::path> directories;
+    for (const auto &fh : manifest)
     {
-        left_file2hash[left_fh.filename] = left_fh.hash;
-        left_hash2file[left_fh.hash] = left_fh.filename;
+        if (!inside_target(fh.filename))
+        {
+            throw ManifestFormatError("manifest entry outside the target: " + fh.filename);
+        }
+        directories.insert((root / fh.filename).parent_path());
     }
-
-    for (const auto &right_fh : right)
+    for (const auto &directory : directories)
     {
-        right_file2hash[right_fh.filename] = right_fh.hash;
-        right_hash2file[right_fh.hash] = right_fh.filename;
+        filesystem::create_directories(directory);
     }
 
-    for (const auto &left_fh : left)
+    atomic<size_t> next{ 0 }, done{ 0 }, restored{ 0 }, skipped{ 0 };
+    atomic<uintmax_t> bytes_restored{ 0 }, bytes_skipped{ 0 };
+    mutex lock;
+    condition_variable finished;
+    bool all_done = false;
+    exception_ptr error;
+
+    auto worker = [&]()
     {
-        if (right_file2hash.count(left_fh.filename) == 0 && right_hash2file.count(left_fh.hash) == 0)
+        try
         {
-            changelog.push_back(left_fh.filename + " deleted");
+            for (size_t i = next++; i < manifest.size(); i = next++)
+            {
+                const file_hash &fh = manifest[i];
+                filesystem::path blob = blob_path(archive, fh.hash, fh.codec);
+                filesystem::path file_path = root / fh.filename;
+                uintmax_t size = blob_raw_size(blob, fh.codec);
+                if (options.verify_existing && filesystem::is_regular_file(file_path)
+                    && filesystem::file_size(file_path) == size && sha_hash(file_path.string()) == fh.hash)
+                {
+                    skipped++;
+                    bytes_skipped += size;
+                }
+                else
+                {
+                    if (fh.codec == Codec::none)
+                    {
+                        copy_file_fast(blob, file_path);
+                    }
+                    else
+                    {
+                        decompress_file(blob, file_path);
+                    }
+                    restored++;
+                    bytes_restored += size;
+                }
+                done++;
+            }
         }
-        else if (right_file2hash.count(left_fh.filename) && right_file2hash[left_fh.filename] != left_fh.hash)
+        catch (...)
         {
-            changelog.push_back(left_fh.filename + " updated");
+            lock_guard<mutex> guard(lock);
+            if (!error)
+            {
+                error = current_exception();
+            }
+            next = manifest.size();     // let the other workers wind down
         }
-        else if (right_hash2file.count(left_fh.hash) && right_hash2file[left_fh.hash] != left_fh.filename)
+    };
+
+    thread reporter;
+    if (options.progress)
+    {
+        reporter = thread([&]()
         {
-            changelog.push_back(left_fh.filename + " renamed to " + right_hash2file[left_fh.hash]);
-        }
+            unique_lock<mutex> guard(lock);
+            while (!finished.wait_for(guard, options.progress_interval, [&] { return all_done; }))
+            {
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                *options.progress << "restore: " << done << "/" << manifest.size() << " files, "
+                                  << bytes_restored / (1024.0 * 1024.0) << " MB, "
+                                  << bytes_restored / (1024.0 * 1024.0) / seconds << " MB/s" << endl;
+            }
+        });
     }
 
-    for (const auto &right_fh : right)
+    vector<thread> workers;
+    for (size_t i = 0; i < max<size_t>(options.threads, 1); i++)
     {
-        if (left_file2hash.count(right_fh.filename) == 0 && left_hash2file.count(right_fh.hash) == 0)
-        {
-            changelog.push_back(right_fh.filename + " added");
-        }
+        workers.emplace_back(worker);
+    }
+    for (auto &t : workers)
+    {
+        t.join();
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        all_done = true;
+    }
+    finished.notify_all();
+    if (reporter.joinable())
+    {
+        reporter.join();
+    }
+    if (error)
+    {
+        rethrow_exception(error);
     }
-}
 
-void backup(const string &source, const string &target, vector<file_hash> &manifest, string &manifest_filename)
-{
-    hash_all(manifest, source);
-    write_manifest(target, manifest, manifest_filename);
-    copy_files(source, target, manifest);
+    if (stats)
+    {
+        stats->files = manifest.size();
+        stats->restored = restored;
+        stats->skipped = skipped;
+        stats->bytes_restored = bytes_restored;
+        stats->bytes_skipped = bytes_skipped;
+        stats->elapsed = chrono::steady_clock::now() - start;
+    }
 }
 
 filesystem::path files_path, saved_path, backup_path;
@@ -254,13 +1987,427 @@ void test_backup()
     backup(files_path.string(), backup_path.string(), manifest, manifest_filename);
     for (const auto &fh : manifest)
     {
-        string file_path = backup_path.string() + '\\' + fh.hash + ".bck";
+        filesystem::path file_path = blob_path(backup_path, fh.hash, fh.codec);
         assert(filesystem::exists(file_path));
     }
     assert(filesystem::exists(manifest_filename));
+    Timeline timeline(backup_path / TIMELINE_FILENAME);
+    assert(timeline.snapshots().size() == 1 && timeline.num_paths() == manifest.size());
+    test_teardown();
+}
+
+void test_backup_pipeline()
+{
+    test_setup();
+    for (int i = 0; i < 20; i++)
+    {
+        ofstream f("copy_" + to_string(i) + ".txt");
+        f << (i % 2 ? "aaa" : "odd one " + to_string(i));
+    }
+    filesystem::path cwd = filesystem::current_path();
+
+    vector<file_hash> manifest;
+    string manifest_filename;
+    BackupStats stats;
+    BackupOptions options;
+    options.hash_threads = 3;
+    options.copy_threads = 2;
+    options.queue_capacity = 1;
+    backup(files_path.string(), backup_path.string(), manifest, manifest_filename, &stats, options);
+
+    assert(filesystem::current_path() == cwd);
+    assert(manifest.size() == 23);
+    assert(is_sorted(manifest.begin(), manifest.end(), [](const file_hash &left, const file_hash &right)
+    {
+        return left.filename < right.filename;
+    }));
+    set<string> hashes;
+    for (const auto &fh : manifest)
+    {
+        hashes.insert(fh.hash);
+        assert(filesystem::exists(blob_path(backup_path, fh.hash, fh.codec)));
+    }
+    assert(stats.walk.files == 23);
+    assert(stats.hash.files == 23);
+    assert(stats.copy.files == hashes.size());
+    assert(stats.hash.queue_max <= 1 && stats.copy.queue_max <= 1);
+
+    // a copier that fails stops the whole pipeline instead of leaving the
+    // stages in front of it blocked on a full queue
+    filesystem::path failing_path = filesystem::temp_directory_path().append("FileArchiverFailing");
+    filesystem::remove_all(failing_path);
+    filesystem::create_directory(failing_path);
+    for (Codec codec : { Codec::none, Codec::lz4, Codec::zstd })
+    {
+        for (const auto &fh : manifest)
+        {
+            filesystem::path partial = blob_path(failing_path, fh.hash, codec);
+            partial += ".tmp";
+            filesystem::create_directories(partial);
+        }
+    }
+    options.hash_threads = 1;
+    options.copy_threads = 1;
+    bool threw = false;
+    try
+    {
+        vector<file_hash> failed;
+        backup(files_path.string(), failing_path.string(), failed, manifest_filename, &stats, options);
+    }
+    catch (const exception &)
+    {
+        threw = true;
+    }
+    assert(threw && filesystem::current_path() == cwd);
+    filesystem::remove_all(failing_path);
+    test_teardown();
+}
+
+// Deterministic stand-in for a SHA-256 hex digest.
+string fake_hash(size_t seed)
+{
+    unsigned char digest[DIGEST_SIZE];
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+    for (size_t i = 0; i < DIGEST_SIZE; i++)
+    {
+        x ^= x >> 29;
+        x *= 0xBF58476D1CE4E5B9ull;
+        digest[i] = (unsigned char)(x >> 56);
+    }
+    return digest_to_hex(digest);
+}
+
+void test_diff_manifests()
+{
+    vector<file_hash> original = { { "a.txt", "aaa" }, { "b.txt", "bbb" }, { "sub_dir\\c.txt", "ccc" }, { "unchanged.txt", "unchanged" } };
+    vector<file_hash> changed = { { "a.txt", "XXX" }, { "Y.txt", "bbb" }, { "d.txt", "ddd" }, { "unchanged.txt", "unchanged" } };
+    // same changes as test_compare_manifest, in filename order
+    vector<string> expect = { "a.txt updated", "b.txt renamed to Y.txt", "d.txt added", "sub_dir\\c.txt deleted" };
+    vector<string> changelog;
+    size_t changes = diff_manifests(SortedManifest(original), SortedManifest(changed), [&](const ManifestChange &change)
+    {
+        changelog.push_back(change.describe());
+    });
+    assert(changes == changelog.size());
+    assert(changelog == expect);
+
+    // files sharing contents: an unchanged one is never a rename, and a
+    // rename goes to the first match by filename in both
+    original = { { "b.txt", "same" }, { "m.txt", "same" }, { "old.txt", "moved" } };
+    changed = { { "n2.txt", "moved" }, { "b.txt", "same" }, { "a.txt", "same" }, { "n1.txt", "moved" } };
+    expect = { "m.txt renamed to a.txt", "old.txt renamed to n1.txt" };
+    changelog.clear();
+    compare_manifest(original, changed, changelog);
+    assert(changelog == expect);
+    changelog.clear();
+    diff_manifests(SortedManifest(original), SortedManifest(changed), [&](const ManifestChange &change)
+    {
+        changelog.push_back(change.describe());
+    });
+    assert(changelog == expect);
+}
+
+void test_diff_binary_manifests()
+{
+    vector<file_hash> left, right;
+    for (size_t i = 0; i < 200; i++)
+    {
+        string filename = "dir/file_" + to_string(i) + ".txt";
+        left.push_back({ filename, fake_hash(i) });
+        switch (i % 5)
+        {
+            case 0: break;                                                  // deleted
+            case 1: right.push_back({ filename, fake_hash(i + 1000) }); break; // updated
+            case 2: right.push_back({ "moved/" + filename, fake_hash(i) }); break;  // renamed
+            default: right.push_back({ filename, fake_hash(i) }); break;    // unchanged
+        }
+    }
+    right.push_back({ "new.txt", fake_hash(5000) });
+
+    filesystem::path left_path = filesystem::temp_directory_path() / "FileArchiverLeft.mft";
+    filesystem::path right_path = filesystem::temp_directory_path() / "FileArchiverRight.mft";
+    save_binary_manifest(left_path, left, 4);
+    save_binary_manifest(right_path, right, 4);
+
+    vector<string> expect;
+    compare_manifest(left, right, expect);
+    sort(expect.begin(), expect.end());
+
+    vector<string> changelog;
+    {
+        BinaryManifest left_manifest(left_path), right_manifest(right_path);
+        diff_manifests(left_manifest, right_manifest, [&](const ManifestChange &change)
+        {
+            changelog.push_back(change.describe());
+        });
+    }
+    sort(changelog.begin(), changelog.end());
+    assert(changelog == expect);
+
+    filesystem::remove(left_path);
+    filesystem::remove(right_path);
+}
+
+void test_copy_file_fast()
+{
+    filesystem::path source = filesystem::temp_directory_path() / "FileArchiverSparse.bin";
+    filesystem::path target = filesystem::temp_directory_path() / "FileArchiverSparse.copy";
+    {
+        // leaves a hole between the two writes on file systems that support it
+        ofstream out(source, ios_base::binary);
+        out << "head";
+        out.seekp(4 * 1024 * 1024);
+        out << "tail";
+    }
+    copy_file_fast(source, target);
+    assert(filesystem::file_size(target) == filesystem::file_size(source));
+    assert(sha_hash(target.string()) == sha_hash(source.string()));
+    filesystem::remove(source);
+    filesystem::remove(target);
+}
+
+void test_restore()
+{
+    test_setup();
+    vector<file_hash> manifest;
+    string manifest_filename;
+    backup(files_path.string(), backup_path.string(), manifest, manifest_filename);
+
+    filesystem::path restore_path = filesystem::temp_directory_path() / "FileArchiverRestore";
+    RestoreStats stats;
+    RestoreOptions options;
+    options.threads = 2;
+    restore(manifest_filename, restore_path.string(), &stats, options);
+    assert(stats.files == manifest.size() && stats.restored == manifest.size() && stats.skipped == 0);
+    for (const auto &fh : manifest)
+    {
+        assert(sha_hash((restore_path / fh.filename).string()) == fh.hash);
+    }
+
+    // a second run only has the damaged file left to do
+    {
+        ofstream damaged(restore_path / manifest[0].filename);
+        damaged << "damaged";
+    }
+    restore(manifest_filename, restore_path.string(), &stats, options);
+    assert(stats.restored == 1 && stats.skipped == manifest.size() - 1);
+    assert(sha_hash((restore_path / manifest[0].filename).string()) == manifest[0].hash);
+
+    // entries that would land outside the target are refused before anything is written
+    filesystem::path escaped = filesystem::temp_directory_path() / "FileArchiverEscaped.txt";
+    for (string filename : { string("../FileArchiverEscaped.txt"), escaped.string() })
+    {
+        vector<file_hash> hostile = manifest;
+        hostile.back().filename = filename;
+        filesystem::path hostile_path = backup_path / "hostile.mft";
+        save_binary_manifest(hostile_path, hostile, 4);
+        bool threw = false;
+        try
+        {
+            restore(hostile_path.string(), restore_path.string(), &stats, options);
+        }
+        catch (const ManifestFormatError &)
+        {
+            threw = true;
+        }
+        assert(threw && !filesystem::exists(escaped));
+    }
+
+    filesystem::remove_all(restore_path);
+    test_teardown();
+}
+
+void test_compression()
+{
+    test_setup();
+    {
+        ofstream text("text.txt", ios_base::binary);
+        for (int i = 0; i < 100000; i++)
+        {
+            text << "line " << i % 100 << " of a very repetitive log file\n";
+        }
+        ofstream varied("varied.txt", ios_base::binary);
+        for (int i = 0; i < 100000; i++)
+        {
+            varied << (char)(' ' + (i * 7919 + i / 13) % 100);
+        }
+        // stands in for already compressed media
+        ofstream noise("noise.bin", ios_base::binary);
+        uint64_t x = 12345;
+        for (int i = 0; i < 2 * 1024 * 1024; i++)
+        {
+            x = x * 6364136223846793005ull + 1442695040888963407ull;
+            noise.put((char)(x >> 56));
+        }
+    }
+    vector<file_hash> manifest;
+    string manifest_filename;
+    BackupStats stats;
+    backup(files_path.string(), backup_path.string(), manifest, manifest_filename, &stats);
+
+    map<string, Codec> codecs;
+    for (const auto &fh : manifest)
+    {
+        codecs[fh.filename] = fh.codec;
+    }
+    assert(codecs["a.txt"] == Codec::none);
+    assert(codecs["text.txt"] == Codec::zstd);
+    assert(codecs["varied.txt"] == Codec::lz4);
+    assert(codecs["noise.bin"] == Codec::none);
+    assert(stats.codecs[(size_t)Codec::zstd].ratio() > 10);
+    assert(stats.codecs[(size_t)Codec::lz4].stored_bytes < stats.codecs[(size_t)Codec::lz4].raw_bytes);
+
+    // the codec survives a manifest round trip
+    vector<file_hash> loaded;
+    load_manifest(loaded, manifest_filename);
+    for (const auto &fh : loaded)
+    {
+        assert(fh.codec == codecs[fh.filename]);
+    }
+
+    filesystem::path restore_path = filesystem::temp_directory_path() / "FileArchiverRestore";
+    restore(manifest_filename, restore_path.string());
+    for (const auto &fh : manifest)
+    {
+        assert(sha_hash((restore_path / fh.filename).string()) == fh.hash);
+    }
+    filesystem::remove_all(restore_path);
     test_teardown();
 }
 
+void test_timeline()
+{
+    filesystem::path file_path = filesystem::temp_directory_path() / "FileArchiverTimeline.log";
+    filesystem::remove(file_path);
+    {
+        Timeline timeline(file_path);
+        assert(timeline.add_snapshot("20240101_000000", { { "a.txt", fake_hash(1) }, { "b.txt", fake_hash(2) } }) == 2);
+        assert(timeline.add_snapshot("20240201_000000", { { "a.txt", fake_hash(1) }, { "b.txt", fake_hash(3) } }) == 1);
+        assert(timeline.add_snapshot("20240301_000000", { { "b.txt", fake_hash(3) }, { "c.txt", fake_hash(4) } }) == 2);
+        assert(timeline.add_snapshot("20240401_000000", { { "a.txt", fake_hash(5) }, { "b.txt", fake_hash(3) }, { "c.txt", fake_hash(4) } }) == 1);
+    }
+
+    Timeline timeline(file_path);
+    assert(timeline.snapshots().size() == 4);
+    assert(timeline.num_paths() == 3);
+    string hash;
+    assert(!timeline.hash_at("a.txt", "20231231_235959", hash));
+    assert(timeline.hash_at("a.txt", "20240115_120000", hash) && hash == fake_hash(1));
+    assert(timeline.hash_at("b.txt", "20240115_120000", hash) && hash == fake_hash(2));
+    assert(timeline.hash_at("b.txt", "20240201_000000", hash) && hash == fake_hash(3));
+    assert(!timeline.hash_at("a.txt", "20240301_000000", hash));
+    assert(timeline.hash_at("a.txt", "20991231_000000", hash) && hash == fake_hash(5));
+    assert(!timeline.hash_at("c.txt", "20240201_000000", hash));
+    assert(!timeline.hash_at("missing.txt", "20240201_000000", hash));
+
+    vector<pair<string, string>> expect = {
+        { "20240101_000000", fake_hash(1) }, { "20240301_000000", "" }, { "20240401_000000", fake_hash(5) } };
+    assert(timeline.history("a.txt") == expect);
+
+    try
+    {
+        timeline.add_snapshot("20230101_000000", {});
+        assert(!"invalid_argument not thrown");
+    }
+    catch (const invalid_argument &)
+    {
+    }
+
+    // a torn record from an interrupted append is dropped before the next one
+    {
+        ofstream out(file_path, ios_base::binary | ios_base::app);
+        out.write("S\x20" "2024", 6);
+    }
+    {
+        Timeline torn(file_path);
+        assert(torn.snapshots().size() == 4);
+        assert(torn.add_snapshot("20240501_000000", { { "a.txt", fake_hash(6) } }) == 3);
+    }
+    Timeline reloaded(file_path);
+    assert(reloaded.snapshots().size() == 5);
+    assert(reloaded.hash_at("a.txt", "20240501_000000", hash) && hash == fake_hash(6));
+    assert(!reloaded.hash_at("b.txt", "20240501_000000", hash));
+
+    // a snapshot torn between its change records is dropped with all of them
+    uintmax_t before = filesystem::file_size(file_path);
+    assert(reloaded.add_snapshot("20240601_000000", { { "a.txt", fake_hash(7) }, { "b.txt", fake_hash(8) }, { "c.txt", fake_hash(9) } }) == 3);
+    size_t snapshot_record = 2 + 15 + 1, change_record = 2 + 5 + DIGEST_SIZE;
+    filesystem::resize_file(file_path, before + snapshot_record + change_record + 10);
+    {
+        Timeline torn(file_path);
+        assert(torn.snapshots().size() == 5);
+        assert(torn.hash_at("a.txt", "20240601_000000", hash) && hash == fake_hash(6));
+        assert(torn.history("a.txt").size() == 4);
+        assert(filesystem::file_size(file_path) == before);
+    }
+    filesystem::remove(file_path);
+}
+
+void test_csv_manifest_quoting()
+{
+    filesystem::path file_path = filesystem::temp_directory_path() / "FileArchiverQuoting.csv";
+    vector<file_hash> original = { { "plain.txt", "aaa" }, { "with space.txt", "bbb" }, { "comma,name.txt", "ccc" }, { "quote\"name.txt", "ddd" } };
+    write_csv_manifest(file_path, original);
+    vector<file_hash> loaded;
+    read_manifest(loaded, file_path.string());
+    assert(loaded.size() == original.size());
+    for (size_t i = 0; i < original.size(); i++)
+    {
+        assert(loaded[i].filename == original[i].filename && loaded[i].hash == original[i].hash);
+    }
+    filesystem::remove(file_path);
+}
+
+void test_binary_manifest()
+{
+    filesystem::path file_path = filesystem::temp_directory_path() / "FileArchiverManifest.mft";
+    vector<file_hash> original;
+    for (size_t i = 0; i < 100; i++)
+    {
+        original.push_back({ "dir_" + to_string(i % 7) + "/file, " + to_string(i) + ".txt", fake_hash(i) });
+    }
+    original.push_back({ "a", fake_hash(1000) });
+    original.push_back({ "a/b", fake_hash(1001) });
+    save_binary_manifest(file_path, original, 3);
+
+    BinaryManifest manifest(file_path);
+    assert(manifest.size() == original.size());
+    for (const auto &fh : original)
+    {
+        string hash;
+        assert(manifest.find(fh.filename, hash));
+        assert(hash == fh.hash);
+    }
+    assert(manifest.find("") == nullptr);
+    assert(manifest.find("dir_0") == nullptr);
+    assert(manifest.find("zzz") == nullptr);
+
+    vector<file_hash> loaded;
+    manifest.read(loaded);
+    assert(loaded.size() == original.size());
+    for (size_t i = 1; i < loaded.size(); i++)
+    {
+        assert(loaded[i - 1].filename < loaded[i].filename);
+    }
+
+    filesystem::path csv_path = filesystem::temp_directory_path() / "FileArchiverManifest.csv";
+    manifest.export_csv(csv_path);
+    vector<file_hash> exported;
+    read_manifest(exported, csv_path.string());
+    assert(exported.size() == loaded.size());
+    for (size_t i = 0; i < loaded.size(); i++)
+    {
+        assert(exported[i].filename == loaded[i].filename && exported[i].hash == loaded[i].hash);
+    }
+    filesystem::remove(csv_path);
+    filesystem::remove(file_path);
+
+    save_binary_manifest(file_path, {});
+    BinaryManifest empty(file_path);
+    assert(empty.size() == 0 && empty.find("a") == nullptr);
+    filesystem::remove(file_path);
+}
+
 void test_compare_manifest()
 {
     vector<file_hash> original = { { "a.txt", "aaa" }, { "b.txt", "bbb" }, { "sub_dir\\c.txt", "ccc" }, { "unchanged.txt", "unchanged" } };
@@ -271,6 +2418,201 @@ void test_compare_manifest()
     assert(changelog == expect);
 }
 
+void sweep_backup()
+{
+#if 0
+    size_t num_files = 10000, file_size = 256 * 1024;
+#else
+    size_t num_files = 200, file_size = 64 * 1024;
+#endif
+    test_setup();
+    string chunk(file_size, 'x');
+    for (size_t i = 0; i < num_files; i++)
+    {
+        ofstream f(to_string(i) + ".dat", ios_base::binary);
+        f << i << chunk;
+    }
+    for (size_t hash_threads : { 1, 2, 4, 8 })
+    {
+        vector<file_hash> manifest;
+        string manifest_filename;
+        BackupStats stats;
+        BackupOptions options;
+        options.hash_threads = hash_threads;
+        backup(files_path.string(), backup_path.string(), manifest, manifest_filename, &stats, options);
+        cout << "Backup of " << num_files << " files with " << hash_threads << " hash threads:" << endl;
+        stats.print(cout);
+        filesystem::remove_all(backup_path);
+    }
+    test_teardown();
+}
+
+void sweep_manifest()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 100000, 1000000, 10000000 };
+#else
+    vector<size_t> sizes = { 1000, 10000, 100000 };
+#endif
+    const size_t lookups = 100000;
+    filesystem::path csv_path = filesystem::temp_directory_path() / "FileArchiverSweep.csv";
+    filesystem::path mft_path = filesystem::temp_directory_path() / "FileArchiverSweep.mft";
+
+    cout << "Manifest load and lookup (times are in ms, " << lookups << " lookups)" << endl;
+    cout << "files\tcsv_MB\tmft_MB\tcsv_load\tcsv_find\tmft_load\tmft_find" << endl;
+    for (auto size : sizes)
+    {
+        vector<file_hash> manifest;
+        manifest.reserve(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            manifest.push_back({ "src/module_" + to_string(i / 1000) + "/part_" + to_string(i % 1000) + ".cpp", fake_hash(i) });
+        }
+        write_csv_manifest(csv_path, manifest);
+        save_binary_manifest(mft_path, manifest);
+        vector<string> probes;
+        for (size_t i = 0; i < lookups; i++)
+        {
+            probes.push_back(manifest[(i * 7919) % size].filename);
+        }
+        manifest.clear();
+        manifest.shrink_to_fit();
+
+        auto start = chrono::steady_clock::now();
+        vector<file_hash> loaded;
+        read_manifest(loaded, csv_path.string());
+        map<string, string> by_name;
+        for (const auto &fh : loaded)
+        {
+            by_name[fh.filename] = fh.hash;
+        }
+        auto csv_loaded = chrono::steady_clock::now();
+        size_t found = 0;
+        for (const auto &probe : probes)
+        {
+            found += by_name.count(probe);
+        }
+        auto csv_found = chrono::steady_clock::now();
+        assert(found == lookups);
+
+        {
+            BinaryManifest binary(mft_path);
+            auto mft_loaded = chrono::steady_clock::now();
+            found = 0;
+            for (const auto &probe : probes)
+            {
+                found += binary.find(probe) != nullptr;
+            }
+            auto mft_found = chrono::steady_clock::now();
+            assert(found == lookups);
+
+            cout << size << "\t" << filesystem::file_size(csv_path) / (1024.0 * 1024.0)
+                 << "\t" << filesystem::file_size(mft_path) / (1024.0 * 1024.0)
+                 << "\t" << (csv_loaded - start).count() * NANO_TO_MS
+                 << "\t" << (csv_found - csv_loaded).count() * NANO_TO_MS
+                 << "\t" << (mft_loaded - csv_found).count() * NANO_TO_MS
+                 << "\t" << (mft_found - mft_loaded).count() * NANO_TO_MS << endl;
+        }
+    }
+    filesystem::remove(csv_path);
+    filesystem::remove(mft_path);
+}
+
+void sweep_diff()
+{
+    const double NANO_TO_MS = 1.0 / 1000000.0;
+#if 0
+    vector<size_t> sizes = { 1000, 100000, 1000000, 10000000 };
+#else
+    vector<size_t> sizes = { 1000, 10000, 100000 };
+#endif
+    filesystem::path left_path = filesystem::temp_directory_path() / "FileArchiverSweepLeft.mft";
+    filesystem::path right_path = filesystem::temp_directory_path() / "FileArchiverSweepRight.mft";
+
+    cout << "Manifest diff, 1% each of updates, renames, deletions and additions (times are in ms)" << endl;
+    cout << "files\tchanges\tmaps\tmerge\tmerge_mft" << endl;
+    for (auto size : sizes)
+    {
+        vector<file_hash> left, right;
+        left.reserve(size);
+        right.reserve(size);
+        for (size_t i = 0; i < size; i++)
+        {
+            string filename = "src/module_" + to_string(i / 1000) + "/part_" + to_string(i % 1000) + ".cpp";
+            left.push_back({ filename, fake_hash(i) });
+            switch (i % 100)
+            {
+                case 0: break;
+                case 1: right.push_back({ filename, fake_hash(i + size) }); break;
+                case 2: right.push_back({ filename + ".old", fake_hash(i) }); break;
+                case 3: right.push_back({ filename, fake_hash(i) }); right.push_back({ filename + ".new", fake_hash(i + 2 * size) }); break;
+                default: right.push_back({ filename, fake_hash(i) }); break;
+            }
+        }
+        save_binary_manifest(left_path, left);
+        save_binary_manifest(right_path, right);
+
+        auto start = chrono::steady_clock::now();
+        vector<string> changelog;
+        compare_manifest(left, right, changelog);
+        auto maps_done = chrono::steady_clock::now();
+        size_t merged = diff_manifests(SortedManifest(left), SortedManifest(right), [](const ManifestChange &) {});
+        auto merge_done = chrono::steady_clock::now();
+        size_t merged_mft;
+        {
+            BinaryManifest left_manifest(left_path), right_manifest(right_path);
+            merged_mft = diff_manifests(left_manifest, right_manifest, [](const ManifestChange &) {});
+        }
+        auto merge_mft_done = chrono::steady_clock::now();
+        assert(merged == changelog.size() && merged_mft == changelog.size());
+
+        cout << size << "\t" << changelog.size()
+             << "\t" << (maps_done - start).count() * NANO_TO_MS
+             << "\t" << (merge_done - maps_done).count() * NANO_TO_MS
+             << "\t" << (merge_mft_done - merge_done).count() * NANO_TO_MS << endl;
+    }
+    filesystem::remove(left_path);
+    filesystem::remove(right_path);
+}
+
+void sweep_restore()
+{
+#if 0
+    size_t num_files = 10000, file_size = 256 * 1024;
+#else
+    size_t num_files = 200, file_size = 64 * 1024;
+#endif
+    test_setup();
+    string chunk(file_size, 'x');
+    for (size_t i = 0; i < num_files; i++)
+    {
+        ofstream f(to_string(i) + ".dat", ios_base::binary);
+        f << i << chunk;
+    }
+    vector<file_hash> manifest;
+    string manifest_filename;
+    backup(files_path.string(), backup_path.string(), manifest, manifest_filename);
+
+    filesystem::path restore_path = filesystem::temp_directory_path() / "FileArchiverRestore";
+    for (size_t threads : { 1, 2, 4, 8 })
+    {
+        filesystem::remove_all(restore_path);
+        RestoreStats stats;
+        RestoreOptions options;
+        options.threads = threads;
+        restore(manifest_filename, restore_path.string(), &stats, options);
+        cout << threads << " threads: ";
+        stats.print(cout);
+    }
+    RestoreStats stats;
+    restore(manifest_filename, restore_path.string(), &stats);
+    cout << "resumed: ";
+    stats.print(cout);
+    filesystem::remove_all(restore_path);
+    test_teardown();
+}
+
 void archiver_main()
 {
     cout << "File Archiver:" << endl;
@@ -281,7 +2623,20 @@ void archiver_main()
     test_hashing();
     test_change();
     test_backup();
+    test_backup_pipeline();
+    test_copy_file_fast();
+    test_restore();
+    test_compression();
+    test_timeline();
+    test_csv_manifest_quoting();
+    test_binary_manifest();
     test_compare_manifest();
+    test_diff_manifests();
+    test_diff_binary_manifests();
 
     cout << "All tests passed" << endl;
+    //sweep_backup();
+    //sweep_manifest();
+    //sweep_diff();
+    //sweep_restore();
 }
\ No newline at end of file
@@ -0,0 +1,316 @@
+// Platform specific file helpers, used by FileArchiver.cpp and Database.cpp
+
+#include "FileUtils.h"
+
+#include <errno.h>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+AppendFile::~AppendFile()
+{
+    close();
+}
+
+void AppendFile::open(const filesystem::path &file_path)
+{
+    close();
+    HANDLE file = CreateFileW(file_path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw runtime_error("can't open " + file_path.string());
+    }
+    handle = file;
+}
+
+void AppendFile::close()
+{
+    if (handle)
+    {
+        CloseHandle(handle);
+        handle = nullptr;
+    }
+}
+
+bool AppendFile::is_open() const
+{
+    return handle != nullptr;
+}
+
+void AppendFile::write(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        DWORD chunk = (DWORD)min<size_t>(length, 1 << 30), written = 0;
+        if (!WriteFile(handle, data, chunk, &written, NULL))
+        {
+            throw runtime_error("write failed: " + to_string(GetLastError()));
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void AppendFile::sync()
+{
+    if (!FlushFileBuffers(handle))
+    {
+        throw runtime_error("sync failed: " + to_string(GetLastError()));
+    }
+}
+
+uintmax_t copy_file_fast(const filesystem::path &source, const filesystem::path &target)
+{
+    if (!CopyFileW(source.c_str(), target.c_str(), FALSE))
+    {
+        throw runtime_error("can't copy " + source.string() + " to " + target.string());
+    }
+    return filesystem::file_size(target);
+}
+
+void sync_directory(const filesystem::path &dir_path)
+{
+}
+
+#else
+
+namespace
+{
+    // Closes the descriptor when leaving scope.
+    struct FileDescriptor
+    {
+        int fd;
+        FileDescriptor(int fd) : fd(fd) {}
+        ~FileDescriptor()
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    };
+
+    // Plain read/write loop, for file systems that can't do copy_file_range.
+    uintmax_t copy_range_buffered(int in, int out, off_t offset, off_t end)
+    {
+        vector<char> buffer(1024 * 1024);
+        uintmax_t copied = 0;
+        while (offset < end)
+        {
+            size_t wanted = (size_t)min<off_t>(end - offset, (off_t)buffer.size());
+            ssize_t bytes_read = pread(in, buffer.data(), wanted, offset);
+            if (bytes_read < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_read < 0)
+            {
+                throw runtime_error("read failed: " + to_string(errno));
+            }
+            if (bytes_read == 0)
+            {
+                // the size came from fstat, a shorter file would be padded with zeros
+                throw runtime_error("source ended early");
+            }
+            for (ssize_t written = 0; written < bytes_read;)
+            {
+                ssize_t n = pwrite(out, buffer.data() + written, bytes_read - written, offset + written);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0)
+                {
+                    throw runtime_error("write failed: " + to_string(errno));
+                }
+                written += n;
+            }
+            offset += bytes_read;
+            copied += bytes_read;
+        }
+        return copied;
+    }
+
+    uintmax_t copy_range(int in, int out, off_t offset, off_t end)
+    {
+        uintmax_t copied = 0;
+#ifdef __linux__
+        while (offset < end)
+        {
+            off_t in_offset = offset, out_offset = offset;
+            ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, (size_t)(end - offset), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                break;
+            }
+            if (n < 0)
+            {
+                throw runtime_error("copy_file_range failed: " + to_string(errno));
+            }
+            if (n == 0)
+            {
+                throw runtime_error("source ended early");
+            }
+            offset += n;
+            copied += n;
+        }
+#endif
+        return copied + copy_range_buffered(in, out, offset, end);
+    }
+}
+
+AppendFile::~AppendFile()
+{
+    close();
+}
+
+void AppendFile::open(const filesystem::path &file_path)
+{
+    close();
+    fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        throw runtime_error("can't open " + file_path.string());
+    }
+}
+
+void AppendFile::close()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+bool AppendFile::is_open() const
+{
+    return fd >= 0;
+}
+
+void AppendFile::write(const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0)
+        {
+            throw runtime_error("write failed: " + to_string(errno));
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void AppendFile::sync()
+{
+#ifdef __APPLE__
+    int result = fsync(fd);
+#else
+    int result = fdatasync(fd);
+#endif
+    if (result != 0)
+    {
+        throw runtime_error("sync failed: " + to_string(errno));
+    }
+}
+
+uintmax_t copy_file_fast(const filesystem::path &source, const filesystem::path &target)
+{
+    FileDescriptor in(open(source.c_str(), O_RDONLY));
+    if (in.fd < 0)
+    {
+        throw runtime_error("can't open " + source.string());
+    }
+    struct stat info;
+    if (fstat(in.fd, &info) != 0)
+    {
+        throw runtime_error("can't get size of " + source.string());
+    }
+    FileDescriptor out(open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    if (out.fd < 0)
+    {
+        throw runtime_error("can't create " + target.string());
+    }
+
+    off_t size = info.st_size;
+#ifdef SEEK_HOLE
+    off_t first_hole = lseek(in.fd, 0, SEEK_HOLE);
+    bool sparse = first_hole >= 0 && first_hole < size;
+#else
+    bool sparse = false;
+#endif
+#ifdef __linux__
+    // a sparse source would be filled in by preallocation, so only dense files get it
+    if (!sparse && size > 0)
+    {
+        fallocate(out.fd, 0, 0, size);
+    }
+#endif
+
+    uintmax_t copied = 0;
+    off_t offset = 0;
+    while (offset < size)
+    {
+        off_t data = offset, hole = size;
+#ifdef SEEK_HOLE
+        if (sparse)
+        {
+            data = lseek(in.fd, offset, SEEK_DATA);
+            if (data < 0)
+            {
+                break;      // only a hole is left
+            }
+            hole = lseek(in.fd, data, SEEK_HOLE);
+            if (hole < 0)
+            {
+                hole = size;
+            }
+        }
+#endif
+        copied += copy_range(in.fd, out.fd, data, hole);
+        offset = hole;
+    }
+    if (ftruncate(out.fd, size) != 0)
+    {
+        throw runtime_error("can't set size of " + target.string());
+    }
+    return copied;
+}
+
+void sync_directory(const filesystem::path &dir_path)
+{
+    FileDescriptor dir(open(dir_path.empty() ? "." : dir_path.c_str(), O_RDONLY));
+    if (dir.fd < 0)
+    {
+        throw runtime_error("can't open " + dir_path.string());
+    }
+    if (fsync(dir.fd) != 0)
+    {
+        throw runtime_error("sync failed: " + to_string(errno));
+    }
+}
+
+#endif
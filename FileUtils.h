@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// requires: /std:c++17
+#include <filesystem>
+
+using namespace std;
+
+// Copies source over target and returns the number of data bytes copied.
+// The copy stays inside the kernel where the platform allows it: on Linux the
+// target is preallocated with fallocate and filled with copy_file_range, and
+// holes in a sparse source are kept as holes instead of being written out.
+// On Windows CopyFileW does the equivalent. Throws runtime_error on failure,
+// which includes a source that gets shorter while it is copied.
+uintmax_t copy_file_fast(const filesystem::path &source, const filesystem::path &target);
+
+// Makes renames and removals of entries in dir_path durable (fsync on the
+// directory on POSIX). A no-op on Windows, where NTFS journals these itself.
+// Throws runtime_error on failure.
+void sync_directory(const filesystem::path &dir_path);
+
+// File opened for appending, with an explicit sync to make what was written
+// durable (fdatasync on POSIX, FlushFileBuffers on Windows). Used for logs.
+class AppendFile
+{
+public:
+    AppendFile() = default;
+    ~AppendFile();
+
+    AppendFile(const AppendFile &) = delete;
+    AppendFile &operator=(const AppendFile &) = delete;
+
+    // Opens (creating if needed) file_path for appending. Throws runtime_error.
+    void open(const filesystem::path &file_path);
+    void close();
+    bool is_open() const;
+
+    // Writes everything or throws runtime_error.
+    void write(const char *data, size_t length);
+    void sync();
+
+private:
+#ifdef _WIN32
+    void *handle = nullptr;
+#else
+    int fd = -1;
+#endif
+};
@@ -9,6 +9,7 @@
 #include <vector>
 #include <utility>
 #include <unordered_map>
+#include <atomic>
 
 // requires: /std:c++17
 #include <filesystem>
@@ -169,13 +170,16 @@ void duplicate_with_naive_hash()
     }
 }
 
-int histogram[256];
+// atomic because sha_hash may be called concurrently (see FileArchiver.cpp)
+atomic<int> histogram[256];
 
 // Based on: https://stackoverflow.com/questions/2262386/generate-sha256-with-openssl-and-c/10632725
 string sha_hash(const string &filename)
 {
+    // each thread hashes into its own buffer, the shared left_buf is not safe here
+    thread_local vector<char> hash_buf(BUFSIZE);
     ifstream file(filename, ios_base::binary);
-    
+
     EVP_MD_CTX *mdCtx = EVP_MD_CTX_new();
     unsigned char mdVal[EVP_MAX_MD_SIZE], *md;
     unsigned int mdLen, i;
@@ -191,11 +195,11 @@ string sha_hash(const string &filename)
     {
         while (!file.eof())
         {
-            file.read(left_buf, BUFSIZE);
+            file.read(hash_buf.data(), BUFSIZE);
             streamsize bytes_read = file.gcount();
            
             // Hashes cnt bytes of data at d into the digest context mdCtx
-            if (!EVP_DigestUpdate(mdCtx, left_buf, bytes_read))
+            if (!EVP_DigestUpdate(mdCtx, hash_buf.data(), bytes_read))
             {
                 printf("Message digest update failed.\n");
                 EVP_MD_CTX_free(mdCtx);
@@ -0,0 +1,163 @@
+// Memory mapped files, used by FileArchiver.cpp, Database.cpp and BuildManager.cpp
+
+#include "MappedFile.h"
+
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const filesystem::path &file_path)
+{
+    open(file_path);
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+{
+    swap(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        swap(other);
+    }
+    return *this;
+}
+
+void MappedFile::swap(MappedFile &other) noexcept
+{
+    std::swap(view, other.view);
+    std::swap(length, other.length);
+    std::swap(opened, other.opened);
+#ifdef _WIN32
+    std::swap(file_handle, other.file_handle);
+    std::swap(mapping_handle, other.mapping_handle);
+#else
+    std::swap(fd, other.fd);
+#endif
+}
+
+#ifdef _WIN32
+
+void MappedFile::open(const filesystem::path &file_path)
+{
+    close();
+    HANDLE file = CreateFileW(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        throw runtime_error("can't open " + file_path.string());
+    }
+    file_handle = file;
+    opened = true;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size))
+    {
+        close();
+        throw runtime_error("can't get size of " + file_path.string());
+    }
+    length = (size_t)file_size.QuadPart;
+    if (length == 0)
+    {
+        return;
+    }
+    mapping_handle = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping_handle == NULL)
+    {
+        close();
+        throw runtime_error("can't map " + file_path.string());
+    }
+    view = (const char *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        close();
+        throw runtime_error("can't map " + file_path.string());
+    }
+}
+
+void MappedFile::close()
+{
+    if (view)
+    {
+        UnmapViewOfFile(view);
+    }
+    if (mapping_handle)
+    {
+        CloseHandle(mapping_handle);
+    }
+    if (file_handle)
+    {
+        CloseHandle(file_handle);
+    }
+    view = nullptr;
+    mapping_handle = nullptr;
+    file_handle = nullptr;
+    length = 0;
+    opened = false;
+}
+
+#else
+
+void MappedFile::open(const filesystem::path &file_path)
+{
+    close();
+    fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw runtime_error("can't open " + file_path.string());
+    }
+    opened = true;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close();
+        throw runtime_error("can't get size of " + file_path.string());
+    }
+    length = (size_t)info.st_size;
+    if (length == 0)
+    {
+        return;
+    }
+    void *mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        close();
+        throw runtime_error("can't map " + file_path.string());
+    }
+    view = (const char *)mapping;
+}
+
+void MappedFile::close()
+{
+    if (view)
+    {
+        munmap((void *)view, length);
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    view = nullptr;
+    fd = -1;
+    length = 0;
+    opened = false;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+
+// requires: /std:c++17
+#include <filesystem>
+
+using namespace std;
+
+// Read-only memory mapping of a whole file. Shared by the chapters that keep
+// large on-disk structures (manifests, record stores, build caches) and want
+// to read them in place instead of parsing them into memory first.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const filesystem::path &file_path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    // Maps file_path, replacing any previous mapping. Throws runtime_error if
+    // the file can't be opened. An empty file maps to data() == nullptr.
+    void open(const filesystem::path &file_path);
+    void close();
+
+    bool is_open() const { return opened; }
+    const char *data() const { return view; }
+    size_t size() const { return length; }
+
+private:
+    const char *view = nullptr;
+    size_t length = 0;
+    bool opened = false;
+#ifdef _WIN32
+    void *file_handle = nullptr;
+    void *mapping_handle = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    void swap(MappedFile &other) noexcept;
+};
@@ -12,6 +12,7 @@ void profiling_main();
 void persist_main();
 void binary_main();
 void database_main();
+void database_benchmark_main();
 void build_main();
 
 int main()
@@ -30,6 +31,7 @@ int main()
     //persist_main();
     //binary_main();
     //database_main();
+    //database_benchmark_main();
     build_main();
     return 0;
 }